@@ -0,0 +1,501 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2022  Panasonic Automotive Systems, Co., Ltd.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <linux/virtio_config.h>
+#include <linux/virtio_ring.h>
+
+#include "libvirtio_lo.h"
+#include "virtio_lo_bench.h"
+
+/* Backend of the virtio_lo_bench driver: serves the benchmark device from
+ * one thread per queue and drives runs over a range of parameters through
+ * the debugfs files of the driver. */
+
+#define BENCH_DEBUGFS "/sys/kernel/debug/virtio-lo-bench"
+#define BENCH_QUEUE_SIZE 256
+#define BENCH_BATCH 32
+#define BENCH_MAX_LIST 16
+
+enum bench_mode {
+	/* wait for kicks on the eventfd, interrupt through the call eventfd */
+	BENCH_MODE_EVENTFD,
+	/* same, but interrupt with VIRTIO_LO_KICK */
+	BENCH_MODE_IOCTL,
+	/* spin on the avail rings with driver notifications disabled */
+	BENCH_MODE_BUSY,
+};
+
+static const char *const bench_mode_names[] = {
+	[BENCH_MODE_EVENTFD] = "eventfd",
+	[BENCH_MODE_IOCTL] = "ioctl",
+	[BENCH_MODE_BUSY] = "busy",
+};
+
+struct bench_list {
+	unsigned n;
+	unsigned v[BENCH_MAX_LIST];
+};
+
+struct bench_opts {
+	struct bench_list queues;
+	struct bench_list depths;
+	struct bench_list batches;
+	unsigned size;
+	unsigned msecs;
+	enum bench_mode mode;
+	bool no_event_idx;
+	bool window;
+};
+
+struct bench_queue {
+	struct bench *b;
+	struct vilo_vq *vq;
+	pthread_t thread;
+};
+
+struct bench {
+	const struct bench_opts *opts;
+	int fd;
+	struct vilo_dev *dev;
+	struct bench_queue *queues;
+	unsigned nqueues;
+	volatile bool stop;
+};
+
+struct bench_result {
+	uint64_t requests;
+	uint64_t duration_ns;
+	uint64_t kicks;
+	uint64_t callbacks;
+	uint64_t lat_p50;
+	uint64_t lat_p90;
+	uint64_t lat_p99;
+	uint64_t lat_p999;
+	uint64_t lat_max;
+};
+
+static void bench_serve(struct vilo_vq *vq, void *opaque)
+{
+	struct bench_queue *q = opaque;
+	struct vilo_elem elems[BENCH_BATCH];
+	int n, i;
+
+	while ((n = vilo_vq_pop_batch(vq, elems, BENCH_BATCH)) > 0) {
+		for (i = 0; i < n; i++) {
+			struct iovec *status = &elems[i].iov[elems[i].out_num];
+
+			if (elems[i].in_num && status->iov_len >= 4) {
+				*(uint32_t *)status->iov_base = 0;
+			}
+			vilo_vq_push(vq, &elems[i], 4);
+		}
+		if (q->b->opts->mode == BENCH_MODE_IOCTL) {
+			if (vilo_vq_publish(vq)) {
+				struct virtio_lo_kick k = {
+					.idx = vilo_dev_idx(q->b->dev),
+					.qidx = vilo_vq_qidx(vq),
+				};
+
+				ioctl(q->b->fd, VIRTIO_LO_KICK, &k);
+			}
+		} else {
+			vilo_vq_flush(vq);
+		}
+	}
+	if (n < 0) {
+		fprintf(stderr, "queue %u: malformed request\n",
+			vilo_vq_qidx(vq));
+		q->b->stop = true;
+	}
+}
+
+static void *bench_thread(void *arg)
+{
+	struct bench_queue *q = arg;
+	struct vilo_loop *loop;
+
+	if (q->b->opts->mode == BENCH_MODE_BUSY) {
+		vilo_vq_disable_notify(q->vq);
+		while (!q->b->stop) {
+			bench_serve(q->vq, q);
+		}
+		return NULL;
+	}
+
+	loop = vilo_loop_create();
+	if (!loop) {
+		perror("vilo_loop_create");
+		return NULL;
+	}
+	if (vilo_loop_add(loop, q->vq, bench_serve, q)) {
+		fprintf(stderr, "cannot serve queue %u\n", vilo_vq_qidx(q->vq));
+	} else {
+		while (!q->b->stop) {
+			vilo_loop_run_once(loop, 100);
+		}
+	}
+	vilo_loop_destroy(loop);
+	return NULL;
+}
+
+static void bench_stop(struct bench *b)
+{
+	unsigned i;
+
+	b->stop = true;
+	for (i = 0; i < b->nqueues; i++) {
+		pthread_join(b->queues[i].thread, NULL);
+	}
+	free(b->queues);
+	b->queues = NULL;
+	vilo_dev_destroy(b->dev);
+	b->dev = NULL;
+}
+
+static int bench_start(struct bench *b, unsigned nqueues)
+{
+	const struct bench_opts *o = b->opts;
+	struct virtio_lo_bench_config config = {
+		.id = getpid(),
+		.nqueues = nqueues,
+	};
+	struct vilo_dev_params p = {
+		.device_id = VIRTIO_LO_BENCH_DEVICE_ID,
+		.vendor_id = 0,
+		.features = 1ULL << VIRTIO_F_VERSION_1 |
+			    1ULL << VIRTIO_RING_F_INDIRECT_DESC,
+		.nqueues = nqueues,
+		.queue_size = BENCH_QUEUE_SIZE,
+		.card_index = -1,
+		.config = &config,
+		.config_size = sizeof(config),
+	};
+	unsigned i;
+
+	/* busy polling relies on VRING_USED_F_NO_NOTIFY */
+	if (!o->no_event_idx && o->mode != BENCH_MODE_BUSY) {
+		p.features |= 1ULL << VIRTIO_RING_F_EVENT_IDX;
+	}
+	if (o->window) {
+		p.flags = VIRTIO_LO_F_WINDOW;
+	} else {
+		p.flags = VIRTIO_LO_F_POOL;
+		/* rings and every request bounced, with room to spare */
+		p.pool_size = (uint64_t)nqueues * BENCH_QUEUE_SIZE *
+				      (o->size + 256) * 2 +
+			      (16 << 20);
+		p.pool_size = (p.pool_size + 4095) & ~4095ULL;
+	}
+
+	b->dev = vilo_dev_create(b->fd, &p);
+	if (!b->dev) {
+		perror("vilo_dev_create");
+		return -1;
+	}
+	b->nqueues = nqueues;
+	b->stop = false;
+	b->queues = calloc(nqueues, sizeof(*b->queues));
+	if (!b->queues) {
+		vilo_dev_destroy(b->dev);
+		return -1;
+	}
+	for (i = 0; i < nqueues; i++) {
+		b->queues[i].b = b;
+		b->queues[i].vq = vilo_dev_vq(b->dev, i);
+		if (pthread_create(&b->queues[i].thread, NULL, bench_thread,
+				   &b->queues[i])) {
+			fprintf(stderr, "cannot start queue threads\n");
+			b->nqueues = i;
+			bench_stop(b);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* CPU time the system has spent outside of idle, in clock ticks */
+static int bench_cpu_ticks(uint64_t *busy)
+{
+	unsigned long long v[8] = { 0 };
+	FILE *f;
+	int n;
+
+	f = fopen("/proc/stat", "r");
+	if (!f) {
+		return -1;
+	}
+	n = fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &v[0],
+		   &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]);
+	fclose(f);
+	if (n < 4) {
+		return -1;
+	}
+	/* all but idle and iowait */
+	*busy = v[0] + v[1] + v[2] + v[5] + v[6] + v[7];
+	return 0;
+}
+
+static uint64_t bench_rusage_ns(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+	       (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+static int bench_parse_result(const char *buf, struct bench_result *r)
+{
+	static const struct {
+		const char *key;
+		size_t offset;
+	} keys[] = {
+		{ "requests", offsetof(struct bench_result, requests) },
+		{ "duration_ns", offsetof(struct bench_result, duration_ns) },
+		{ "kicks", offsetof(struct bench_result, kicks) },
+		{ "callbacks", offsetof(struct bench_result, callbacks) },
+		{ "lat_p50_ns", offsetof(struct bench_result, lat_p50) },
+		{ "lat_p90_ns", offsetof(struct bench_result, lat_p90) },
+		{ "lat_p99_ns", offsetof(struct bench_result, lat_p99) },
+		{ "lat_p999_ns", offsetof(struct bench_result, lat_p999) },
+		{ "lat_max_ns", offsetof(struct bench_result, lat_max) },
+	};
+	char key[32];
+	uint64_t value;
+	unsigned i;
+	int len;
+
+	memset(r, 0, sizeof(*r));
+	while (sscanf(buf, "%31s %" SCNu64 "\n%n", key, &value, &len) == 2) {
+		for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+			if (!strcmp(key, keys[i].key)) {
+				*(uint64_t *)((char *)r + keys[i].offset) = value;
+			}
+		}
+		buf += len;
+	}
+	return r->requests ? 0 : -1;
+}
+
+static int bench_run(struct bench *b, unsigned depth, unsigned batch,
+		     struct bench_result *r, double *cpu_ns, double *backend_ns)
+{
+	uint64_t busy0 = 0, busy1 = 0, self0;
+	char path[64], buf[512];
+	ssize_t len;
+	int fd, ret = -1;
+
+	snprintf(path, sizeof(path), BENCH_DEBUGFS "/%u/run",
+		 (unsigned)getpid());
+	fd = open(path, O_RDWR);
+	if (fd == -1) {
+		fprintf(stderr,
+			"%s: %s\n(is virtio_lo_bench loaded and debugfs "
+			"mounted?)\n",
+			path, strerror(errno));
+		return -1;
+	}
+
+	len = snprintf(buf, sizeof(buf), "%u %u %u %u", depth, batch,
+		       b->opts->msecs, b->opts->size);
+	bench_cpu_ticks(&busy0);
+	self0 = bench_rusage_ns();
+	if (write(fd, buf, len) != len) {
+		perror("run");
+		goto out;
+	}
+	bench_cpu_ticks(&busy1);
+	*backend_ns = bench_rusage_ns() - self0;
+
+	len = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0) {
+		perror("result");
+		goto out;
+	}
+	buf[len] = '\0';
+	if (bench_parse_result(buf, r)) {
+		fprintf(stderr, "no request completed\n");
+		goto out;
+	}
+	*cpu_ns = (double)(busy1 - busy0) * 1e9 / sysconf(_SC_CLK_TCK);
+	*cpu_ns /= r->requests;
+	*backend_ns /= r->requests;
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
+
+static void bench_print_header(void)
+{
+	printf("%-8s %6s %5s %5s %10s %8s %8s %8s %8s %8s %6s %6s %8s %8s\n",
+	       "mode", "queues", "depth", "batch", "req/s", "p50_us", "p90_us",
+	       "p99_us", "p999_us", "max_us", "kick/r", "irq/r", "cpu_ns/r",
+	       "be_ns/r");
+}
+
+static void bench_print(const struct bench *b, unsigned depth, unsigned batch,
+			const struct bench_result *r, double cpu_ns,
+			double backend_ns)
+{
+	double n = r->requests;
+
+	printf("%-8s %6u %5u %5u %10.0f %8.1f %8.1f %8.1f %8.1f %8.1f %6.3f "
+	       "%6.3f %8.0f %8.0f\n",
+	       bench_mode_names[b->opts->mode], b->nqueues, depth, batch,
+	       n * 1e9 / r->duration_ns, r->lat_p50 / 1e3, r->lat_p90 / 1e3,
+	       r->lat_p99 / 1e3, r->lat_p999 / 1e3, r->lat_max / 1e3,
+	       r->kicks / n, r->callbacks / n, cpu_ns, backend_ns);
+	fflush(stdout);
+}
+
+static int bench_parse_list(const char *s, struct bench_list *l)
+{
+	char *end;
+
+	l->n = 0;
+	do {
+		unsigned long v = strtoul(s, &end, 0);
+
+		if (end == s || !v || l->n == BENCH_MAX_LIST) {
+			return -1;
+		}
+		l->v[l->n++] = v;
+		s = end + 1;
+	} while (*end == ',');
+	return *end ? -1 : 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -q LIST   numbers of queues (1)\n"
+		"  -d LIST   requests in flight per queue (1,8,32)\n"
+		"  -b LIST   requests per driver notification (1)\n"
+		"  -s SIZE   payload of a request in bytes (64)\n"
+		"  -t MSECS  duration of each run (1000)\n"
+		"  -m MODE   eventfd, ioctl or busy (eventfd)\n"
+		"  -E        do not offer VIRTIO_RING_F_EVENT_IDX\n"
+		"  -w        use VIRTIO_LO_F_WINDOW instead of a pool\n"
+		"LIST is a comma separated list, every combination is run.\n"
+		"The virtio_lo_bench module has to be loaded and debugfs "
+		"mounted.\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_opts o = {
+		.queues = { 1, { 1 } },
+		.depths = { 3, { 1, 8, 32 } },
+		.batches = { 1, { 1 } },
+		.size = 64,
+		.msecs = 1000,
+		.mode = BENCH_MODE_EVENTFD,
+	};
+	struct bench b = { .opts = &o };
+	unsigned qi, di, bi;
+	int opt, ret = EXIT_SUCCESS;
+
+	while ((opt = getopt(argc, argv, "q:d:b:s:t:m:Ewh")) != -1) {
+		switch (opt) {
+		case 'q':
+			if (bench_parse_list(optarg, &o.queues)) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'd':
+			if (bench_parse_list(optarg, &o.depths)) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'b':
+			if (bench_parse_list(optarg, &o.batches)) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 's':
+			o.size = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			o.msecs = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			for (o.mode = 0; o.mode <= BENCH_MODE_BUSY; o.mode++) {
+				if (!strcmp(optarg, bench_mode_names[o.mode])) {
+					break;
+				}
+			}
+			if (o.mode > BENCH_MODE_BUSY) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'E':
+			o.no_event_idx = true;
+			break;
+		case 'w':
+			o.window = true;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	b.fd = open("/dev/virtio-lo", O_RDWR);
+	if (b.fd == -1) {
+		perror("/dev/virtio-lo");
+		return EXIT_FAILURE;
+	}
+
+	bench_print_header();
+	for (qi = 0; qi < o.queues.n && ret == EXIT_SUCCESS; qi++) {
+		if (bench_start(&b, o.queues.v[qi])) {
+			ret = EXIT_FAILURE;
+			break;
+		}
+		for (di = 0; di < o.depths.n && ret == EXIT_SUCCESS; di++) {
+			for (bi = 0; bi < o.batches.n; bi++) {
+				unsigned depth = o.depths.v[di];
+				unsigned batch = o.batches.v[bi];
+				struct bench_result r;
+				double cpu_ns, backend_ns;
+
+				if (batch > depth) {
+					continue;
+				}
+				if (bench_run(&b, depth, batch, &r, &cpu_ns,
+					      &backend_ns)) {
+					ret = EXIT_FAILURE;
+					break;
+				}
+				bench_print(&b, depth, batch, &r, cpu_ns,
+					    backend_ns);
+			}
+		}
+		bench_stop(&b);
+	}
+
+	close(b.fd);
+	return ret;
+}
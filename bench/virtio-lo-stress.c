@@ -0,0 +1,465 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2022  Panasonic Automotive Systems, Co., Ltd.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "virtio_lo.h"
+#include "virtio_lo_bench.h"
+
+/* Scale test of the owner and device management: for every thread count,
+ * as many threads create and delete devices over several owners each while
+ * as many other threads kick the queues of devices of their own. Prints
+ * the throughput and latency of creation, deletion and kicks, and the time
+ * it takes to close an owner with its remaining devices. */
+
+#define STRESS_QUEUE_SIZE 256
+/* ADDDEV fails with ENOENT unless a driver reaches DRIVER_OK */
+#define STRESS_BENCH_DRIVER "/sys/bus/virtio/drivers/virtio_lo_bench"
+#define STRESS_MAX_LIST 16
+
+/* same layout as the histograms of the benchmark driver */
+#define STRESS_HIST_SUB_BITS 5
+#define STRESS_HIST_SUB (1U << STRESS_HIST_SUB_BITS)
+#define STRESS_HIST_SIZE ((64 - STRESS_HIST_SUB_BITS + 1) * STRESS_HIST_SUB)
+
+struct stress_list {
+	unsigned n;
+	unsigned v[STRESS_MAX_LIST];
+};
+
+struct stress_opts {
+	struct stress_list threads;
+	unsigned owners;
+	unsigned devices;
+	unsigned nqueues;
+	unsigned secs;
+	uint32_t device_id;
+	bool direct;
+	bool kicks;
+};
+
+struct stress_lat {
+	uint64_t count;
+	uint64_t max;
+	uint32_t hist[STRESS_HIST_SIZE];
+};
+
+struct stress {
+	const struct stress_opts *opts;
+	volatile bool stop;
+	pthread_barrier_t start;
+	uint32_t next_id;
+};
+
+struct stress_thread {
+	struct stress *s;
+	pthread_t thread;
+	struct stress_lat add;
+	struct stress_lat del;
+	struct stress_lat close;
+	struct stress_lat kick;
+	uint64_t errors;
+};
+
+static unsigned stress_hist_idx(uint64_t v)
+{
+	unsigned shift;
+
+	if (v < STRESS_HIST_SUB) {
+		return v;
+	}
+	shift = 63 - __builtin_clzll(v) - STRESS_HIST_SUB_BITS;
+	return (shift + 1) * STRESS_HIST_SUB + (v >> shift) - STRESS_HIST_SUB;
+}
+
+static uint64_t stress_hist_value(unsigned idx)
+{
+	unsigned shift;
+
+	if (idx < STRESS_HIST_SUB) {
+		return idx;
+	}
+	shift = idx / STRESS_HIST_SUB - 1;
+	return (uint64_t)(idx % STRESS_HIST_SUB + STRESS_HIST_SUB) << shift;
+}
+
+static uint64_t stress_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void stress_lat_add(struct stress_lat *l, uint64_t start)
+{
+	uint64_t v = stress_now() - start;
+
+	l->count++;
+	l->hist[stress_hist_idx(v)]++;
+	if (v > l->max) {
+		l->max = v;
+	}
+}
+
+static void stress_lat_merge(struct stress_lat *to, const struct stress_lat *l)
+{
+	unsigned i;
+
+	to->count += l->count;
+	if (l->max > to->max) {
+		to->max = l->max;
+	}
+	for (i = 0; i < STRESS_HIST_SIZE; i++) {
+		to->hist[i] += l->hist[i];
+	}
+}
+
+static double stress_lat_us(const struct stress_lat *l, unsigned permille)
+{
+	uint64_t target = (l->count * permille + 999) / 1000;
+	uint64_t sum = 0;
+	unsigned i;
+
+	for (i = 0; i < STRESS_HIST_SIZE; i++) {
+		sum += l->hist[i];
+		if (sum && sum >= target) {
+			return stress_hist_value(i) / 1e3;
+		}
+	}
+	return 0;
+}
+
+static int stress_adddev(struct stress *s, int fd, unsigned *idx)
+{
+	const struct stress_opts *o = s->opts;
+	struct virtio_lo_qinfo qi[o->nqueues];
+	struct virtio_lo_bench_config config = {
+		.id = __atomic_fetch_add(&s->next_id, 1, __ATOMIC_RELAXED),
+		.nqueues = o->nqueues,
+	};
+	struct virtio_lo_devinfo di = {
+		.device_id = o->device_id,
+		.nqueues = o->nqueues,
+		.config_size = sizeof(config),
+		.config_kick = -1,
+		.card_index = -1,
+		.flags = o->direct ? VIRTIO_LO_F_DIRECT : 0,
+		.config = (uint8_t *)&config,
+		.qinfo = qi,
+		.done_fd = -1,
+	};
+	unsigned i;
+
+	for (i = 0; i < o->nqueues; i++) {
+		qi[i] = (struct virtio_lo_qinfo){
+			.kickfd = -1,
+			.callfd = -1,
+			.size = STRESS_QUEUE_SIZE,
+		};
+	}
+	if (ioctl(fd, VIRTIO_LO_ADDDEV, &di) < 0) {
+		return -errno;
+	}
+	*idx = di.idx;
+	return 0;
+}
+
+/* Creates and deletes devices over opts->owners owners, keeping up to
+ * opts->devices devices alive on each of them */
+static void *stress_churn(void *arg)
+{
+	struct stress_thread *t = arg;
+	const struct stress_opts *o = t->s->opts;
+	unsigned (*alive)[o->devices] = calloc(o->owners, sizeof(*alive));
+	unsigned *first = calloc(o->owners, sizeof(*first));
+	unsigned *n = calloc(o->owners, sizeof(*n));
+	int *fds = calloc(o->owners, sizeof(*fds));
+	unsigned i, owner = 0;
+	uint64_t start;
+
+	for (i = 0; fds && i < o->owners; i++) {
+		fds[i] = open("/dev/virtio-lo", O_RDWR);
+		if (fds[i] == -1) {
+			perror("/dev/virtio-lo");
+			t->errors++;
+		}
+	}
+	pthread_barrier_wait(&t->s->start);
+	if (!alive || !first || !n || !fds || t->errors) {
+		t->errors++;
+		goto out;
+	}
+
+	while (!t->s->stop) {
+		unsigned idx;
+
+		if (n[owner] == o->devices) {
+			start = stress_now();
+			if (ioctl(fds[owner], VIRTIO_LO_DELDEV,
+				  alive[owner][first[owner]]) < 0) {
+				t->errors++;
+			}
+			stress_lat_add(&t->del, start);
+			first[owner] = (first[owner] + 1) % o->devices;
+			n[owner]--;
+		}
+		start = stress_now();
+		if (stress_adddev(t->s, fds[owner], &idx)) {
+			t->errors++;
+		} else {
+			stress_lat_add(&t->add, start);
+			alive[owner][(first[owner] + n[owner]) % o->devices] =
+				idx;
+			n[owner]++;
+		}
+		owner = (owner + 1) % o->owners;
+	}
+
+out:
+	/* the remaining devices go away with their owner */
+	for (i = 0; fds && i < o->owners; i++) {
+		if (fds[i] != -1) {
+			start = stress_now();
+			close(fds[i]);
+			stress_lat_add(&t->close, start);
+		}
+	}
+	free(fds);
+	free(n);
+	free(first);
+	free(alive);
+	return NULL;
+}
+
+/* Kicks every queue of a device in turn */
+static void *stress_kick(void *arg)
+{
+	struct stress_thread *t = arg;
+	const struct stress_opts *o = t->s->opts;
+	struct virtio_lo_kick k = { 0 };
+	unsigned q = 0;
+	uint64_t start;
+	int fd;
+
+	fd = open("/dev/virtio-lo", O_RDWR);
+	if (fd == -1 || stress_adddev(t->s, fd, &k.idx)) {
+		t->errors++;
+	}
+	pthread_barrier_wait(&t->s->start);
+	if (t->errors) {
+		goto out;
+	}
+
+	while (!t->s->stop) {
+		k.qidx = q;
+		start = stress_now();
+		if (ioctl(fd, VIRTIO_LO_KICK, &k) < 0) {
+			t->errors++;
+		}
+		stress_lat_add(&t->kick, start);
+		q = (q + 1) % o->nqueues;
+	}
+out:
+	if (fd != -1) {
+		close(fd);
+	}
+	return NULL;
+}
+
+static void stress_print_header(void)
+{
+	printf("%7s %8s %8s %7s %7s %7s %7s %7s %7s %8s %9s %8s %8s %6s\n",
+	       "threads", "add/s", "del/s", "add_p50", "add_p99", "add_max",
+	       "del_p50", "del_p99", "del_max", "close_ms", "kick/s",
+	       "kick_p50", "kick_p99", "errors");
+}
+
+static int stress_step(const struct stress_opts *o, unsigned nthreads)
+{
+	struct stress s = {
+		.opts = o,
+		.next_id = (uint32_t)getpid() << 16,
+	};
+	unsigned nkick = o->kicks ? nthreads : 0;
+	struct stress_thread *t;
+	struct stress_lat *sum;
+	uint64_t start, elapsed, errors = 0;
+	unsigned i, started;
+	double secs;
+
+	t = calloc(nthreads + nkick, sizeof(*t));
+	sum = calloc(4, sizeof(*sum));
+	if (!t || !sum) {
+		free(sum);
+		free(t);
+		return -1;
+	}
+	pthread_barrier_init(&s.start, NULL, nthreads + nkick + 1);
+	for (started = 0; started < nthreads + nkick; started++) {
+		t[started].s = &s;
+		if (pthread_create(&t[started].thread, NULL,
+				   started < nthreads ? stress_churn :
+							stress_kick,
+				   &t[started])) {
+			fprintf(stderr, "cannot start %u threads\n",
+				nthreads + nkick);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* device creation for the kickers is not measured */
+	pthread_barrier_wait(&s.start);
+	start = stress_now();
+	sleep(o->secs);
+	s.stop = true;
+	elapsed = stress_now() - start;
+	for (i = 0; i < started; i++) {
+		pthread_join(t[i].thread, NULL);
+		stress_lat_merge(&sum[0], &t[i].add);
+		stress_lat_merge(&sum[1], &t[i].del);
+		stress_lat_merge(&sum[2], &t[i].close);
+		stress_lat_merge(&sum[3], &t[i].kick);
+		errors += t[i].errors;
+	}
+	pthread_barrier_destroy(&s.start);
+
+	secs = elapsed / 1e9;
+	printf("%7u %8.0f %8.0f %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f %8.1f "
+	       "%9.0f %8.2f %8.2f %6" PRIu64 "\n",
+	       nthreads, sum[0].count / secs, sum[1].count / secs,
+	       stress_lat_us(&sum[0], 500), stress_lat_us(&sum[0], 990),
+	       sum[0].max / 1e3, stress_lat_us(&sum[1], 500),
+	       stress_lat_us(&sum[1], 990), sum[1].max / 1e3,
+	       sum[2].max / 1e6, sum[3].count / secs,
+	       stress_lat_us(&sum[3], 500), stress_lat_us(&sum[3], 990),
+	       errors);
+	fflush(stdout);
+
+	free(sum);
+	free(t);
+	return 0;
+}
+
+static int stress_parse_list(const char *s, struct stress_list *l)
+{
+	char *end;
+
+	l->n = 0;
+	do {
+		unsigned long v = strtoul(s, &end, 0);
+
+		if (end == s || !v || l->n == STRESS_MAX_LIST) {
+			return -1;
+		}
+		l->v[l->n++] = v;
+		s = end + 1;
+	} while (*end == ',');
+	return *end ? -1 : 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -t LIST   numbers of threads (1,2,4,8)\n"
+		"  -o N      owners per thread (4)\n"
+		"  -n N      devices kept alive per owner (4)\n"
+		"  -q N      queues per device (4)\n"
+		"  -s SECS   duration of each step (5)\n"
+		"  -i ID     virtio device ID (VIRTIO_LO_BENCH_DEVICE_ID)\n"
+		"  -D        create VIRTIO_LO_F_DIRECT devices\n"
+		"  -K        no kick traffic\n"
+		"Devices are only created once a driver sets DRIVER_OK: the\n"
+		"default ID needs virtio_lo_bench, any other ID a driver of its own.\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct stress_opts o = {
+		.threads = { 4, { 1, 2, 4, 8 } },
+		.owners = 4,
+		.devices = 4,
+		.nqueues = 4,
+		.secs = 5,
+		.device_id = VIRTIO_LO_BENCH_DEVICE_ID,
+		.kicks = true,
+	};
+	unsigned i;
+	int fd, opt;
+
+	while ((opt = getopt(argc, argv, "t:o:n:q:s:i:DKh")) != -1) {
+		switch (opt) {
+		case 't':
+			if (stress_parse_list(optarg, &o.threads)) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'o':
+			o.owners = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			o.devices = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			o.nqueues = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			o.secs = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			o.device_id = strtoul(optarg, NULL, 0);
+			break;
+		case 'D':
+			o.direct = true;
+			break;
+		case 'K':
+			o.kicks = false;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (!o.owners || !o.devices || !o.nqueues || !o.secs) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	fd = open("/dev/virtio-lo", O_RDWR);
+	if (fd == -1) {
+		perror("/dev/virtio-lo");
+		return EXIT_FAILURE;
+	}
+	close(fd);
+	if (o.device_id == VIRTIO_LO_BENCH_DEVICE_ID &&
+	    access(STRESS_BENCH_DRIVER, F_OK)) {
+		fprintf(stderr, "virtio_lo_bench is not loaded, "
+				"no device could be created\n");
+		return EXIT_FAILURE;
+	}
+
+	stress_print_header();
+	for (i = 0; i < o.threads.n; i++) {
+		if (stress_step(&o, o.threads.v[i])) {
+			return EXIT_FAILURE;
+		}
+	}
+	return EXIT_SUCCESS;
+}
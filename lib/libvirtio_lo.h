@@ -0,0 +1,136 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2022  Panasonic Automotive Systems, Co., Ltd.
+ */
+
+#ifndef _LIBVIRTIO_LO_H
+#define _LIBVIRTIO_LO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "virtio_lo.h"
+
+/* Device side of virtio-lo devices: creation, access to the memory of the
+ * driver and a split ring engine.
+ *
+ * The backend has to reach the buffers of the driver, so the devices use
+ * either VIRTIO_LO_F_POOL or VIRTIO_LO_F_WINDOW, and only split rings are
+ * supported (VIRTIO_F_RING_PACKED is never offered). Rings are assumed to
+ * be in the byte order of the host, which is little endian for
+ * VIRTIO_F_VERSION_1 devices on the usual hosts.
+ *
+ * Functions returning int return a negative errno value on failure, the
+ * ones returning a pointer return NULL and set errno. Nothing is thread
+ * safe, a queue should be served by a single thread. */
+
+struct vilo_dev;
+struct vilo_vq;
+struct vilo_loop;
+
+struct vilo_dev_params {
+	uint32_t device_id;
+	uint32_t vendor_id;
+	uint64_t features;
+	uint32_t nqueues;
+	/* maximum size of every queue, a power of 2 */
+	uint32_t queue_size;
+	/* VIRTIO_LO_F_POOL or VIRTIO_LO_F_WINDOW, optionally with other
+	 * VIRTIO_LO_F_ flags */
+	uint32_t flags;
+	/* for VIRTIO_LO_F_POOL */
+	uint64_t pool_size;
+	int32_t card_index;
+	const void *config;
+	uint32_t config_size;
+};
+
+/* Maximum number of buffers of an element */
+#define VILO_ELEM_MAX_IOV 64
+
+/* A descriptor chain made available by the driver */
+struct vilo_elem {
+	uint16_t head;
+	/* out_num buffers the device reads followed by in_num buffers it
+	 * writes */
+	uint16_t out_num;
+	uint16_t in_num;
+	struct iovec iov[VILO_ELEM_MAX_IOV];
+};
+
+/* Devices */
+
+/** Create a device on fd, an open /dev/virtio-lo */
+struct vilo_dev *vilo_dev_create(int fd, const struct vilo_dev_params *params);
+/** Delete the device and free it */
+void vilo_dev_destroy(struct vilo_dev *dev);
+
+unsigned vilo_dev_idx(const struct vilo_dev *dev);
+/** Features negotiated by the driver */
+uint64_t vilo_dev_features(const struct vilo_dev *dev);
+unsigned vilo_dev_nqueues(const struct vilo_dev *dev);
+struct vilo_vq *vilo_dev_vq(struct vilo_dev *dev, unsigned qidx);
+
+/** Read the config space */
+int vilo_dev_get_config(struct vilo_dev *dev, unsigned offset, void *buf,
+			unsigned len);
+/** Write the config space and notify the driver */
+int vilo_dev_set_config(struct vilo_dev *dev, unsigned offset,
+			const void *buf, unsigned len);
+
+/** Pointer to len bytes of driver memory at addr, NULL if out of reach */
+void *vilo_dev_translate(struct vilo_dev *dev, uint64_t addr, uint64_t len);
+
+/** Follow the queues when the driver resets the device or sets them up
+ * again, for devices created with VIRTIO_LO_F_EVENTS. Events of other
+ * devices are ignored. */
+int vilo_dev_handle_event(struct vilo_dev *dev,
+			  const struct virtio_lo_event *ev);
+
+/* Queues */
+
+/** Take up to max chains made available by the driver. The avail index is
+ * read once for the whole batch. Returns the number of elements, -EIO if
+ * the driver has made a malformed chain available. */
+int vilo_vq_pop_batch(struct vilo_vq *vq, struct vilo_elem *elems,
+		      unsigned max);
+/** Return an element to the driver, len bytes have been written to it.
+ * The driver sees it once the queue is flushed. */
+void vilo_vq_push(struct vilo_vq *vq, const struct vilo_elem *elem,
+		  uint32_t len);
+/** Publish the pushed elements and interrupt the driver once if it asked
+ * for it */
+int vilo_vq_flush(struct vilo_vq *vq);
+/** Publish the pushed elements without interrupting the driver, returns
+ * true if it asked for an interrupt, to be raised some other way */
+bool vilo_vq_publish(struct vilo_vq *vq);
+
+/** Ask the driver not to kick while the queue is being processed */
+void vilo_vq_disable_notify(struct vilo_vq *vq);
+/** Ask the driver to kick again, returns true if chains have been made
+ * available meanwhile and the queue has to be processed again */
+bool vilo_vq_enable_notify(struct vilo_vq *vq);
+
+/** Eventfd signalled by the driver notifications */
+int vilo_vq_kickfd(const struct vilo_vq *vq);
+unsigned vilo_vq_qidx(const struct vilo_vq *vq);
+
+/* Event loop */
+
+/** Called when the driver has made chains available. Notifications are
+ * disabled meanwhile and the handler is called again until the queue is
+ * empty. */
+typedef void (*vilo_vq_handler_t)(struct vilo_vq *vq, void *opaque);
+
+struct vilo_loop *vilo_loop_create(void);
+void vilo_loop_destroy(struct vilo_loop *loop);
+
+/** Serve the queue with handler, a queue can be added to a single loop */
+int vilo_loop_add(struct vilo_loop *loop, struct vilo_vq *vq,
+		  vilo_vq_handler_t handler, void *opaque);
+/** Wait up to timeout_ms (-1 for ever) for kicks and handle them. Returns
+ * the number of queues handled. */
+int vilo_loop_run_once(struct vilo_loop *loop, int timeout_ms);
+
+#endif /* _LIBVIRTIO_LO_H */
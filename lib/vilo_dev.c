@@ -0,0 +1,269 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2022  Panasonic Automotive Systems, Co., Ltd.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <linux/virtio_config.h>
+
+#include "vilo_priv.h"
+
+static void vilo_dev_free(struct vilo_dev *dev)
+{
+	unsigned i;
+
+	if (dev->mem) {
+		munmap(dev->mem, dev->mem_size);
+	}
+	if (dev->dev_fd != -1) {
+		close(dev->dev_fd);
+	}
+	for (i = 0; dev->vqs && i < dev->nqueues; i++) {
+		if (dev->vqs[i].kickfd != -1) {
+			close(dev->vqs[i].kickfd);
+		}
+		if (dev->vqs[i].callfd != -1) {
+			close(dev->vqs[i].callfd);
+		}
+	}
+	free(dev->vqs);
+	free(dev);
+}
+
+/* Maps the memory the rings point to */
+static int vilo_dev_map(struct vilo_dev *dev, const struct vilo_dev_params *p)
+{
+	uint64_t offset;
+	int flags = MAP_SHARED;
+
+	if (p->flags & VIRTIO_LO_F_POOL) {
+		offset = VIRTIO_LO_REGION_OFFSET(VIRTIO_LO_REGION_POOL);
+		dev->mem_size = p->pool_size;
+	} else {
+		/* the whole region, pages are mapped on first access */
+		offset = VIRTIO_LO_REGION_OFFSET(VIRTIO_LO_REGION_WINDOW);
+		dev->mem_size = VIRTIO_LO_REGION_OFFSET(1);
+		flags |= MAP_NORESERVE;
+	}
+	dev->mem = mmap(NULL, dev->mem_size, PROT_READ | PROT_WRITE, flags,
+			dev->dev_fd, offset);
+	if (dev->mem == MAP_FAILED) {
+		dev->mem = NULL;
+		return -errno;
+	}
+	return 0;
+}
+
+struct vilo_dev *vilo_dev_create(int fd, const struct vilo_dev_params *p)
+{
+	struct virtio_lo_devinfo di = { 0 };
+	struct virtio_lo_qinfo *qi = NULL;
+	struct vilo_dev *dev;
+	uint8_t *config = NULL;
+	unsigned i;
+	int ret;
+
+	if (!(p->flags & (VIRTIO_LO_F_POOL | VIRTIO_LO_F_WINDOW)) ||
+	    !p->nqueues || !p->queue_size ||
+	    (p->queue_size & (p->queue_size - 1))) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev) {
+		return NULL;
+	}
+	dev->fd = fd;
+	dev->dev_fd = -1;
+	dev->nqueues = p->nqueues;
+	dev->vqs = calloc(p->nqueues, sizeof(*dev->vqs));
+	qi = calloc(p->nqueues, sizeof(*qi));
+	config = malloc(p->config_size ? p->config_size : 1);
+	if (!dev->vqs || !qi || !config) {
+		ret = -ENOMEM;
+		goto err;
+	}
+	memcpy(config, p->config, p->config_size);
+	for (i = 0; i < dev->nqueues; i++) {
+		dev->vqs[i].kickfd = -1;
+		dev->vqs[i].callfd = -1;
+	}
+
+	for (i = 0; i < dev->nqueues; i++) {
+		struct vilo_vq *vq = &dev->vqs[i];
+
+		vq->dev = dev;
+		vq->qidx = i;
+		vq->kickfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		vq->callfd = eventfd(0, EFD_CLOEXEC);
+		if (vq->kickfd == -1 || vq->callfd == -1) {
+			ret = -errno;
+			goto err;
+		}
+		qi[i].kickfd = vq->kickfd;
+		qi[i].callfd = vq->callfd;
+		qi[i].size = p->queue_size;
+	}
+
+	di.device_id = p->device_id;
+	di.vendor_id = p->vendor_id;
+	di.nqueues = p->nqueues;
+	/* the engine only knows split rings */
+	di.features = p->features & ~(1ULL << VIRTIO_F_RING_PACKED);
+	di.config_size = p->config_size;
+	di.config_kick = -1;
+	di.card_index = p->card_index;
+	di.flags = (p->flags & ~VIRTIO_LO_F_ASYNC) | VIRTIO_LO_F_CALLFD;
+	di.config = config;
+	di.qinfo = qi;
+	di.pool_size = p->pool_size;
+	di.done_fd = -1;
+	if (ioctl(fd, VIRTIO_LO_ADDDEV, &di) < 0) {
+		ret = -errno;
+		goto err;
+	}
+	dev->idx = di.idx;
+	dev->features = di.features;
+
+	ret = ioctl(fd, VIRTIO_LO_DEVICE_FD, di.idx);
+	if (ret < 0) {
+		ret = -errno;
+		goto err_del;
+	}
+	dev->dev_fd = ret;
+	ret = vilo_dev_map(dev, p);
+	if (ret) {
+		goto err_del;
+	}
+
+	for (i = 0; i < dev->nqueues; i++) {
+		/* queues the driver does not use are left out */
+		if (!qi[i].size || (qi[i].flags & VIRTIO_LO_QUEUE_F_PACKED)) {
+			continue;
+		}
+		ret = vilo_vq_setup(&dev->vqs[i], qi[i].size, qi[i].desc,
+				    qi[i].avail, qi[i].used);
+		if (ret) {
+			goto err_del;
+		}
+	}
+
+	free(config);
+	free(qi);
+	return dev;
+err_del:
+	ioctl(fd, VIRTIO_LO_DELDEV, dev->idx);
+err:
+	free(config);
+	free(qi);
+	vilo_dev_free(dev);
+	errno = -ret;
+	return NULL;
+}
+
+void vilo_dev_destroy(struct vilo_dev *dev)
+{
+	ioctl(dev->fd, VIRTIO_LO_DELDEV, dev->idx);
+	vilo_dev_free(dev);
+}
+
+unsigned vilo_dev_idx(const struct vilo_dev *dev)
+{
+	return dev->idx;
+}
+
+uint64_t vilo_dev_features(const struct vilo_dev *dev)
+{
+	return dev->features;
+}
+
+unsigned vilo_dev_nqueues(const struct vilo_dev *dev)
+{
+	return dev->nqueues;
+}
+
+struct vilo_vq *vilo_dev_vq(struct vilo_dev *dev, unsigned qidx)
+{
+	if (qidx >= dev->nqueues) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return &dev->vqs[qidx];
+}
+
+int vilo_dev_get_config(struct vilo_dev *dev, unsigned offset, void *buf,
+			unsigned len)
+{
+	struct virtio_lo_config c = {
+		.idx = dev->idx,
+		.offset = offset,
+		.len = len,
+		.config = buf,
+	};
+
+	return ioctl(dev->fd, VIRTIO_LO_GCONF, &c) < 0 ? -errno : 0;
+}
+
+int vilo_dev_set_config(struct vilo_dev *dev, unsigned offset,
+			const void *buf, unsigned len)
+{
+	struct virtio_lo_config c = {
+		.idx = dev->idx,
+		.offset = offset,
+		.len = len,
+		.config = (uint8_t *)buf,
+	};
+
+	return ioctl(dev->fd, VIRTIO_LO_SCONF, &c) < 0 ? -errno : 0;
+}
+
+void *vilo_dev_translate(struct vilo_dev *dev, uint64_t addr, uint64_t len)
+{
+	if (addr >= dev->mem_size || len > dev->mem_size - addr) {
+		return NULL;
+	}
+	return dev->mem + addr;
+}
+
+int vilo_dev_handle_event(struct vilo_dev *dev,
+			  const struct virtio_lo_event *ev)
+{
+	unsigned i;
+
+	if (ev->idx != dev->idx) {
+		return 0;
+	}
+	switch (ev->type) {
+	case VIRTIO_LO_EVENT_FEATURES:
+		dev->features = ev->value;
+		break;
+	case VIRTIO_LO_EVENT_RESET:
+		for (i = 0; i < dev->nqueues; i++) {
+			vilo_vq_clear(&dev->vqs[i]);
+		}
+		break;
+	case VIRTIO_LO_EVENT_QUEUE_SETUP:
+		if (ev->qidx >= dev->nqueues) {
+			return -EINVAL;
+		}
+		return vilo_vq_setup(&dev->vqs[ev->qidx], ev->size, ev->desc,
+				     ev->avail, ev->used);
+	case VIRTIO_LO_EVENT_QUEUE_DEL:
+		if (ev->qidx >= dev->nqueues) {
+			return -EINVAL;
+		}
+		vilo_vq_clear(&dev->vqs[ev->qidx]);
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
@@ -0,0 +1,92 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2022  Panasonic Automotive Systems, Co., Ltd.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "vilo_priv.h"
+
+/* Maximum number of kicks handled by one epoll_wait */
+#define VILO_LOOP_EVENTS 64
+
+struct vilo_loop {
+	int epfd;
+};
+
+struct vilo_loop *vilo_loop_create(void)
+{
+	struct vilo_loop *loop;
+
+	loop = calloc(1, sizeof(*loop));
+	if (!loop) {
+		return NULL;
+	}
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd == -1) {
+		int err = errno;
+
+		free(loop);
+		errno = err;
+		return NULL;
+	}
+	return loop;
+}
+
+void vilo_loop_destroy(struct vilo_loop *loop)
+{
+	close(loop->epfd);
+	free(loop);
+}
+
+int vilo_loop_add(struct vilo_loop *loop, struct vilo_vq *vq,
+		  vilo_vq_handler_t handler, void *opaque)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = vq,
+	};
+
+	if (vq->handler) {
+		return -EBUSY;
+	}
+	vq->handler = handler;
+	vq->opaque = opaque;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, vq->kickfd, &ev) < 0) {
+		vq->handler = NULL;
+		return -errno;
+	}
+	return 0;
+}
+
+static void vilo_loop_handle(struct vilo_vq *vq)
+{
+	uint64_t cnt;
+
+	/* the kicks are merged, the ring says what is new */
+	if (read(vq->kickfd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+		return;
+	}
+	do {
+		vilo_vq_disable_notify(vq);
+		vq->handler(vq, vq->opaque);
+	} while (vilo_vq_enable_notify(vq));
+}
+
+int vilo_loop_run_once(struct vilo_loop *loop, int timeout_ms)
+{
+	struct epoll_event evs[VILO_LOOP_EVENTS];
+	int n, i;
+
+	n = epoll_wait(loop->epfd, evs, VILO_LOOP_EVENTS, timeout_ms);
+	if (n < 0) {
+		return errno == EINTR ? 0 : -errno;
+	}
+	for (i = 0; i < n; i++) {
+		vilo_loop_handle(evs[i].data.ptr);
+	}
+	return n;
+}
@@ -0,0 +1,60 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2022  Panasonic Automotive Systems, Co., Ltd.
+ */
+
+#ifndef _VILO_PRIV_H
+#define _VILO_PRIV_H
+
+#include <linux/virtio_ring.h>
+
+#include "libvirtio_lo.h"
+
+struct vilo_vq {
+	struct vilo_dev *dev;
+	unsigned qidx;
+	int kickfd;
+	int callfd;
+
+	/* the rings are known and can be accessed */
+	bool ready;
+	bool event_idx;
+	unsigned num;
+	struct vring_desc *desc;
+	struct vring_avail *avail;
+	struct vring_used *used;
+
+	/* next avail entry to take */
+	uint16_t last_avail;
+	/* used index including the pushed elements, and the one the driver
+	 * has seen */
+	uint16_t used_idx;
+	uint16_t used_published;
+
+	/* see vilo_loop_add */
+	vilo_vq_handler_t handler;
+	void *opaque;
+};
+
+struct vilo_dev {
+	/* the owner file, not closed with the device */
+	int fd;
+	int dev_fd;
+	unsigned idx;
+	uint64_t features;
+
+	/* the pool or the window, addresses in the rings are offsets in it */
+	uint8_t *mem;
+	uint64_t mem_size;
+
+	unsigned nqueues;
+	struct vilo_vq *vqs;
+};
+
+/* Point the queue to its rings, they are empty */
+int vilo_vq_setup(struct vilo_vq *vq, uint32_t num, uint64_t desc,
+		  uint64_t avail, uint64_t used);
+/* Forget the rings, the driver has deleted them */
+void vilo_vq_clear(struct vilo_vq *vq);
+
+#endif /* _VILO_PRIV_H */
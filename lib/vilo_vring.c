@@ -0,0 +1,265 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2022  Panasonic Automotive Systems, Co., Ltd.
+ */
+
+#include <errno.h>
+#include <unistd.h>
+
+#include "vilo_priv.h"
+
+/* Split ring engine
+ *
+ * The driver side fields (avail ring, used_event) are read with acquire
+ * semantics once per batch, the device side fields are written with plain
+ * stores and the used index is published with a single release store per
+ * batch. */
+
+#define vilo_load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define vilo_store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define vilo_mb() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/* avail_event and used_event live right after the rings */
+static inline uint16_t *vilo_avail_event(struct vilo_vq *vq)
+{
+	return (uint16_t *)&vq->used->ring[vq->num];
+}
+
+static inline uint16_t *vilo_used_event(struct vilo_vq *vq)
+{
+	return (uint16_t *)&vq->avail->ring[vq->num];
+}
+
+int vilo_vq_setup(struct vilo_vq *vq, uint32_t num, uint64_t desc,
+		  uint64_t avail, uint64_t used)
+{
+	struct vilo_dev *dev = vq->dev;
+
+	vq->ready = false;
+	if (!num || (num & (num - 1)) || num > 32768) {
+		return -EINVAL;
+	}
+	vq->desc = vilo_dev_translate(dev, desc, sizeof(*vq->desc) * num);
+	vq->avail = vilo_dev_translate(
+		dev, avail, sizeof(*vq->avail) + sizeof(uint16_t) * (num + 1));
+	vq->used = vilo_dev_translate(dev, used,
+				      sizeof(*vq->used) +
+					      sizeof(vq->used->ring[0]) * num +
+					      sizeof(uint16_t));
+	if (!vq->desc || !vq->avail || !vq->used) {
+		return -EFAULT;
+	}
+
+	vq->num = num;
+	vq->event_idx = dev->features & (1ULL << VIRTIO_RING_F_EVENT_IDX);
+	vq->last_avail = 0;
+	vq->used_idx = 0;
+	vq->used_published = 0;
+	vq->ready = true;
+	return 0;
+}
+
+void vilo_vq_clear(struct vilo_vq *vq)
+{
+	vq->ready = false;
+}
+
+/* Fills elem with the chain starting at head, indirect tables included */
+static int vilo_vq_map_chain(struct vilo_vq *vq, uint16_t head,
+			     struct vilo_elem *elem)
+{
+	const struct vring_desc *table = vq->desc;
+	unsigned table_num = vq->num;
+	unsigned i = head;
+	unsigned count = 0;
+
+	if (head >= vq->num) {
+		return -EIO;
+	}
+	elem->head = head;
+	elem->out_num = 0;
+	elem->in_num = 0;
+
+	if (table[i].flags & VRING_DESC_F_INDIRECT) {
+		uint32_t len = table[i].len;
+
+		if (!len || len % sizeof(*table)) {
+			return -EIO;
+		}
+		table = vilo_dev_translate(vq->dev, table[i].addr, len);
+		if (!table) {
+			return -EIO;
+		}
+		table_num = len / sizeof(*table);
+		i = 0;
+	}
+
+	for (;;) {
+		const struct vring_desc *d = &table[i];
+		unsigned n = elem->out_num + elem->in_num;
+		void *p;
+
+		/* a looping chain is longer than the table */
+		if (count++ == table_num || n == VILO_ELEM_MAX_IOV) {
+			return -EIO;
+		}
+		if (d->flags & VRING_DESC_F_NEXT) {
+			__builtin_prefetch(&table[d->next % table_num]);
+		}
+		p = vilo_dev_translate(vq->dev, d->addr, d->len);
+		if (!p) {
+			return -EIO;
+		}
+		elem->iov[n].iov_base = p;
+		elem->iov[n].iov_len = d->len;
+		if (d->flags & VRING_DESC_F_WRITE) {
+			elem->in_num++;
+		} else if (elem->in_num) {
+			/* readable buffers come first */
+			return -EIO;
+		} else {
+			elem->out_num++;
+		}
+
+		if (!(d->flags & VRING_DESC_F_NEXT)) {
+			return 0;
+		}
+		i = d->next;
+		if (i >= table_num) {
+			return -EIO;
+		}
+	}
+}
+
+int vilo_vq_pop_batch(struct vilo_vq *vq, struct vilo_elem *elems,
+		      unsigned max)
+{
+	unsigned mask = vq->num - 1;
+	uint16_t avail_idx, n, i;
+	int ret;
+
+	if (!vq->ready) {
+		return 0;
+	}
+	/* one snapshot of the index covers the whole batch */
+	avail_idx = vilo_load_acquire(&vq->avail->idx);
+	n = avail_idx - vq->last_avail;
+	if (n > vq->num) {
+		return -EIO;
+	}
+	if (n > max) {
+		n = max;
+	}
+
+	for (i = 0; i < n; i++) {
+		uint16_t head = vq->avail->ring[(vq->last_avail + i) & mask];
+
+		/* fetch the next head while this chain is walked */
+		if (i + 1 < n) {
+			uint16_t next =
+				vq->avail->ring[(vq->last_avail + i + 1) & mask];
+
+			__builtin_prefetch(&vq->desc[next & mask]);
+		}
+		ret = vilo_vq_map_chain(vq, head, &elems[i]);
+		if (ret) {
+			/* the broken chain is reported by the next call */
+			if (!i) {
+				return ret;
+			}
+			n = i;
+			break;
+		}
+	}
+
+	vq->last_avail += n;
+	/* the driver kicks again once it goes past what we took */
+	if (vq->event_idx) {
+		*vilo_avail_event(vq) = vq->last_avail;
+	}
+	return n;
+}
+
+void vilo_vq_push(struct vilo_vq *vq, const struct vilo_elem *elem,
+		  uint32_t len)
+{
+	struct vring_used_elem *u = &vq->used->ring[vq->used_idx & (vq->num - 1)];
+
+	u->id = elem->head;
+	u->len = len;
+	vq->used_idx++;
+}
+
+static int vilo_vq_signal(struct vilo_vq *vq)
+{
+	uint64_t one = 1;
+
+	if (write(vq->callfd, &one, sizeof(one)) != sizeof(one)) {
+		return -errno;
+	}
+	return 0;
+}
+
+bool vilo_vq_publish(struct vilo_vq *vq)
+{
+	uint16_t old = vq->used_published;
+	uint16_t new = vq->used_idx;
+
+	if (!vq->ready || old == new) {
+		return false;
+	}
+	vilo_store_release(&vq->used->idx, new);
+	vq->used_published = new;
+
+	/* the used index has to be visible before the driver flags are read,
+	 * or an interrupt the driver waits for could be skipped */
+	vilo_mb();
+	if (vq->event_idx) {
+		return vring_need_event(vilo_load_acquire(vilo_used_event(vq)),
+					new, old);
+	}
+	return !(vilo_load_acquire(&vq->avail->flags) &
+		 VRING_AVAIL_F_NO_INTERRUPT);
+}
+
+int vilo_vq_flush(struct vilo_vq *vq)
+{
+	if (!vilo_vq_publish(vq)) {
+		return 0;
+	}
+	return vilo_vq_signal(vq);
+}
+
+void vilo_vq_disable_notify(struct vilo_vq *vq)
+{
+	/* with event index the driver only kicks past avail_event anyway */
+	if (vq->ready && !vq->event_idx) {
+		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+	}
+}
+
+bool vilo_vq_enable_notify(struct vilo_vq *vq)
+{
+	if (!vq->ready) {
+		return false;
+	}
+	if (vq->event_idx) {
+		*vilo_avail_event(vq) = vq->last_avail;
+	} else {
+		vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+	}
+	/* the flags have to be visible before the index is checked, or a
+	 * chain made available meanwhile would not be kicked */
+	vilo_mb();
+	return vilo_load_acquire(&vq->avail->idx) != vq->last_avail;
+}
+
+int vilo_vq_kickfd(const struct vilo_vq *vq)
+{
+	return vq->kickfd;
+}
+
+unsigned vilo_vq_qidx(const struct vilo_vq *vq)
+{
+	return vq->qidx;
+}
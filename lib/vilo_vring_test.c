@@ -0,0 +1,286 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2022  Panasonic Automotive Systems, Co., Ltd.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vilo_priv.h"
+
+/* Checks of the split ring engine on rings built in a malloc'd buffer, the
+ * way the driver would lay them out in the pool. No module is needed. */
+
+#define TEST_NUM 8
+#define TEST_MEM_SIZE 0x10000
+#define TEST_DESC 0x0
+#define TEST_AVAIL 0x1000
+#define TEST_USED 0x2000
+#define TEST_INDIRECT 0x3000
+#define TEST_BUF 0x4000
+#define TEST_BUF_SIZE 0x100
+
+struct test_ring {
+	struct vilo_dev dev;
+	struct vilo_vq vq;
+	struct vring_desc *desc;
+	struct vring_avail *avail;
+	struct vring_used *used;
+};
+
+static int failures;
+
+#define CHECK(cond)                                                            \
+	do {                                                                   \
+		if (!(cond)) {                                                 \
+			fprintf(stderr, "%s:%d: %s failed\n", __FILE__,        \
+				__LINE__, #cond);                              \
+			failures++;                                            \
+		}                                                              \
+	} while (0)
+
+static void test_ring_init(struct test_ring *r, uint8_t *mem, bool event_idx)
+{
+	memset(mem, 0, TEST_MEM_SIZE);
+	memset(r, 0, sizeof(*r));
+	r->dev.mem = mem;
+	r->dev.mem_size = TEST_MEM_SIZE;
+	r->dev.features = event_idx ? 1ULL << VIRTIO_RING_F_EVENT_IDX : 0;
+	r->vq.dev = &r->dev;
+	r->vq.kickfd = r->vq.callfd = -1;
+	r->desc = (struct vring_desc *)(mem + TEST_DESC);
+	r->avail = (struct vring_avail *)(mem + TEST_AVAIL);
+	r->used = (struct vring_used *)(mem + TEST_USED);
+	if (vilo_vq_setup(&r->vq, TEST_NUM, TEST_DESC, TEST_AVAIL, TEST_USED)) {
+		fprintf(stderr, "cannot set the queue up\n");
+		exit(1);
+	}
+}
+
+static void test_desc(struct vring_desc *table, unsigned i, uint32_t len,
+		      uint16_t flags, uint16_t next)
+{
+	table[i].addr = TEST_BUF + i * TEST_BUF_SIZE;
+	table[i].len = len;
+	table[i].flags = flags;
+	table[i].next = next;
+}
+
+/* makes the chain at head available */
+static void test_avail(struct test_ring *r, uint16_t head)
+{
+	r->avail->ring[r->avail->idx % TEST_NUM] = head;
+	r->avail->idx++;
+}
+
+static void test_chain(void)
+{
+	uint8_t *mem = malloc(TEST_MEM_SIZE);
+	struct vilo_elem elem;
+	struct vring_desc *table;
+	struct test_ring r;
+
+	/* one readable and two writable buffers */
+	test_ring_init(&r, mem, false);
+	test_desc(r.desc, 0, 16, VRING_DESC_F_NEXT, 2);
+	test_desc(r.desc, 2, 32, VRING_DESC_F_NEXT | VRING_DESC_F_WRITE, 5);
+	test_desc(r.desc, 5, 64, VRING_DESC_F_WRITE, 0);
+	test_avail(&r, 0);
+	CHECK(vilo_vq_pop_batch(&r.vq, &elem, 1) == 1);
+	CHECK(elem.head == 0);
+	CHECK(elem.out_num == 1 && elem.in_num == 2);
+	CHECK(elem.iov[0].iov_base == mem + TEST_BUF);
+	CHECK(elem.iov[1].iov_len == 32);
+	CHECK(elem.iov[2].iov_base == mem + TEST_BUF + 5 * TEST_BUF_SIZE);
+
+	/* indirect table of three entries */
+	test_ring_init(&r, mem, false);
+	table = (struct vring_desc *)(mem + TEST_INDIRECT);
+	test_desc(table, 0, 8, VRING_DESC_F_NEXT, 1);
+	test_desc(table, 1, 8, VRING_DESC_F_NEXT, 2);
+	test_desc(table, 2, 8, VRING_DESC_F_WRITE, 0);
+	r.desc[3].addr = TEST_INDIRECT;
+	r.desc[3].len = 3 * sizeof(*table);
+	r.desc[3].flags = VRING_DESC_F_INDIRECT;
+	test_avail(&r, 3);
+	CHECK(vilo_vq_pop_batch(&r.vq, &elem, 1) == 1);
+	CHECK(elem.head == 3);
+	CHECK(elem.out_num == 2 && elem.in_num == 1);
+	CHECK(elem.iov[2].iov_base == mem + TEST_BUF + 2 * TEST_BUF_SIZE);
+	free(mem);
+}
+
+static void test_malformed(void)
+{
+	uint8_t *mem = malloc(TEST_MEM_SIZE);
+	struct vilo_elem elem;
+	struct vring_desc *table;
+	struct test_ring r;
+
+	/* loop */
+	test_ring_init(&r, mem, false);
+	test_desc(r.desc, 0, 8, VRING_DESC_F_NEXT, 1);
+	test_desc(r.desc, 1, 8, VRING_DESC_F_NEXT, 0);
+	test_avail(&r, 0);
+	CHECK(vilo_vq_pop_batch(&r.vq, &elem, 1) == -EIO);
+
+	/* next out of the table */
+	test_ring_init(&r, mem, false);
+	test_desc(r.desc, 0, 8, VRING_DESC_F_NEXT, TEST_NUM);
+	test_avail(&r, 0);
+	CHECK(vilo_vq_pop_batch(&r.vq, &elem, 1) == -EIO);
+
+	/* head out of the table */
+	test_ring_init(&r, mem, false);
+	test_avail(&r, TEST_NUM);
+	CHECK(vilo_vq_pop_batch(&r.vq, &elem, 1) == -EIO);
+
+	/* readable buffer after a writable one */
+	test_ring_init(&r, mem, false);
+	test_desc(r.desc, 0, 8, VRING_DESC_F_NEXT | VRING_DESC_F_WRITE, 1);
+	test_desc(r.desc, 1, 8, 0, 0);
+	test_avail(&r, 0);
+	CHECK(vilo_vq_pop_batch(&r.vq, &elem, 1) == -EIO);
+
+	/* buffer out of the memory */
+	test_ring_init(&r, mem, false);
+	r.desc[0].addr = TEST_MEM_SIZE - 4;
+	r.desc[0].len = 8;
+	test_avail(&r, 0);
+	CHECK(vilo_vq_pop_batch(&r.vq, &elem, 1) == -EIO);
+
+	/* indirect table of a size that is not a multiple of a descriptor */
+	test_ring_init(&r, mem, false);
+	r.desc[0].addr = TEST_INDIRECT;
+	r.desc[0].len = sizeof(*table) + 1;
+	r.desc[0].flags = VRING_DESC_F_INDIRECT;
+	test_avail(&r, 0);
+	CHECK(vilo_vq_pop_batch(&r.vq, &elem, 1) == -EIO);
+
+	/* loop in an indirect table */
+	test_ring_init(&r, mem, false);
+	table = (struct vring_desc *)(mem + TEST_INDIRECT);
+	test_desc(table, 0, 8, VRING_DESC_F_NEXT, 1);
+	test_desc(table, 1, 8, VRING_DESC_F_NEXT, 0);
+	r.desc[0].addr = TEST_INDIRECT;
+	r.desc[0].len = 2 * sizeof(*table);
+	r.desc[0].flags = VRING_DESC_F_INDIRECT;
+	test_avail(&r, 0);
+	CHECK(vilo_vq_pop_batch(&r.vq, &elem, 1) == -EIO);
+
+	/* avail index further than the size of the queue */
+	test_ring_init(&r, mem, false);
+	r.avail->idx = TEST_NUM + 1;
+	CHECK(vilo_vq_pop_batch(&r.vq, &elem, 1) == -EIO);
+
+	/* the chains before a broken one are returned first */
+	test_ring_init(&r, mem, false);
+	test_desc(r.desc, 0, 8, 0, 0);
+	test_desc(r.desc, 1, 8, VRING_DESC_F_NEXT, TEST_NUM);
+	test_avail(&r, 0);
+	test_avail(&r, 1);
+	{
+		struct vilo_elem elems[2];
+
+		CHECK(vilo_vq_pop_batch(&r.vq, elems, 2) == 1);
+		CHECK(vilo_vq_pop_batch(&r.vq, elems, 2) == -EIO);
+	}
+	free(mem);
+}
+
+static void test_batch(void)
+{
+	uint8_t *mem = malloc(TEST_MEM_SIZE);
+	struct vilo_elem elems[TEST_NUM];
+	uint16_t *avail_event;
+	struct test_ring r;
+	unsigned i;
+
+	test_ring_init(&r, mem, true);
+	avail_event = (uint16_t *)&r.used->ring[TEST_NUM];
+	for (i = 0; i < 5; i++) {
+		test_desc(r.desc, i, 8, 0, 0);
+		test_avail(&r, i);
+	}
+	/* stops at max */
+	CHECK(vilo_vq_pop_batch(&r.vq, elems, 3) == 3);
+	CHECK(elems[2].head == 2);
+	CHECK(*avail_event == 3);
+	/* and at the avail index */
+	CHECK(vilo_vq_pop_batch(&r.vq, elems, TEST_NUM) == 2);
+	CHECK(elems[0].head == 3 && elems[1].head == 4);
+	CHECK(*avail_event == 5);
+	CHECK(vilo_vq_pop_batch(&r.vq, elems, TEST_NUM) == 0);
+
+	/* the index wraps */
+	for (i = 0; i < TEST_NUM; i++) {
+		vilo_vq_push(&r.vq, &elems[0], 0);
+	}
+	for (i = 0; i < TEST_NUM; i++) {
+		test_desc(r.desc, i, 8, 0, 0);
+		test_avail(&r, i);
+	}
+	CHECK(vilo_vq_pop_batch(&r.vq, elems, TEST_NUM) == TEST_NUM);
+	CHECK(elems[TEST_NUM - 1].head == TEST_NUM - 1);
+	free(mem);
+}
+
+static void test_publish(void)
+{
+	uint8_t *mem = malloc(TEST_MEM_SIZE);
+	uint16_t *used_event;
+	struct vilo_elem elem;
+	struct test_ring r;
+
+	/* without event index, VRING_AVAIL_F_NO_INTERRUPT decides */
+	test_ring_init(&r, mem, false);
+	test_desc(r.desc, 0, 8, 0, 0);
+	test_avail(&r, 0);
+	CHECK(vilo_vq_pop_batch(&r.vq, &elem, 1) == 1);
+	CHECK(!vilo_vq_publish(&r.vq));
+	vilo_vq_push(&r.vq, &elem, 4);
+	CHECK(vilo_vq_publish(&r.vq));
+	CHECK(r.used->idx == 1);
+	CHECK(r.used->ring[0].id == 0 && r.used->ring[0].len == 4);
+	r.avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+	vilo_vq_push(&r.vq, &elem, 4);
+	CHECK(!vilo_vq_publish(&r.vq));
+	CHECK(r.used->idx == 2);
+
+	/* with event index, only crossing used_event interrupts */
+	test_ring_init(&r, mem, true);
+	used_event = &r.avail->ring[TEST_NUM];
+	test_desc(r.desc, 0, 8, 0, 0);
+	test_avail(&r, 0);
+	CHECK(vilo_vq_pop_batch(&r.vq, &elem, 1) == 1);
+	/* the flags are ignored */
+	r.avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+	*used_event = 0;
+	vilo_vq_push(&r.vq, &elem, 0);
+	CHECK(vilo_vq_publish(&r.vq));
+	vilo_vq_push(&r.vq, &elem, 0);
+	CHECK(!vilo_vq_publish(&r.vq));
+	/* one publish of several elements crossing used_event */
+	*used_event = 3;
+	vilo_vq_push(&r.vq, &elem, 0);
+	vilo_vq_push(&r.vq, &elem, 0);
+	vilo_vq_push(&r.vq, &elem, 0);
+	CHECK(vilo_vq_publish(&r.vq));
+	CHECK(r.used->idx == 5);
+	free(mem);
+}
+
+int main(void)
+{
+	test_chain();
+	test_malformed();
+	test_batch();
+	test_publish();
+	if (failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	return 0;
+}
@@ -9,12 +9,107 @@
 #include <linux/ioctl.h>
 #include <linux/types.h>
 
+/* With VIRTIO_LO_F_CALLFD, signalling callfd (if not -1) has the same
+ * effect as VIRTIO_LO_KICK for this queue. Signals that arrive before the
+ * driver has handled the previous one are merged into a single interrupt.
+ *
+ * If VIRTIO_F_RING_PACKED has been negotiated, VIRTIO_LO_QUEUE_F_PACKED is
+ * set in flags and the addresses describe a packed virtqueue: desc is the
+ * descriptor ring, avail is the driver event suppression structure and used
+ * is the device event suppression structure. */
+#define VIRTIO_LO_QUEUE_F_PACKED (1 << 0)
+
 struct virtio_lo_qinfo {
 	__s32 kickfd; /* IN */
 	__u32 size; /* IN/OUT */
 	__u64 desc; /* OUT */
 	__u64 avail; /* OUT */
 	__u64 used; /* OUT */
+	__s32 callfd; /* IN */
+	__u32 flags; /* OUT */
+};
+
+/* Device flags */
+
+/* The callfd of every virtio_lo_qinfo is set, see struct virtio_lo_qinfo.
+ * Without it callfd is ignored, so a zeroed entry does not take fd 0. */
+#define VIRTIO_LO_F_CALLFD (1 << 0)
+
+/* Allocate a memory pool of pool_size bytes for the device, up to the
+ * max_pool_size module parameter. The driver part then allocates its vrings
+ * from the pool and bounces all the other DMA buffers through it, so every
+ * address in the rings (including the addresses in virtio_lo_qinfo) is an
+ * offset in the pool. The pool is mapped with VIRTIO_LO_REGION_POOL of the
+ * device file, queue files cannot be mapped. VIRTIO_F_ACCESS_PLATFORM is
+ * added to the device features. */
+#define VIRTIO_LO_F_POOL (1 << 1)
+
+/* Give the backend access to the memory the driver has passed to the
+ * device (vrings and the buffers it has mapped for DMA) through
+ * VIRTIO_LO_REGION_WINDOW of the device file. The offset in the region is
+ * the address used in the rings. Pages are mapped on first access, other
+ * addresses raise SIGBUS. Access to a buffer lasts until the driver has
+ * taken it back from the used ring. The window works in pages: buffers
+ * that do not fill their pages (kmalloc memory, parts of pages) are copied
+ * to zeroed pages of their own, so the address of such a buffer in the
+ * rings is the one of its copy. VIRTIO_F_ACCESS_PLATFORM is added to
+ * the device features. Cannot be combined with VIRTIO_LO_F_POOL or
+ * VIRTIO_LO_F_DIRECT. */
+#define VIRTIO_LO_F_WINDOW (1 << 2)
+
+/* Allow busy polling of the used rings, see VIRTIO_LO_SET_POLL. Polling
+ * stays off for all the queues until it is enabled. */
+#define VIRTIO_LO_F_POLL (1 << 3)
+
+/* Publish driver notifications in a doorbell page, see struct
+ * virtio_lo_doorbell. */
+#define VIRTIO_LO_F_DOORBELL (1 << 4)
+
+/* Return from VIRTIO_LO_ADDDEV as soon as the device has been created and
+ * probe the driver part in the background, see VIRTIO_LO_ADDDEV_RESULT. */
+#define VIRTIO_LO_F_ASYNC (1 << 5)
+
+/* Report what the driver does with the device through the event queue of
+ * the owner, see struct virtio_lo_event. */
+#define VIRTIO_LO_F_EVENTS (1 << 6)
+
+/* Register the virtio device directly under the virtio-lo-bus device
+ * instead of going through a platform device. Creation is faster and the
+ * device takes less memory. Cannot be combined with VIRTIO_LO_F_POOL or
+ * VIRTIO_LO_F_WINDOW, nor with VIRTIO_F_ACCESS_PLATFORM in the features,
+ * which need a device of its own for the DMA. */
+#define VIRTIO_LO_F_DIRECT (1 << 7)
+
+/* Entry of a queue in VIRTIO_LO_REGION_DOORBELL, one cache line each.
+ *
+ * Every driver notification stores the avail index of a split ring (0 for
+ * packed rings) and then increments seq, so a backend thread can busy poll
+ * seq instead of waiting for kickfd. The kickfd and the queue file are
+ * only signalled while sleeping is non-zero. It is initially set, so
+ * backends that ignore the doorbell see no difference. Before blocking,
+ * a polling backend sets sleeping, issues a full memory barrier and checks
+ * seq again; it clears sleeping once it is awake. */
+struct virtio_lo_doorbell {
+	__u32 seq; /* OUT */
+	__u32 avail; /* OUT */
+	__u32 sleeping; /* IN */
+	__u32 reserved[13];
+};
+
+/* Maximum number of shared memory regions of a device */
+#define VIRTIO_LO_MAX_SHM 16
+
+/* Virtio shared memory region backed by a physical memory range the backend
+ * owns, for example memory reserved with memmap= or a PCI BAR. It cannot be
+ * system RAM, because the driver reserves the range as device memory, nor
+ * a range claimed by another driver. The region is also mmapped with
+ * VIRTIO_LO_REGION_SHM(id) of the device file, write-combined. addr and len
+ * should be page aligned. Needs CAP_SYS_RAWIO. */
+struct virtio_lo_shm {
+	__u64 addr; /* IN */
+	__u64 len; /* IN */
+	__u8 id; /* IN */
+	__u8 padding[7]; /* IN */
 };
 
 struct virtio_lo_devinfo {
@@ -26,9 +121,54 @@ struct virtio_lo_devinfo {
 	__u32 config_size; /* IN */
 	__s32 config_kick; /* IN */
 	__s32 card_index; /* IN */
-	__u32 padding; /* IN */
+	__u32 flags; /* IN */
 	__u8 *config; /* IN/OUT */
 	struct virtio_lo_qinfo *qinfo; /* IN/OUT */
+	__u64 pool_size; /* IN */
+	__u32 nshm; /* IN */
+	__u32 padding2; /* IN */
+	struct virtio_lo_shm *shm; /* IN */
+	__s32 done_fd; /* IN */
+	__u32 padding3; /* IN */
+};
+
+/* Maximum number of devices accepted by VIRTIO_LO_ADDDEV_BULK */
+#define VIRTIO_LO_ADDDEV_BULK_MAX 64
+
+struct virtio_lo_adddev_bulk {
+	__u32 ndevs; /* IN */
+	__u32 padding; /* IN */
+	struct virtio_lo_devinfo *devs; /* IN/OUT */
+};
+
+/* VIRTIO_LO_ADDDEV encodes the size of struct virtio_lo_devinfo, which has
+ * grown since its first version. The first version (VIRTIO_LO_ADDDEV_VER0)
+ * is still accepted: it stops after qinfo, has no flags (the field was
+ * padding) and its qinfo entries stop after used. */
+#define VIRTIO_LO_DEVINFO_SIZE_VER0 56
+#define VIRTIO_LO_QINFO_SIZE_VER0 32
+
+/* Layout of VIRTIO_LO_REGION_CONFIG: this header followed by the config
+ * space of the device.
+ *
+ * seq is odd while the config is being written. A writer moves seq from an
+ * even value to the next odd one with compare-and-swap, updates the config,
+ * increments generation and then, after a write barrier, increments seq
+ * again. A reader copies the config between two reads of seq separated by
+ * read barriers and retries if seq was odd or has changed.
+ *
+ * The driver does not read the page: the kernel keeps the config the driver
+ * sees and copies it to the page on every driver write and VIRTIO_LO_SCONF.
+ * A change made while the backend is updating the page is not copied, it is
+ * only returned by VIRTIO_LO_GCONF. After an update of the page,
+ * VIRTIO_LO_CONFIG_CHANGED hands the whole config over to the driver and
+ * lets it know, or fails with EAGAIN if seq is odd or changes meanwhile. */
+struct virtio_lo_config_page {
+	__u32 seq;
+	__u32 generation;
+	__u32 size; /* OUT */
+	__u32 padding;
+	__u8 config[];
 };
 
 struct virtio_lo_config {
@@ -44,20 +184,270 @@ struct virtio_lo_kick {
 	__s32 qidx; /* IN */
 };
 
+/* Maximum number of entries accepted by VIRTIO_LO_KICK_BATCH */
+#define VIRTIO_LO_KICK_BATCH_MAX 1024
+
+/* Kicks are delivered once per (idx, qidx) pair regardless of how many
+ * times the pair is repeated in the array; a qidx == -1 entry covers all
+ * the queues of its device. Nothing is delivered if any entry is invalid. */
+struct virtio_lo_kick_batch {
+	__u32 nkicks; /* IN */
+	__u32 padding; /* IN */
+	const struct virtio_lo_kick *kicks; /* IN */
+};
+
+/* Per-queue counters, all of them count since the device creation */
+struct virtio_lo_qstats {
+	/* driver -> device notifications */
+	__u64 notifications;
+	/* buffers made available without a notification of their own */
+	__u64 notifications_suppressed;
+	/* device -> driver interrupts delivered */
+	__u64 interrupts;
+	/* kicks dropped because the driver did not ask for an interrupt */
+	__u64 interrupts_suppressed;
+};
+
+struct virtio_lo_stats {
+	__u32 idx; /* IN */
+	__u32 nqueues; /* IN/OUT: size of qstats array / queues reported */
+	struct virtio_lo_qstats *qstats; /* OUT */
+};
+
+/* if qidx == -1, the settings apply to all the queues */
+struct virtio_lo_poll {
+	__u32 idx; /* IN */
+	__s32 qidx; /* IN */
+	/* 0 disables polling of the queue */
+	__u32 idle_usecs; /* IN */
+	/* 0 selects the default */
+	__u32 budget; /* IN */
+};
+
+/* Interrupt moderation, if qidx == -1 the settings apply to all the queues.
+ * Kicks of the driver are merged into one interrupt that is delivered when
+ * max_frames kicks are pending or max_usecs after the first pending one,
+ * whichever comes first. max_frames == 0 means no limit, max_frames <= 1
+ * together with max_usecs == 0 disables the moderation. max_usecs is
+ * required if max_frames > 1. Busy polling is not moderated. */
+struct virtio_lo_coalesce {
+	__u32 idx; /* IN */
+	__s32 qidx; /* IN */
+	__u32 max_frames; /* IN */
+	__u32 max_usecs; /* IN */
+};
+
+/* CPU the interrupts of a queue are delivered on, if qidx == -1 of all
+ * the queues. With cpu == -1 the affinity requested by the driver is used
+ * and without it the interrupt runs on the CPU of the kick. */
+struct virtio_lo_affinity {
+	__u32 idx; /* IN */
+	__s32 qidx; /* IN */
+	__s32 cpu; /* IN */
+	__u32 padding; /* IN */
+};
+
+/* status written by the driver, value is the status */
+#define VIRTIO_LO_EVENT_STATUS 1
+/* the driver has reset the device */
+#define VIRTIO_LO_EVENT_RESET 2
+/* features negotiated, value is the features */
+#define VIRTIO_LO_EVENT_FEATURES 3
+/* queue qidx set up by the driver, size and ring addresses are set */
+#define VIRTIO_LO_EVENT_QUEUE_SETUP 4
+/* queue qidx deleted by the driver, its rings must not be accessed */
+#define VIRTIO_LO_EVENT_QUEUE_DEL 5
+/* value events have been lost since the previous read, idx is -1 */
+#define VIRTIO_LO_EVENT_LOST 6
+
+struct virtio_lo_event {
+	__u32 type;
+	__u32 idx;
+	__u32 qidx;
+	__u32 size;
+	__u64 value;
+	__u64 desc;
+	__u64 avail;
+	__u64 used;
+};
+
+struct virtio_lo_queue_fd {
+	__u32 idx; /* IN */
+	__u32 qidx; /* IN */
+};
+
+/* Returned by read() of a queue file given a large enough buffer */
+struct virtio_lo_queue_notify {
+	/* notifications since the previous read */
+	__u64 count;
+	/* VIRTIO_F_NOTIFICATION_DATA value of the latest notification: the
+	 * queue index in bits 0-15 and the avail index in bits 16-31, 0 if
+	 * the feature has not been negotiated */
+	__u32 data;
+	__u32 padding;
+};
+
+/* mmap offsets of the regions of a device file */
+#define VIRTIO_LO_REGION_SHIFT 40
+#define VIRTIO_LO_REGION_OFFSET(region)                                        \
+	((__u64)(region) << VIRTIO_LO_REGION_SHIFT)
+
+/* memory pool, see VIRTIO_LO_F_POOL */
+#define VIRTIO_LO_REGION_POOL 0
+/* driver memory window, see VIRTIO_LO_F_WINDOW */
+#define VIRTIO_LO_REGION_WINDOW 1
+/* busy polling state, see VIRTIO_LO_F_POLL */
+#define VIRTIO_LO_REGION_POLL 2
+/* notification doorbells, see VIRTIO_LO_F_DOORBELL */
+#define VIRTIO_LO_REGION_DOORBELL 3
+/* config space, see struct virtio_lo_config_page */
+#define VIRTIO_LO_REGION_CONFIG 4
+/* shared memory region with the given id, see struct virtio_lo_shm */
+#define VIRTIO_LO_REGION_SHM(id) (0x100 + (id))
+
+/* Notification data
+ *
+ * VIRTIO_F_NOTIFICATION_DATA may be offered for split rings. When the
+ * driver accepts it, the data of the latest notification (queue index and
+ * new avail index) is returned by read() of the queue file, so the backend
+ * knows which descriptors to fetch without reading avail->idx. The doorbell
+ * page carries the avail index regardless of the feature. The feature is
+ * not negotiated for packed rings. */
+
+/* Notification suppression
+ *
+ * Kicks of the driver (VIRTIO_LO_KICK, VIRTIO_LO_KICK_BATCH, call eventfds
+ * and queue files) are checked against the split ring state before an
+ * interrupt is injected: if VIRTIO_RING_F_EVENT_IDX has been negotiated,
+ * the interrupt is delivered only if the used index has passed used_event
+ * (avail->ring[size]) since the previous interrupt, otherwise it is dropped
+ * when the driver has set VRING_AVAIL_F_NO_INTERRUPT. The backend may thus
+ * kick after every completion and leave the filtering to the module.
+ *
+ * In the other direction the driver already honours avail_event
+ * (used->ring[size]) and VRING_USED_F_NO_NOTIFY, so a backend that offers
+ * VIRTIO_RING_F_EVENT_IDX must keep avail_event up to date, otherwise it
+ * will not be notified.
+ *
+ * For packed rings the kick is dropped if the driver event suppression
+ * structure says VRING_PACKED_EVENT_FLAG_DISABLE. Descriptor specific
+ * events (VRING_PACKED_EVENT_FLAG_DESC) always interrupt the driver. The
+ * device event suppression structure is to be maintained by the backend. */
+
+/* Asynchronous creation
+ *
+ * With VIRTIO_LO_F_ASYNC, VIRTIO_LO_ADDDEV only validates the devinfo,
+ * sets idx and returns, the driver parts of several devices are then
+ * probed concurrently. done_fd (if not -1) is signalled when the probe
+ * has finished. VIRTIO_LO_ADDDEV_RESULT with the same devinfo (idx, qinfo
+ * and config) then waits for the probe if needed and fills in the OUT
+ * fields like a synchronous VIRTIO_LO_ADDDEV would, the device can be
+ * used only after that. If the driver failed to probe, the device is
+ * deleted and the ioctl fails with ENOENT.
+ *
+ * VIRTIO_LO_ADDDEV_BULK creates ndevs devices this way and returns the
+ * number of devices created. If it is less than ndevs, creation of the
+ * next one failed. */
+
+/* Events
+ *
+ * Devices created with VIRTIO_LO_F_EVENTS queue a struct virtio_lo_event
+ * on the owner file when the driver changes the status, resets the device,
+ * negotiates the features or sets up and deletes queues, in the order the
+ * driver did it. read() on the owner file returns as many whole events as
+ * fit in the buffer and blocks (unless O_NONBLOCK) if there are none,
+ * poll() reports EPOLLIN when there are events to read. Up to
+ * VIRTIO_LO_EVENTS_MAX events are kept, further ones are counted by a
+ * VIRTIO_LO_EVENT_LOST event and the backend should then re-query the
+ * state it is interested in. */
+#define VIRTIO_LO_EVENTS_MAX 256
+
+/* Busy polling
+ *
+ * On a device created with VIRTIO_LO_F_POLL, a kernel thread can watch the
+ * used index of split rings and deliver the completions to the driver, so
+ * that the backend does not have to kick. Polling of a queue starts when
+ * the driver notifies it and stops idle_usecs after the last notification
+ * or completion, after that the queue falls back to kicks. The thread
+ * handles up to budget completions of a queue before it lets other tasks
+ * run (64 by default). Packed rings are not polled.
+ *
+ * VIRTIO_LO_REGION_POLL of the device file is a read-only array of __u32,
+ * one per queue, which is non-zero while the queue is polled. After
+ * publishing used->idx, the backend should issue a full memory barrier and
+ * kick only if the entry of the queue is zero. Completions that race with
+ * the end of polling are picked up by the thread itself. */
+
 /* ioctls for virtio_lo */
 #define VIRTIO_LOIO 0x50
 
 /* ioctl for creating virtio device */
 #define VIRTIO_LO_ADDDEV _IOWR(VIRTIO_LOIO, 1, struct virtio_lo_devinfo)
+#define VIRTIO_LO_ADDDEV_VER0                                                  \
+	_IOC(_IOC_READ | _IOC_WRITE, VIRTIO_LOIO, 1,                           \
+	     VIRTIO_LO_DEVINFO_SIZE_VER0)
 #define VIRTIO_LO_DELDEV _IOW(VIRTIO_LOIO, 2, unsigned)
+/* collect a device created with VIRTIO_LO_F_ASYNC */
+#define VIRTIO_LO_ADDDEV_RESULT _IOWR(VIRTIO_LOIO, 3, struct virtio_lo_devinfo)
+/* create several devices with VIRTIO_LO_F_ASYNC */
+#define VIRTIO_LO_ADDDEV_BULK                                                  \
+	_IOW(VIRTIO_LOIO, 4, const struct virtio_lo_adddev_bulk)
 
 /* ioctls for configuration */
 /* get config for device */
 #define VIRTIO_LO_GCONF _IOR(VIRTIO_LOIO, 20, struct virtio_lo_config)
 /* set config for device */
 #define VIRTIO_LO_SCONF _IOW(VIRTIO_LOIO, 21, const struct virtio_lo_config)
+/* notify the driver of a config change made in VIRTIO_LO_REGION_CONFIG */
+#define VIRTIO_LO_CONFIG_CHANGED _IOW(VIRTIO_LOIO, 22, unsigned)
 
 /* ioctls for kicking driver */
 #define VIRTIO_LO_KICK _IOW(VIRTIO_LOIO, 30, const struct virtio_lo_config)
+/* kick several queues of several devices in one call */
+#define VIRTIO_LO_KICK_BATCH                                                   \
+	_IOW(VIRTIO_LOIO, 31, const struct virtio_lo_kick_batch)
+
+/* Returns a file descriptor dedicated to one queue of a device:
+ *  - read() returns the number of driver notifications since the previous
+ *    read as __u64 and blocks (unless O_NONBLOCK) if there were none. If
+ *    the buffer fits struct virtio_lo_queue_notify, the notification data
+ *    is returned as well,
+ *  - poll() reports EPOLLIN when there are notifications to read and
+ *    EPOLLHUP when the device has been deleted,
+ *  - mmap() at offset 0 maps the vring of the queue. For split rings desc
+ *    is at the beginning of the mapping, avail and used are at the same
+ *    offsets from desc as their addresses in virtio_lo_qinfo. For packed
+ *    rings the descriptor ring is followed by one page with the driver
+ *    event suppression structure and then one page with the device event
+ *    suppression structure, each at the beginning of its page. The mapping
+ *    keeps the rings it was made of, it has to be redone once the driver
+ *    has set the queue up again. The rings cannot be mapped once
+ *    VIRTIO_F_ACCESS_PLATFORM has been negotiated, unless the device has
+ *    a window (their addresses are DMA addresses),
+ *  - VIRTIO_LO_QUEUE_KICK ioctl kicks the driver for this queue.
+ * The descriptor holds a reference to the device, but not to the owner. */
+#define VIRTIO_LO_QUEUE_FD _IOW(VIRTIO_LOIO, 40, const struct virtio_lo_queue_fd)
+
+/* set busy polling parameters of queues */
+#define VIRTIO_LO_SET_POLL _IOW(VIRTIO_LOIO, 60, const struct virtio_lo_poll)
+
+/* set interrupt moderation of queues */
+#define VIRTIO_LO_SET_COALESCE                                                 \
+	_IOW(VIRTIO_LOIO, 61, const struct virtio_lo_coalesce)
+
+/* set the CPU interrupts of queues are delivered on */
+#define VIRTIO_LO_SET_AFFINITY                                                 \
+	_IOW(VIRTIO_LOIO, 62, const struct virtio_lo_affinity)
+
+/* get queue statistics of a device */
+#define VIRTIO_LO_GSTATS _IOWR(VIRTIO_LOIO, 50, struct virtio_lo_stats)
+
+/* Returns a file descriptor for the device with the given idx. The regions
+ * of the device are mmapped from it at VIRTIO_LO_REGION_OFFSET(region).
+ * The descriptor holds a reference to the device, but not to the owner. */
+#define VIRTIO_LO_DEVICE_FD _IOW(VIRTIO_LOIO, 42, unsigned)
+
+/* ioctls for queue file descriptors */
+#define VIRTIO_LO_QUEUE_KICK _IO(VIRTIO_LOIO, 41)
 
 #endif /* _UAPI__VIRTIO_LO_H */
@@ -0,0 +1,563 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2022  Panasonic Automotive Systems, Co., Ltd.
+ */
+
+#include <linux/debugfs.h>
+#include <linux/delay.h>
+#include <linux/module.h>
+#include <linux/scatterlist.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/virtio.h>
+#include <linux/virtio_config.h>
+#include <linux/wait.h>
+
+#include "virtio_lo_bench.h"
+
+/* Latency histogram: values below VLB_HIST_SUB have a bucket each, every
+ * power of 2 above is split in VLB_HIST_SUB buckets, so percentiles are
+ * within 1/VLB_HIST_SUB of the real value. */
+#define VLB_HIST_SUB_BITS 5
+#define VLB_HIST_SUB (1U << VLB_HIST_SUB_BITS)
+#define VLB_HIST_SIZE ((64 - VLB_HIST_SUB_BITS + 1) * VLB_HIST_SUB)
+
+/* longest run, and the time the device has to return the requests after */
+#define VLB_MAX_MSECS 60000
+#define VLB_DRAIN_TIMEOUT (5 * HZ)
+
+static struct dentry *vlb_debugfs;
+
+struct vlb_req {
+	u64 start;
+	__u32 status;
+	/* followed by the payload, both go to the device */
+	struct virtio_lo_bench_req hdr;
+};
+
+struct vlb_queue {
+	struct virtio_lo_bench *vb;
+	struct virtqueue *vq;
+	spinlock_t lock;
+
+	struct vlb_req **reqs;
+	unsigned nreqs;
+	u64 seq;
+	/* requests added, and the ones among them not notified yet */
+	unsigned inflight;
+	unsigned pending;
+
+	/* statistics of the current run */
+	u64 completed;
+	u64 kicks;
+	u64 callbacks;
+	u64 lat_max;
+	u32 *hist;
+};
+
+struct vlb_result {
+	u64 requests;
+	u64 duration_ns;
+	u64 kicks;
+	u64 callbacks;
+	u64 lat_max;
+	u64 lat_p50;
+	u64 lat_p90;
+	u64 lat_p99;
+	u64 lat_p999;
+};
+
+struct virtio_lo_bench {
+	struct virtio_device *vdev;
+	struct dentry *debugfs;
+	/* serializes the runs */
+	struct mutex lock;
+
+	unsigned nqueues;
+	struct vlb_queue *queues;
+
+	/* parameters of the current run */
+	unsigned batch;
+	unsigned size;
+	bool stop;
+	wait_queue_head_t drained;
+	/* requests are still held by a device that did not return them */
+	bool broken;
+
+	struct vlb_result result;
+};
+
+static unsigned vlb_hist_idx(u64 v)
+{
+	unsigned shift;
+
+	if (v < VLB_HIST_SUB) {
+		return v;
+	}
+	shift = fls64(v) - 1 - VLB_HIST_SUB_BITS;
+	return (shift + 1) * VLB_HIST_SUB + (v >> shift) - VLB_HIST_SUB;
+}
+
+/* lowest value of the bucket */
+static u64 vlb_hist_value(unsigned idx)
+{
+	unsigned shift;
+
+	if (idx < VLB_HIST_SUB) {
+		return idx;
+	}
+	shift = idx / VLB_HIST_SUB - 1;
+	return (u64)(idx % VLB_HIST_SUB + VLB_HIST_SUB) << shift;
+}
+
+static int vlb_submit(struct vlb_queue *q, struct vlb_req *req)
+{
+	struct scatterlist out, in, *sgs[] = { &out, &in };
+	int ret;
+
+	req->hdr.seq = q->seq++;
+	req->start = ktime_get_ns();
+	req->hdr.ts = req->start;
+	req->status = ~0U;
+	sg_init_one(&out, &req->hdr, sizeof(req->hdr) + q->vb->size);
+	sg_init_one(&in, &req->status, sizeof(req->status));
+	ret = virtqueue_add_sgs(q->vq, sgs, 1, 1, req, GFP_ATOMIC);
+	if (ret) {
+		return ret;
+	}
+	q->inflight++;
+	q->pending++;
+	return 0;
+}
+
+/* Notifies once batch requests are pending, or right away if the device
+ * has nothing else to complete */
+static void vlb_kick(struct vlb_queue *q)
+{
+	if (!q->pending ||
+	    (q->pending < q->vb->batch && q->pending != q->inflight)) {
+		return;
+	}
+	if (virtqueue_kick_prepare(q->vq)) {
+		virtqueue_notify(q->vq);
+		q->kicks++;
+	}
+	q->pending = 0;
+}
+
+static void vlb_done(struct virtqueue *vq)
+{
+	struct virtio_lo_bench *vb = vq->vdev->priv;
+	struct vlb_queue *q = &vb->queues[vq->index];
+	struct vlb_req *req;
+	unsigned long flags;
+	unsigned len;
+	bool idle;
+
+	spin_lock_irqsave(&q->lock, flags);
+	q->callbacks++;
+	while ((req = virtqueue_get_buf(vq, &len))) {
+		u64 lat = ktime_get_ns() - req->start;
+
+		q->inflight--;
+		q->completed++;
+		q->hist[vlb_hist_idx(lat)]++;
+		if (lat > q->lat_max) {
+			q->lat_max = lat;
+		}
+		if (!READ_ONCE(vb->stop)) {
+			vlb_submit(q, req);
+		}
+	}
+	vlb_kick(q);
+	idle = !q->inflight;
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	if (idle) {
+		wake_up(&vb->drained);
+	}
+}
+
+static bool vlb_idle(struct virtio_lo_bench *vb)
+{
+	unsigned i;
+
+	for (i = 0; i < vb->nqueues; i++) {
+		if (READ_ONCE(vb->queues[i].inflight)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void vlb_free_reqs(struct virtio_lo_bench *vb)
+{
+	unsigned i, j;
+
+	for (i = 0; i < vb->nqueues; i++) {
+		struct vlb_queue *q = &vb->queues[i];
+
+		for (j = 0; j < q->nreqs; j++) {
+			kfree(q->reqs[j]);
+		}
+		kfree(q->reqs);
+		q->reqs = NULL;
+		q->nreqs = 0;
+	}
+}
+
+static int vlb_alloc_reqs(struct virtio_lo_bench *vb, unsigned depth)
+{
+	unsigned i, j;
+
+	for (i = 0; i < vb->nqueues; i++) {
+		struct vlb_queue *q = &vb->queues[i];
+
+		q->reqs = kcalloc(depth, sizeof(*q->reqs), GFP_KERNEL);
+		if (!q->reqs) {
+			goto err;
+		}
+		for (j = 0; j < depth; j++) {
+			q->reqs[j] = kzalloc(sizeof(struct vlb_req) + vb->size,
+					     GFP_KERNEL);
+			if (!q->reqs[j]) {
+				goto err;
+			}
+			q->nreqs++;
+		}
+	}
+	return 0;
+err:
+	vlb_free_reqs(vb);
+	return -ENOMEM;
+}
+
+static u64 vlb_percentile(const u32 *hist, u64 total, unsigned permille)
+{
+	u64 target = div_u64(total * permille + 999, 1000);
+	u64 sum = 0;
+	unsigned i;
+
+	for (i = 0; i < VLB_HIST_SIZE; i++) {
+		sum += hist[i];
+		if (sum && sum >= target) {
+			return vlb_hist_value(i);
+		}
+	}
+	return 0;
+}
+
+static int vlb_collect(struct virtio_lo_bench *vb, u64 duration_ns)
+{
+	struct vlb_result *r = &vb->result;
+	unsigned i, j;
+	u32 *hist;
+
+	hist = kcalloc(VLB_HIST_SIZE, sizeof(*hist), GFP_KERNEL);
+	if (!hist) {
+		return -ENOMEM;
+	}
+	memset(r, 0, sizeof(*r));
+	r->duration_ns = duration_ns;
+	for (i = 0; i < vb->nqueues; i++) {
+		struct vlb_queue *q = &vb->queues[i];
+
+		r->requests += q->completed;
+		r->kicks += q->kicks;
+		r->callbacks += q->callbacks;
+		r->lat_max = max(r->lat_max, q->lat_max);
+		for (j = 0; j < VLB_HIST_SIZE; j++) {
+			hist[j] += q->hist[j];
+		}
+	}
+	r->lat_p50 = vlb_percentile(hist, r->requests, 500);
+	r->lat_p90 = vlb_percentile(hist, r->requests, 900);
+	r->lat_p99 = vlb_percentile(hist, r->requests, 990);
+	r->lat_p999 = vlb_percentile(hist, r->requests, 999);
+	kfree(hist);
+	return 0;
+}
+
+static int vlb_run(struct virtio_lo_bench *vb, unsigned depth, unsigned batch,
+		   unsigned msecs, unsigned size)
+{
+	u64 start;
+	unsigned i, j;
+	int ret;
+
+	if (vb->broken) {
+		return -EIO;
+	}
+	if (!depth || !batch || batch > depth || !msecs ||
+	    msecs > VLB_MAX_MSECS || size > VIRTIO_LO_BENCH_MAX_SIZE) {
+		return -EINVAL;
+	}
+	/* two descriptors per request */
+	for (i = 0; i < vb->nqueues; i++) {
+		if (depth > virtqueue_get_vring_size(vb->queues[i].vq) / 2) {
+			return -EINVAL;
+		}
+	}
+
+	vb->batch = batch;
+	vb->size = size;
+	ret = vlb_alloc_reqs(vb, depth);
+	if (ret) {
+		return ret;
+	}
+	for (i = 0; i < vb->nqueues; i++) {
+		struct vlb_queue *q = &vb->queues[i];
+
+		q->completed = 0;
+		q->kicks = 0;
+		q->callbacks = 0;
+		q->lat_max = 0;
+		memset(q->hist, 0, VLB_HIST_SIZE * sizeof(*q->hist));
+	}
+
+	WRITE_ONCE(vb->stop, false);
+	start = ktime_get_ns();
+	for (i = 0; i < vb->nqueues; i++) {
+		struct vlb_queue *q = &vb->queues[i];
+
+		spin_lock_irq(&q->lock);
+		for (j = 0; j < depth; j++) {
+			ret = vlb_submit(q, q->reqs[j]);
+			if (ret) {
+				break;
+			}
+			vlb_kick(q);
+		}
+		spin_unlock_irq(&q->lock);
+		if (ret) {
+			break;
+		}
+	}
+
+	if (!ret) {
+		msleep_interruptible(msecs);
+	}
+	WRITE_ONCE(vb->stop, true);
+	if (!wait_event_timeout(vb->drained, vlb_idle(vb),
+				VLB_DRAIN_TIMEOUT)) {
+		dev_err(&vb->vdev->dev, "requests not returned by the device\n");
+		/* they are freed once the device is reset */
+		vb->broken = true;
+		return -ETIMEDOUT;
+	}
+	if (!ret) {
+		ret = vlb_collect(vb, ktime_get_ns() - start);
+	}
+	vlb_free_reqs(vb);
+	return ret;
+}
+
+static int vlb_run_show(struct seq_file *s, void *unused)
+{
+	struct virtio_lo_bench *vb = s->private;
+	struct vlb_result *r;
+	int ret;
+
+	ret = mutex_lock_interruptible(&vb->lock);
+	if (ret) {
+		return ret;
+	}
+	r = &vb->result;
+	seq_printf(s, "requests %llu\n", r->requests);
+	seq_printf(s, "duration_ns %llu\n", r->duration_ns);
+	seq_printf(s, "kicks %llu\n", r->kicks);
+	seq_printf(s, "callbacks %llu\n", r->callbacks);
+	seq_printf(s, "lat_p50_ns %llu\n", r->lat_p50);
+	seq_printf(s, "lat_p90_ns %llu\n", r->lat_p90);
+	seq_printf(s, "lat_p99_ns %llu\n", r->lat_p99);
+	seq_printf(s, "lat_p999_ns %llu\n", r->lat_p999);
+	seq_printf(s, "lat_max_ns %llu\n", r->lat_max);
+	mutex_unlock(&vb->lock);
+	return 0;
+}
+
+static int vlb_run_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, vlb_run_show, inode->i_private);
+}
+
+static ssize_t vlb_run_write(struct file *file, const char __user *ubuf,
+			     size_t count, loff_t *ppos)
+{
+	struct virtio_lo_bench *vb = file_inode(file)->i_private;
+	unsigned depth, batch, msecs, size;
+	char buf[64];
+	int ret;
+
+	if (count >= sizeof(buf)) {
+		return -EINVAL;
+	}
+	if (copy_from_user(buf, ubuf, count)) {
+		return -EFAULT;
+	}
+	buf[count] = '\0';
+	if (sscanf(buf, "%u %u %u %u", &depth, &batch, &msecs, &size) != 4) {
+		return -EINVAL;
+	}
+
+	ret = mutex_lock_interruptible(&vb->lock);
+	if (ret) {
+		return ret;
+	}
+	ret = vlb_run(vb, depth, batch, msecs, size);
+	mutex_unlock(&vb->lock);
+
+	return ret ? ret : count;
+}
+
+static const struct file_operations vlb_run_fops = {
+	.owner = THIS_MODULE,
+	.open = vlb_run_open,
+	.read = seq_read,
+	.write = vlb_run_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void vlb_free(struct virtio_lo_bench *vb)
+{
+	unsigned i;
+
+	for (i = 0; i < vb->nqueues; i++) {
+		kfree(vb->queues[i].hist);
+	}
+	kfree(vb->queues);
+	kfree(vb);
+}
+
+static int vlb_probe(struct virtio_device *vdev)
+{
+	struct virtio_lo_bench *vb;
+	struct virtqueue **vqs;
+	vq_callback_t **callbacks;
+	const char **names;
+	char name[16];
+	unsigned i;
+	u32 id;
+	int ret;
+
+	vb = kzalloc(sizeof(*vb), GFP_KERNEL);
+	if (!vb) {
+		return -ENOMEM;
+	}
+	vb->vdev = vdev;
+	mutex_init(&vb->lock);
+	init_waitqueue_head(&vb->drained);
+	id = virtio_cread32(vdev, offsetof(struct virtio_lo_bench_config, id));
+	vb->nqueues = virtio_cread32(
+		vdev, offsetof(struct virtio_lo_bench_config, nqueues));
+	if (!vb->nqueues) {
+		kfree(vb);
+		return -EINVAL;
+	}
+
+	vb->queues = kcalloc(vb->nqueues, sizeof(*vb->queues), GFP_KERNEL);
+	vqs = kcalloc(vb->nqueues, sizeof(*vqs), GFP_KERNEL);
+	callbacks = kcalloc(vb->nqueues, sizeof(*callbacks), GFP_KERNEL);
+	names = kcalloc(vb->nqueues, sizeof(*names), GFP_KERNEL);
+	if (!vb->queues || !vqs || !callbacks || !names) {
+		ret = -ENOMEM;
+		goto err;
+	}
+	for (i = 0; i < vb->nqueues; i++) {
+		struct vlb_queue *q = &vb->queues[i];
+
+		q->vb = vb;
+		spin_lock_init(&q->lock);
+		q->hist = kcalloc(VLB_HIST_SIZE, sizeof(*q->hist), GFP_KERNEL);
+		if (!q->hist) {
+			ret = -ENOMEM;
+			goto err;
+		}
+		callbacks[i] = vlb_done;
+		names[i] = "bench";
+	}
+
+	vdev->priv = vb;
+	ret = virtio_find_vqs(vdev, vb->nqueues, vqs, callbacks, names, NULL);
+	if (ret) {
+		goto err;
+	}
+	for (i = 0; i < vb->nqueues; i++) {
+		vb->queues[i].vq = vqs[i];
+	}
+	virtio_device_ready(vdev);
+
+	snprintf(name, sizeof(name), "%u", id);
+	vb->debugfs = debugfs_create_dir(name, vlb_debugfs);
+	debugfs_create_file("run", 0600, vb->debugfs, vb, &vlb_run_fops);
+
+	kfree(names);
+	kfree(callbacks);
+	kfree(vqs);
+	return 0;
+err:
+	kfree(names);
+	kfree(callbacks);
+	kfree(vqs);
+	vlb_free(vb);
+	return ret;
+}
+
+static void vlb_remove(struct virtio_device *vdev)
+{
+	struct virtio_lo_bench *vb = vdev->priv;
+
+	/* waits for a run in progress */
+	debugfs_remove_recursive(vb->debugfs);
+	vdev->config->reset(vdev);
+	vdev->config->del_vqs(vdev);
+	vlb_free_reqs(vb);
+	vlb_free(vb);
+}
+
+static const struct virtio_device_id vlb_id_table[] = {
+	{ VIRTIO_LO_BENCH_DEVICE_ID, VIRTIO_DEV_ANY_ID },
+	{ 0 },
+};
+MODULE_DEVICE_TABLE(virtio, vlb_id_table);
+
+static unsigned int vlb_features[] = {
+	VIRTIO_RING_F_EVENT_IDX,
+	VIRTIO_RING_F_INDIRECT_DESC,
+};
+
+static struct virtio_driver vlb_driver = {
+	.feature_table = vlb_features,
+	.feature_table_size = ARRAY_SIZE(vlb_features),
+	.driver.name = KBUILD_MODNAME,
+	.driver.owner = THIS_MODULE,
+	.id_table = vlb_id_table,
+	.probe = vlb_probe,
+	.remove = vlb_remove,
+};
+
+static int __init vlb_init(void)
+{
+	int ret;
+
+	vlb_debugfs = debugfs_create_dir("virtio-lo-bench", NULL);
+	ret = register_virtio_driver(&vlb_driver);
+	if (ret) {
+		debugfs_remove(vlb_debugfs);
+	}
+	return ret;
+}
+
+static void __exit vlb_exit(void)
+{
+	unregister_virtio_driver(&vlb_driver);
+	debugfs_remove(vlb_debugfs);
+}
+
+module_init(vlb_init);
+module_exit(vlb_exit);
+
+MODULE_DESCRIPTION("Benchmark driver for virtio-lo devices");
+MODULE_LICENSE("GPL");
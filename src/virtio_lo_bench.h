@@ -0,0 +1,45 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2022  Panasonic Automotive Systems, Co., Ltd.
+ */
+
+#ifndef _UAPI__VIRTIO_LO_BENCH_H
+#define _UAPI__VIRTIO_LO_BENCH_H
+
+#include <linux/types.h>
+
+/* Benchmark device served by the virtio_lo_bench driver
+ *
+ * Every queue carries requests made of one readable buffer, starting with
+ * struct virtio_lo_bench_req and followed by the payload, and one writable
+ * __u32 status. The device completes them in any order, writing the status
+ * (0 for success) and returning a used length of 4.
+ *
+ * The driver creates a debugfs directory virtio-lo-bench/<id>, with id
+ * taken from the config space. A run is started by writing
+ * "<depth> <batch> <msecs> <size>" to its "run" file: every queue then
+ * keeps depth requests of size payload bytes in flight for msecs, and the
+ * driver notifies the device once per batch requests (or when the device
+ * holds nothing). The write returns when the run is over and reading the
+ * file gives the results of the last run. */
+
+/* outside of the range assigned by the virtio specification */
+#define VIRTIO_LO_BENCH_DEVICE_ID 0xfff0
+
+/* largest payload of a request */
+#define VIRTIO_LO_BENCH_MAX_SIZE 65536
+
+struct virtio_lo_bench_config {
+	/* chosen by the backend to find the device in debugfs */
+	__u32 id;
+	__u32 nqueues;
+};
+
+struct virtio_lo_bench_req {
+	/* sequence number of the request in its queue */
+	__u64 seq;
+	/* time of submission, in ns of the driver clock */
+	__u64 ts;
+};
+
+#endif /* _UAPI__VIRTIO_LO_BENCH_H */
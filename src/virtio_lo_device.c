@@ -3,23 +3,54 @@
  * Copyright (c) 2022  Panasonic Automotive Systems, Co., Ltd.
  */
 
+#include <linux/anon_inodes.h>
 #include <linux/atomic.h>
+#include <linux/capability.h>
+#include <linux/debugfs.h>
+#include <linux/dma-map-ops.h>
+#include <linux/dma-mapping.h>
 #include <linux/eventfd.h>
+#include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/highmem.h>
+#include <linux/idr.h>
+#include <linux/ioport.h>
+#include <linux/irq_work.h>
+#include <linux/kfifo.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/mount.h>
 #include <linux/platform_device.h>
+#include <linux/poll.h>
+#include <linux/pseudo_fs.h>
+#include <linux/rcupdate.h>
+#include <linux/refcount.h>
+#include <linux/scatterlist.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/sizes.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
 #include <linux/uaccess.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/virtio_ring.h>
 #include <linux/workqueue.h>
+#include <linux/xarray.h>
 
+#include <uapi/linux/vduse.h>
 #include <uapi/linux/virtio_config.h>
 
 #include "virtio_lo_device.h"
+#include "virtio_lo_pool.h"
+#include "virtio_lo_trace.h"
 #include "virtio_lo.h"
 
-static void virtio_lo_add_pdev(struct work_struct *work);
+static void virtio_lo_add_driver(struct work_struct *work);
+static void vilo_vduse_flush(struct virtio_lo_vduse *v);
+static void vilo_window_revoke(struct work_struct *work);
+static int vilo_config_publish(struct virtio_lo_device *dev);
 
 void vl_device_parent_release(struct device *dev)
 {
@@ -30,68 +61,282 @@ static struct device vl_device_parent = {
 	.release = vl_device_parent_release,
 };
 
-static atomic_t vilo_device_id;
+/* ids of the devices, see struct virtio_lo_device */
+static DEFINE_IDA(vilo_ida);
 static struct workqueue_struct *vilo_wq;
+static struct dentry *vilo_debugfs;
+
+/* off by default, the pool and the window give each backend access to its
+ * own devices only */
+static bool raw_mmap;
+module_param(raw_mmap, bool, 0444);
+MODULE_PARM_DESC(raw_mmap,
+		 "Allow mapping of any physical memory with /dev/virtio-lo (default off)");
+
+static unsigned long vduse_pool_size = SZ_64M;
+module_param(vduse_pool_size, ulong, 0444);
+MODULE_PARM_DESC(vduse_pool_size,
+		 "Size of the IOVA domain of devices created with VDUSE_CREATE_DEV");
+
+static unsigned long max_pool_size = SZ_256M;
+module_param(max_pool_size, ulong, 0444);
+MODULE_PARM_DESC(max_pool_size,
+		 "Largest memory pool of a device created with VIRTIO_LO_F_POOL");
+
+/* Maximum number of pages mapped by one window fault */
+#define VIRTIO_LO_WINDOW_FAULT_PAGES 512
+
+/* Flags of vilo_device_create() and vilo_device_finish() set by the kernel
+ * only */
+/* the qinfo entries have the layout of VIRTIO_LO_ADDDEV_VER0 */
+#define VILO_CREATE_QINFO_VER0 (1U << 0)
+/* no qinfo, the queues are set up later (VDUSE devices) */
+#define VILO_CREATE_NO_QINFO (1U << 1)
+
+/* vm_flags can only be changed through helpers since 6.3 */
+static inline void vilo_vm_flags_set(struct vm_area_struct *vma,
+				     vm_flags_t flags)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_set(vma, flags);
+#else
+	vma->vm_flags |= flags;
+#endif
+}
+
+static inline void vilo_vm_flags_clear(struct vm_area_struct *vma,
+				       vm_flags_t flags)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, flags);
+#else
+	vma->vm_flags &= ~flags;
+#endif
+}
+
+/* Window devices get an inode of their own for their device files, so that
+ * revoking the window does not touch the mappings of the other devices */
+#define VILO_FS_MAGIC 0x76696c6f
+
+static struct vfsmount *vilo_mnt;
+static int vilo_mnt_count;
+
+static int vilo_fs_init_fs_context(struct fs_context *fc)
+{
+	return init_pseudo(fc, VILO_FS_MAGIC) ? 0 : -ENOMEM;
+}
+
+static struct file_system_type vilo_fs_type = {
+	.name = "virtio_lo",
+	.owner = THIS_MODULE,
+	.init_fs_context = vilo_fs_init_fs_context,
+	.kill_sb = kill_anon_super,
+};
 
 /* Structure allocated on each open call to handle all virtual devices
  * provided by userspace program */
 struct virtio_lo_owner {
 	atomic_t lastidx;
+	/* idx -> struct virtio_lo_device, readers are RCU protected */
+	struct xarray devices;
+	/* idx -> struct virtio_lo_device created with VIRTIO_LO_F_ASYNC and
+	 * not collected yet */
+	struct xarray pending;
+
+	/* see VIRTIO_LO_F_EVENTS, written by the drivers of the devices */
+	spinlock_t events_lock;
+	DECLARE_KFIFO(events, struct virtio_lo_event, VIRTIO_LO_EVENTS_MAX);
+	u64 events_lost;
+	wait_queue_head_t events_wait;
+	/* serializes the readers, which only consume what they copied */
+	struct mutex events_read_lock;
+
+	/* idx -> struct virtio_lo_device created with VDUSE_CREATE_DEV */
+	struct xarray vduse;
+	/* keeps the names of the VDUSE devices unique */
+	struct mutex vduse_lock;
+};
+
+/* VDUSE personality of a device, see vilo_vduse_fops */
+struct virtio_lo_vduse {
+	char name[VDUSE_NAME_MAX];
+	/* size of the IOVA domain, which is the pool of the device */
+	u64 iova_size;
+
+	/* protects everything below */
 	spinlock_t lock;
-	struct list_head devlist;
+	/* requests not read yet and requests waiting for a response */
+	struct list_head send_list;
+	struct list_head recv_list;
+	wait_queue_head_t waitq;
+	u32 msg_id;
+	/* the device file is open */
+	bool connected;
+	/* all the queues have been set up, the driver part is being added */
+	bool started;
 };
 
-/* should be called with owner->lock held */
+struct vilo_vduse_msg {
+	struct vduse_dev_request req;
+	struct vduse_dev_response resp;
+	struct list_head list;
+	wait_queue_head_t waitq;
+	bool completed;
+};
+
+/* should be called under rcu_read_lock(), the device stays valid until
+ * rcu_read_unlock() */
+static inline struct virtio_lo_device *
+virtio_owner_getdev_rcu(struct virtio_lo_owner *owner, unsigned idx)
+{
+	return xa_load(&owner->devices, idx);
+}
+
+/* returns a referenced device, release it with virtio_lo_device_put() */
 static struct virtio_lo_device *
-virtio_owner_getdev_unlocked(struct virtio_lo_owner *owner, unsigned idx)
+virtio_owner_getdev(struct virtio_lo_owner *owner, unsigned idx)
 {
-	struct virtio_lo_device *ret = NULL, *dev;
-	list_for_each_entry (dev, &owner->devlist, devlist) {
-		if (dev->idx == idx) {
-			ret = dev;
-			break;
-		}
+	struct virtio_lo_device *dev;
+
+	rcu_read_lock();
+	dev = virtio_owner_getdev_rcu(owner, idx);
+	/* the owner reference is only dropped after an RCU grace period
+	 * following the removal from the array, so it is still held here */
+	if (dev) {
+		kref_get(&dev->kref);
 	}
-	return ret;
+	rcu_read_unlock();
+	return dev;
 }
-static inline struct virtio_lo_device *
-virtio_owner_getdev(struct virtio_lo_owner *owner, unsigned idx)
+
+/* Call eventfd: signals from the backend are turned into vring interrupts
+ * the same way KVM irqfd turns them into guest interrupts */
+
+static void vilo_call_inject(struct irq_work *work)
 {
-	unsigned long flags;
-	struct virtio_lo_device *ret;
+	struct virtio_lo_vq_info *info =
+		container_of(work, struct virtio_lo_vq_info, call_work);
+	virtio_lo_kick_driver(info->dev, info->qidx);
+}
 
-	spin_lock_irqsave(&owner->lock, flags);
-	ret = virtio_owner_getdev_unlocked(owner, idx);
-	spin_unlock_irqrestore(&owner->lock, flags);
-	return ret;
+/* called with the eventfd wait queue lock held */
+static int vilo_call_wakeup(wait_queue_entry_t *wait, unsigned mode, int sync,
+			    void *key)
+{
+	struct virtio_lo_vq_info *info =
+		container_of(wait, struct virtio_lo_vq_info, call_wait);
+
+	/* signals coming while the work is still pending are merged */
+	if (key_to_poll(key) & EPOLLIN) {
+		irq_work_queue(&info->call_work);
+	}
+	return 0;
+}
+
+static void vilo_call_queue_proc(struct file *file, wait_queue_head_t *wqh,
+				 poll_table *pt)
+{
+	struct virtio_lo_vq_info *info =
+		container_of(pt, struct virtio_lo_vq_info, call_pt);
+	add_wait_queue(wqh, &info->call_wait);
+}
+
+static int vilo_call_get(struct virtio_lo_vq_info *info, int fd)
+{
+	struct file *file;
+	struct eventfd_ctx *ctx;
+
+	file = fget(fd);
+	if (!file) {
+		return -EBADF;
+	}
+	ctx = eventfd_ctx_fileget(file);
+	if (IS_ERR(ctx)) {
+		fput(file);
+		return PTR_ERR(ctx);
+	}
+	info->driver_call = ctx;
+	info->driver_call_file = file;
+	return 0;
+}
+
+/* should be called only after the driver has set up the queue */
+static void vilo_call_arm(struct virtio_lo_vq_info *info)
+{
+	__poll_t events;
+
+	init_waitqueue_func_entry(&info->call_wait, vilo_call_wakeup);
+	init_poll_funcptr(&info->call_pt, vilo_call_queue_proc);
+	events = vfs_poll(info->driver_call_file, &info->call_pt);
+
+	fput(info->driver_call_file);
+	info->driver_call_file = NULL;
+
+	/* the eventfd could be signalled before we started watching it */
+	if (events & EPOLLIN) {
+		irq_work_queue(&info->call_work);
+	}
+}
+
+static void vilo_call_put(struct virtio_lo_vq_info *info)
+{
+	u64 cnt;
+
+	if (!info->driver_call) {
+		return;
+	}
+	if (info->driver_call_file) {
+		fput(info->driver_call_file);
+		info->driver_call_file = NULL;
+	} else {
+		eventfd_ctx_remove_wait_queue(info->driver_call,
+					      &info->call_wait, &cnt);
+		irq_work_sync(&info->call_work);
+	}
+	eventfd_ctx_put(info->driver_call);
+	info->driver_call = NULL;
+}
+
+static inline bool vilo_packed(struct virtio_lo_device *dev)
+{
+	return dev->features & BIT_ULL(VIRTIO_F_RING_PACKED);
 }
 
 static int virtio_lo_misc_device_open(struct inode *inode, struct file *file)
 {
 	struct virtio_lo_owner *owner;
 
-	owner = kmalloc(sizeof(*owner), GFP_KERNEL);
-	spin_lock_init(&owner->lock);
-	INIT_LIST_HEAD(&owner->devlist);
+	owner = kzalloc(sizeof(*owner), GFP_KERNEL);
+	if (!owner) {
+		return -ENOMEM;
+	}
+	xa_init(&owner->devices);
+	xa_init(&owner->pending);
+	xa_init(&owner->vduse);
+	spin_lock_init(&owner->events_lock);
+	INIT_KFIFO(owner->events);
+	init_waitqueue_head(&owner->events_wait);
+	mutex_init(&owner->events_read_lock);
+	mutex_init(&owner->vduse_lock);
 	file->private_data = owner;
 	return 0;
 }
 
-static void virtio_lo_device_release(struct virtio_lo_device *dev)
+static void virtio_lo_device_release(struct kref *kref)
 {
+	struct virtio_lo_device *dev =
+		container_of(kref, struct virtio_lo_device, kref);
 	unsigned long i;
 
-	dev->status = 0;
-	dev->device_features = 0;
-
-	platform_device_unregister(dev->pdev);
-
+	vfree(dev->config_page);
 	kfree(dev->config);
-	dev->config = NULL;
 
 	if (dev->config_kick) {
 		eventfd_ctx_put(dev->config_kick);
 	}
+	if (dev->done_kick) {
+		eventfd_ctx_put(dev->done_kick);
+	}
 
 	for (i = 0; i < dev->nqueues; i++) {
 		if (dev->queues[i].device_kick) {
@@ -99,27 +344,98 @@ static void virtio_lo_device_release(struct virtio_lo_device *dev)
 		}
 	}
 	kfree(dev->queues);
+	kfree(dev->shm);
+	vfree(dev->poll_state);
+	vfree(dev->doorbell);
+	xa_destroy(&dev->window);
+	xa_destroy(&dev->window_bounce);
+	if (dev->inode) {
+		iput(dev->inode);
+		simple_release_fs(&vilo_mnt, &vilo_mnt_count);
+	}
+	if (dev->pool) {
+		virtio_lo_pool_destroy(dev->pool);
+	}
+	kfree(dev->vduse);
+	ida_free(&vilo_ida, dev->id);
 	kfree(dev);
 	dev_notice(&vl_device_parent, "device released\n");
 }
 
+static inline void virtio_lo_device_put(struct virtio_lo_device *dev)
+{
+	kref_put(&dev->kref, virtio_lo_device_release);
+}
+
+/* Should be called after the device has been removed from the owner array.
+ * Waits for the lockless users to go away, unregisters the driver part
+ * and drops the owner reference. */
+static void virtio_lo_device_remove(struct virtio_lo_device *dev)
+{
+	unsigned long i;
+
+	trace_virtio_lo_device_remove(dev->idx);
+	WRITE_ONCE(dev->removed, true);
+	synchronize_rcu();
+	debugfs_remove(dev->debugfs);
+
+	if (dev->vduse) {
+		vilo_vduse_flush(dev->vduse);
+		/* the driver part may still be being added */
+		if (READ_ONCE(dev->vduse->started)) {
+			wait_for_completion(&dev->init_done);
+		}
+	}
+
+	for (i = 0; i < dev->nqueues; i++) {
+		wake_up_interruptible_poll(&dev->queues[i].notify_wait,
+					   EPOLLHUP);
+	}
+
+	atomic_set(&dev->status, 0);
+	dev->device_features = 0;
+
+	/* no interrupts should be injected after this point */
+	for (i = 0; i < dev->nqueues; i++) {
+		vilo_call_put(&dev->queues[i]);
+	}
+
+	/* direct devices have no platform device */
+	if (dev->pdev) {
+		platform_device_unregister(dev->pdev);
+	} else if (dev->driver) {
+		virtio_lo_driver_remove(dev);
+	}
+	/* the driver part is gone, nothing reports events to the owner */
+	dev->events = NULL;
+	virtio_lo_window_reset(dev);
+
+	virtio_lo_device_put(dev);
+}
+
 static int virtio_lo_misc_device_release(struct inode *inode, struct file *file)
 {
 	if (file->private_data) {
 		struct virtio_lo_owner *owner = file->private_data;
-		unsigned long flags;
-		spin_lock_irqsave(&owner->lock, flags);
-		while (!list_empty(&owner->devlist)) {
-			struct virtio_lo_device *dev =
-				list_first_entry(&owner->devlist,
-						 struct virtio_lo_device,
-						 devlist);
-			list_del(&dev->devlist);
-			spin_unlock_irqrestore(&owner->lock, flags);
-			virtio_lo_device_release(dev);
-			spin_lock_irqsave(&owner->lock, flags);
-		}
-		spin_unlock_irqrestore(&owner->lock, flags);
+		struct virtio_lo_device *dev;
+		unsigned long idx;
+
+		xa_for_each (&owner->devices, idx, dev) {
+			xa_erase(&owner->devices, idx);
+			virtio_lo_device_remove(dev);
+		}
+		xa_destroy(&owner->devices);
+		xa_for_each (&owner->pending, idx, dev) {
+			xa_erase(&owner->pending, idx);
+			wait_for_completion(&dev->init_done);
+			virtio_lo_device_remove(dev);
+		}
+		xa_destroy(&owner->pending);
+		xa_for_each (&owner->vduse, idx, dev) {
+			xa_erase(&owner->vduse, idx);
+			virtio_lo_device_remove(dev);
+		}
+		xa_destroy(&owner->vduse);
 		kfree(owner);
 	}
 	dev_notice(&vl_device_parent, "misc device released\n");
@@ -129,6 +445,9 @@ static int virtio_lo_misc_device_release(struct inode *inode, struct file *file)
 static int virtio_lo_misc_device_mmap(struct file *file,
 				      struct vm_area_struct *vma)
 {
+	if (!raw_mmap) {
+		return -EPERM;
+	}
 	/* Remap-pfn-range will mark the range VM_IO */
 	if (remap_pfn_range(vma, vma->vm_start, vma->vm_pgoff,
 			    vma->vm_end - vma->vm_start, vma->vm_page_prot)) {
@@ -137,65 +456,319 @@ static int virtio_lo_misc_device_mmap(struct file *file,
 	return 0;
 }
 
-static void virtio_lo_add_pdev(struct work_struct *work)
+static void virtio_lo_add_driver(struct work_struct *work)
 {
 	struct virtio_lo_device *dev =
 		container_of(work, struct virtio_lo_device, init_work);
-	unsigned id = atomic_fetch_add(1, &vilo_device_id);
-	dev->pdev = platform_device_register_data(
-		&vl_device_parent, "virtio-lo", id, &dev, sizeof(dev));
+	struct platform_device *pdev;
+
+	if (dev->direct) {
+		if (virtio_lo_driver_add(dev, &vl_device_parent)) {
+			dev_notice(&vl_device_parent,
+				   "cannot add virtio lo device\n");
+		}
+	} else {
+		pdev = platform_device_register_data(&vl_device_parent,
+						     "virtio-lo", dev->id, &dev,
+						     sizeof(dev));
+		dev->pdev = IS_ERR(pdev) ? NULL : pdev;
+	}
+	/* nobody collects VDUSE devices, a driver part that did not get to
+	 * DRIVER_OK goes away here */
+	if (dev->vduse && dev->pdev &&
+	    !(atomic_read(&dev->status) & VIRTIO_CONFIG_S_DRIVER_OK)) {
+		dev_notice(&vl_device_parent,
+			   "virtio lo device initialization failed\n");
+		platform_device_unregister(dev->pdev);
+		dev->pdev = NULL;
+	}
+	/* the device may be gone as soon as init_done is completed */
+	if (dev->done_kick) {
+		eventfd_signal(dev->done_kick, 1);
+	}
 	complete_all(&dev->init_done);
 }
 
-static long vilo_ioctl_adddev(struct virtio_lo_owner *owner,
-			      struct virtio_lo_devinfo __user *info)
+/* Debugfs */
+
+static int vilo_stats_show(struct seq_file *s, void *unused)
+{
+	struct virtio_lo_device *dev = s->private;
+	unsigned i, b;
+
+	for (i = 0; i < dev->nqueues; i++) {
+		struct virtio_lo_vq_stats *st = &dev->queues[i].stats;
+
+		seq_printf(s, "queue %u\n", i);
+		seq_printf(s, "  notifications: %lld\n",
+			   atomic64_read(&st->notifications));
+		seq_printf(s, "  notifications_suppressed: %lld\n",
+			   atomic64_read(&st->notifications_suppressed));
+		seq_printf(s, "  kicks: %lld\n", atomic64_read(&st->kicks));
+		seq_printf(s, "  interrupts: %lld\n",
+			   atomic64_read(&st->interrupts));
+		seq_printf(s, "  interrupts_suppressed: %lld\n",
+			   atomic64_read(&st->interrupts_suppressed));
+		seq_printf(s, "  spurious: %lld\n", atomic64_read(&st->spurious));
+		seq_printf(s, "  inflight_max: %u\n",
+			   READ_ONCE(st->inflight_max));
+		seq_puts(s, "  notify_to_used_ns:\n");
+		for (b = 0; b < VIRTIO_LO_RTT_BUCKETS; b++) {
+			s64 n = atomic64_read(&st->rtt[b]);
+
+			if (n) {
+				seq_printf(s, "    %llu: %lld\n", 1ULL << b, n);
+			}
+		}
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(vilo_stats);
+
+/* the directory is named like the platform device would be, idx is only
+ * unique per owner */
+static void vilo_debugfs_add(struct virtio_lo_device *dev)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "virtio-lo.%d", dev->id);
+	dev->debugfs = debugfs_create_dir(name, vilo_debugfs);
+	debugfs_create_file("stats", 0444, dev->debugfs, dev,
+			    &vilo_stats_fops);
+}
+
+/* Refuses the ranges claimed for exclusive use by a driver, the same way
+ * /dev/mem does */
+static int vilo_shm_check_free(u64 addr, u64 len)
+{
+	u64 off;
+
+	for (off = 0; off < len; off += PAGE_SIZE) {
+		if (iomem_is_exclusive(addr + off)) {
+			return -EBUSY;
+		}
+		cond_resched();
+	}
+	return 0;
+}
+
+static int vilo_shm_get(struct virtio_lo_device *dev,
+			const struct virtio_lo_devinfo *di)
+{
+	struct virtio_lo_shm *shm;
+	unsigned i, j;
+	int ret = 0;
+
+	if (!di->nshm) {
+		return 0;
+	}
+	if (di->nshm > VIRTIO_LO_MAX_SHM) {
+		return -EINVAL;
+	}
+	/* the backend gets the range mapped, as with /dev/mem */
+	if (!capable(CAP_SYS_RAWIO)) {
+		return -EPERM;
+	}
+	shm = memdup_user(di->shm, di->nshm * sizeof(*shm));
+	if (IS_ERR(shm)) {
+		return PTR_ERR(shm);
+	}
+	dev->shm = kcalloc(di->nshm, sizeof(*dev->shm), GFP_KERNEL);
+	if (!dev->shm) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < di->nshm; i++) {
+		if (!shm[i].len || !PAGE_ALIGNED(shm[i].addr) ||
+		    !PAGE_ALIGNED(shm[i].len) ||
+		    shm[i].addr + shm[i].len < shm[i].addr) {
+			ret = -EINVAL;
+			goto err;
+		}
+		/* the driver reserves the region as device memory */
+		if (region_intersects(shm[i].addr, shm[i].len,
+				      IORESOURCE_SYSTEM_RAM,
+				      IORES_DESC_NONE) != REGION_DISJOINT) {
+			ret = -EINVAL;
+			goto err;
+		}
+		ret = vilo_shm_check_free(shm[i].addr, shm[i].len);
+		if (ret) {
+			goto err;
+		}
+		for (j = 0; j < i; j++) {
+			if (shm[j].id == shm[i].id) {
+				ret = -EINVAL;
+				goto err;
+			}
+		}
+		dev->shm[i].id = shm[i].id;
+		dev->shm[i].addr = shm[i].addr;
+		dev->shm[i].len = shm[i].len;
+	}
+	dev->nshm = di->nshm;
+	goto out;
+err:
+	kfree(dev->shm);
+	dev->shm = NULL;
+out:
+	kfree(shm);
+	return ret;
+}
+
+static int vilo_qinfo_get(const struct virtio_lo_devinfo *di, unsigned flags,
+			  struct virtio_lo_qinfo *qi)
+{
+	unsigned i;
+
+	if (!(flags & VILO_CREATE_QINFO_VER0)) {
+		return copy_from_user(qi, di->qinfo, di->nqueues * sizeof(*qi)) ?
+			       -EFAULT :
+			       0;
+	}
+	/* the fields of the first version come first */
+	for (i = 0; i < di->nqueues; i++) {
+		if (copy_from_user(&qi[i],
+				   (u8 __user *)di->qinfo +
+					   i * VIRTIO_LO_QINFO_SIZE_VER0,
+				   VIRTIO_LO_QINFO_SIZE_VER0)) {
+			return -EFAULT;
+		}
+		qi[i].callfd = -1;
+	}
+	return 0;
+}
+
+static int vilo_qinfo_put(const struct virtio_lo_devinfo *di, unsigned flags,
+			  const struct virtio_lo_qinfo *qi)
+{
+	unsigned i;
+
+	if (!(flags & VILO_CREATE_QINFO_VER0)) {
+		return copy_to_user(di->qinfo, qi, di->nqueues * sizeof(*qi)) ?
+			       -EFAULT :
+			       0;
+	}
+	for (i = 0; i < di->nqueues; i++) {
+		if (copy_to_user((u8 __user *)di->qinfo +
+					 i * VIRTIO_LO_QINFO_SIZE_VER0,
+				 &qi[i], VIRTIO_LO_QINFO_SIZE_VER0)) {
+			return -EFAULT;
+		}
+	}
+	return 0;
+}
+
+/* Creates the device part, the driver part is then added by init_work */
+static struct virtio_lo_device *
+vilo_device_create(struct virtio_lo_owner *owner,
+		   const struct virtio_lo_devinfo *di, unsigned flags)
 {
-	struct virtio_lo_devinfo di;
 	struct virtio_lo_device *dev;
 	struct virtio_lo_qinfo *qi;
 	unsigned i;
 	long ret = 0;
-	unsigned long flags;
 
-	if (copy_from_user(&di, info, sizeof(di))) {
-		return -EFAULT;
+	if (di->flags & ~(VIRTIO_LO_F_CALLFD | VIRTIO_LO_F_POOL |
+			  VIRTIO_LO_F_WINDOW | VIRTIO_LO_F_POLL |
+			  VIRTIO_LO_F_DOORBELL | VIRTIO_LO_F_ASYNC |
+			  VIRTIO_LO_F_EVENTS | VIRTIO_LO_F_DIRECT)) {
+		return ERR_PTR(-EINVAL);
+	}
+	if ((di->flags & VIRTIO_LO_F_POOL) &&
+	    (di->flags & (VIRTIO_LO_F_WINDOW | VIRTIO_LO_F_DIRECT))) {
+		return ERR_PTR(-EINVAL);
+	}
+	/* the window is fed by the DMA API of the platform device */
+	if ((di->flags & VIRTIO_LO_F_WINDOW) &&
+	    (di->flags & VIRTIO_LO_F_DIRECT)) {
+		return ERR_PTR(-EINVAL);
+	}
+	/* the shared parent of direct devices has no DMA mask */
+	if ((di->flags & VIRTIO_LO_F_DIRECT) &&
+	    (di->features & BIT_ULL(VIRTIO_F_ACCESS_PLATFORM))) {
+		return ERR_PTR(-EINVAL);
+	}
+	if ((di->flags & VIRTIO_LO_F_WINDOW) && !IS_ENABLED(CONFIG_DMA_OPS)) {
+		return ERR_PTR(-EOPNOTSUPP);
+	}
+	if ((di->flags & VIRTIO_LO_F_POOL) && di->pool_size > max_pool_size) {
+		return ERR_PTR(-EINVAL);
+	}
+	if ((di->flags & (VIRTIO_LO_F_POLL | VIRTIO_LO_F_DOORBELL)) &&
+	    !di->nqueues) {
+		return ERR_PTR(-EINVAL);
 	}
 
 	dev = kcalloc(1, sizeof(*dev), GFP_KERNEL);
 	if (!dev) {
-		return -ENOMEM;
+		return ERR_PTR(-ENOMEM);
+	}
+	dev->id = ida_alloc(&vilo_ida, GFP_KERNEL);
+	if (dev->id < 0) {
+		ret = dev->id;
+		goto err_dev;
 	}
+	dev->direct = di->flags & VIRTIO_LO_F_DIRECT;
 
-	spin_lock_init(&dev->config_lock);
-	spin_lock_init(&dev->status_lock);
+	kref_init(&dev->kref);
+	mutex_init(&dev->queue_lock);
+	xa_init_flags(&dev->window, XA_FLAGS_LOCK_IRQ);
+	xa_init_flags(&dev->window_bounce, XA_FLAGS_LOCK_IRQ);
+	mutex_init(&dev->window_lock);
+	INIT_WORK(&dev->window_work, vilo_window_revoke);
+	dev->window_enabled = di->flags & VIRTIO_LO_F_WINDOW;
+	/* the owner outlives the driver part, which emits the events */
+	if (di->flags & VIRTIO_LO_F_EVENTS) {
+		dev->events = owner;
+	}
 
-	dev->device_id = di.device_id;
-	dev->vendor_id = di.vendor_id;
-	dev->card_index = di.card_index;
-	dev->nqueues = di.nqueues;
-	dev->features = dev->device_features = di.features;
+	dev->device_id = di->device_id;
+	dev->vendor_id = di->vendor_id;
+	dev->card_index = di->card_index;
+	dev->nqueues = di->nqueues;
+	dev->features = dev->device_features = di->features;
 
-	dev->config_size = di.config_size;
-	dev->config = kmalloc(dev->config_size, GFP_KERNEL);
-	if (!dev->config) {
+	dev->config_size = di->config_size;
+	seqlock_init(&dev->config_lock);
+	dev->config_page = vmalloc_user(
+		PAGE_ALIGN(sizeof(*dev->config_page) + dev->config_size));
+	dev->config = kzalloc(dev->config_size, GFP_KERNEL);
+	if (!dev->config_page || !dev->config) {
 		ret = -ENOMEM;
-		goto err_dev;
+		goto err_conf;
+	}
+	dev->config_page->size = dev->config_size;
+	if (di->config_kick != -1) {
+		dev->config_kick = eventfd_ctx_fdget(di->config_kick);
+		if (IS_ERR(dev->config_kick)) {
+			ret = PTR_ERR(dev->config_kick);
+			dev->config_kick = NULL;
+			goto err_conf;
+		}
 	}
-	dev->config_kick = eventfd_ctx_fdget(di.config_kick);
 
-	if (copy_from_user(dev->config, di.config, di.config_size)) {
+	if (copy_from_user(dev->config, di->config, di->config_size)) {
 		ret = -EFAULT;
 		goto err_conf;
 	}
+	memcpy(dev->config_page->config, dev->config, dev->config_size);
 
 	qi = kcalloc(dev->nqueues, sizeof(*qi), GFP_KERNEL);
 	if (!qi) {
 		ret = -ENOMEM;
 		goto err_conf;
 	}
-	if (copy_from_user(qi, di.qinfo, dev->nqueues * sizeof(*qi))) {
-		ret = -EFAULT;
-		goto err_qi;
+	if (flags & VILO_CREATE_NO_QINFO) {
+		for (i = 0; i < dev->nqueues; i++) {
+			qi[i].kickfd = qi[i].callfd = -1;
+		}
+	} else {
+		ret = vilo_qinfo_get(di, flags, qi);
+		if (ret) {
+			goto err_qi;
+		}
 	}
 	dev->queues = kcalloc(dev->nqueues, sizeof(*dev->queues), GFP_KERNEL);
 	if (!dev->queues) {
@@ -204,233 +777,2416 @@ static long vilo_ioctl_adddev(struct virtio_lo_owner *owner,
 	}
 
 	for (i = 0; i < dev->nqueues; i++) {
-		dev->queues[i].maxsize = qi[i].size;
+		struct virtio_lo_vq_info *info = &dev->queues[i];
+
+		info->maxsize = qi[i].size;
+		info->dev = dev;
+		info->qidx = i;
+		info->irq_cpu = -1;
+		init_waitqueue_head(&info->notify_wait);
+		init_irq_work(&info->call_work, vilo_call_inject);
 		if (qi[i].kickfd != -1) {
-			dev->queues[i].device_kick =
-				eventfd_ctx_fdget(qi[i].kickfd);
+			info->device_kick = eventfd_ctx_fdget(qi[i].kickfd);
+			if (IS_ERR(info->device_kick)) {
+				ret = PTR_ERR(info->device_kick);
+				info->device_kick = NULL;
+				goto err_calls;
+			}
+		}
+		if ((di->flags & VIRTIO_LO_F_CALLFD) && qi[i].callfd != -1) {
+			ret = vilo_call_get(info, qi[i].callfd);
+			if (ret) {
+				goto err_calls;
+			}
 		}
 	}
 
-	dev->idx = atomic_fetch_add(1, &owner->lastidx);
+	if (di->flags & VIRTIO_LO_F_POOL) {
+		dev->pool = virtio_lo_pool_create(di->pool_size);
+		if (IS_ERR(dev->pool)) {
+			ret = PTR_ERR(dev->pool);
+			dev->pool = NULL;
+			goto err_calls;
+		}
+		/* the driver has to use the DMA API to reach the pool */
+		dev->device_features |= BIT_ULL(VIRTIO_F_ACCESS_PLATFORM);
+		dev->features = dev->device_features;
+	}
+	if (dev->window_enabled) {
+		/* same for the window to see the buffers */
+		dev->device_features |= BIT_ULL(VIRTIO_F_ACCESS_PLATFORM);
+		dev->features = dev->device_features;
 
-	/* everything is OK, create driver part platform device */
-	init_completion(&dev->init_done);
+		ret = simple_pin_fs(&vilo_fs_type, &vilo_mnt, &vilo_mnt_count);
+		if (ret) {
+			goto err_calls;
+		}
+		dev->inode = alloc_anon_inode(vilo_mnt->mnt_sb);
+		if (IS_ERR(dev->inode)) {
+			ret = PTR_ERR(dev->inode);
+			dev->inode = NULL;
+			simple_release_fs(&vilo_mnt, &vilo_mnt_count);
+			goto err_calls;
+		}
+	}
 
-	INIT_WORK(&dev->init_work, virtio_lo_add_pdev);
+	if (di->flags & VIRTIO_LO_F_POLL) {
+		dev->poll_state =
+			vmalloc_user(PAGE_ALIGN(dev->nqueues * sizeof(u32)));
+		if (!dev->poll_state) {
+			ret = -ENOMEM;
+			goto err_pool;
+		}
+	}
 
-	queue_work(vilo_wq, &dev->init_work);
+	if (di->flags & VIRTIO_LO_F_DOORBELL) {
+		dev->doorbell = vmalloc_user(
+			PAGE_ALIGN(dev->nqueues * sizeof(*dev->doorbell)));
+		if (!dev->doorbell) {
+			ret = -ENOMEM;
+			goto err_pool;
+		}
+		for (i = 0; i < dev->nqueues; i++) {
+			dev->doorbell[i].sleeping = 1;
+		}
+	}
 
-	wait_for_completion(&dev->init_done);
+	ret = vilo_shm_get(dev, di);
+	if (ret) {
+		goto err_pool;
+	}
 
-	if (!(dev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
-		dev_notice(&vl_device_parent,
-			   "virtio lo device initialization failed\n");
-		ret = -ENOENT;
-		goto err_queues;
+	if ((di->flags & VIRTIO_LO_F_ASYNC) && di->done_fd != -1) {
+		dev->done_kick = eventfd_ctx_fdget(di->done_fd);
+		if (IS_ERR(dev->done_kick)) {
+			ret = PTR_ERR(dev->done_kick);
+			dev->done_kick = NULL;
+			goto err_pool;
+		}
 	}
 
+	dev->idx = atomic_fetch_add(1, &owner->lastidx);
+
+	init_completion(&dev->init_done);
+	INIT_WORK(&dev->init_work, virtio_lo_add_driver);
+
+	kfree(qi);
+	return dev;
+err_pool:
+	kfree(dev->shm);
+	vfree(dev->poll_state);
+	vfree(dev->doorbell);
+	if (dev->inode) {
+		iput(dev->inode);
+		simple_release_fs(&vilo_mnt, &vilo_mnt_count);
+	}
+	if (dev->pool) {
+		virtio_lo_pool_destroy(dev->pool);
+	}
+err_calls:
 	for (i = 0; i < dev->nqueues; i++) {
-		qi[i].size = dev->queues[i].size;
-		qi[i].desc = dev->queues[i].desc;
-		qi[i].avail = dev->queues[i].avail;
-		qi[i].used = dev->queues[i].used;
+		vilo_call_put(&dev->queues[i]);
+		if (dev->queues[i].device_kick) {
+			eventfd_ctx_put(dev->queues[i].device_kick);
+		}
+	}
+	kfree(dev->queues);
+err_qi:
+	kfree(qi);
+err_conf:
+	if (dev->config_kick) {
+		eventfd_ctx_put(dev->config_kick);
+	}
+	vfree(dev->config_page);
+	kfree(dev->config);
+	ida_free(&vilo_ida, dev->id);
+err_dev:
+	kfree(dev);
+	return ERR_PTR(ret);
+}
+
+/* Called once the driver part has been probed: reports the queues to the
+ * backend and makes the device available to the owner. The device is
+ * removed if the driver did not get to DRIVER_OK. */
+static long vilo_device_finish(struct virtio_lo_owner *owner,
+			       struct virtio_lo_device *dev,
+			       const struct virtio_lo_devinfo *di,
+			       unsigned flags,
+			       struct virtio_lo_devinfo __user *info)
+{
+	struct virtio_lo_qinfo *qi;
+	void *config;
+	unsigned i;
+	long ret = 0;
+
+	if (!(atomic_read(&dev->status) & VIRTIO_CONFIG_S_DRIVER_OK)) {
+		dev_notice(&vl_device_parent,
+			   "virtio lo device initialization failed\n");
+		virtio_lo_device_remove(dev);
+		return -ENOENT;
+	}
+
+	qi = kcalloc(dev->nqueues, sizeof(*qi), GFP_KERNEL);
+	if (!qi) {
+		virtio_lo_device_remove(dev);
+		return -ENOMEM;
+	}
+	if (vilo_qinfo_get(di, flags, qi)) {
+		kfree(qi);
+		virtio_lo_device_remove(dev);
+		return -EFAULT;
+	}
+
+	for (i = 0; i < dev->nqueues; i++) {
+		qi[i].size = dev->queues[i].size;
+		qi[i].desc = dev->queues[i].desc;
+		qi[i].avail = dev->queues[i].avail;
+		qi[i].used = dev->queues[i].used;
+		qi[i].flags = vilo_packed(dev) ? VIRTIO_LO_QUEUE_F_PACKED : 0;
+	}
+	if (vilo_qinfo_put(di, flags, qi)) {
+		ret = -EFAULT;
+	}
+	if (copy_to_user(&info->idx, &dev->idx, sizeof(dev->idx))) {
+		ret = -EFAULT;
+	}
+	if (copy_to_user(&info->features, &dev->features,
+			 sizeof(dev->features))) {
+		ret = -EFAULT;
+	}
+	kfree(qi);
+
+	/* the driver may have written it already */
+	config = kmalloc(dev->config_size, GFP_KERNEL);
+	if (!config) {
+		ret = -ENOMEM;
+	} else {
+		virtio_lo_config_get(dev, 0, config, dev->config_size);
+		if (copy_to_user(di->config, config, dev->config_size)) {
+			ret = -EFAULT;
+		}
+		kfree(config);
+	}
+
+	for (i = 0; i < dev->nqueues; i++) {
+		if (dev->queues[i].driver_call) {
+			vilo_call_arm(&dev->queues[i]);
+		}
+	}
+
+	/* a DELDEV may remove the device as soon as it is inserted, removal
+	 * takes the debugfs entry down with it */
+	vilo_debugfs_add(dev);
+	if (xa_insert(&owner->devices, dev->idx, dev, GFP_KERNEL)) {
+		virtio_lo_device_remove(dev);
+		return -ENOMEM;
+	}
+	trace_virtio_lo_device_add(dev->idx, dev->device_id, dev->nqueues);
+
+	return ret;
+}
+
+/* Queues the creation of the driver part and returns, the device is pending
+ * until VIRTIO_LO_ADDDEV_RESULT */
+static long vilo_adddev_async(struct virtio_lo_owner *owner,
+			      const struct virtio_lo_devinfo *di,
+			      struct virtio_lo_devinfo __user *info)
+{
+	struct virtio_lo_device *dev;
+
+	dev = vilo_device_create(owner, di, 0);
+	if (IS_ERR(dev)) {
+		return PTR_ERR(dev);
+	}
+	if (copy_to_user(&info->idx, &dev->idx, sizeof(dev->idx))) {
+		virtio_lo_device_remove(dev);
+		return -EFAULT;
+	}
+	if (xa_insert(&owner->pending, dev->idx, dev, GFP_KERNEL)) {
+		virtio_lo_device_remove(dev);
+		return -ENOMEM;
+	}
+	queue_work(vilo_wq, &dev->init_work);
+	return 0;
+}
+
+/* usize is the size of struct virtio_lo_devinfo encoded in the command */
+static long vilo_ioctl_adddev(struct virtio_lo_owner *owner,
+			      struct virtio_lo_devinfo __user *info,
+			      size_t usize)
+{
+	struct virtio_lo_devinfo di;
+	struct virtio_lo_device *dev;
+	unsigned flags = 0;
+	int ret;
+
+	if (usize == VIRTIO_LO_DEVINFO_SIZE_VER0) {
+		ret = copy_struct_from_user(&di, sizeof(di), info, usize);
+		/* flags was padding, nothing after qinfo is there */
+		di.flags = 0;
+		flags |= VILO_CREATE_QINFO_VER0;
+	} else if (usize > VIRTIO_LO_DEVINFO_SIZE_VER0) {
+		/* the fields older callers do not know about are zeroed */
+		ret = copy_struct_from_user(&di, sizeof(di), info, usize);
+	} else {
+		ret = -EINVAL;
+	}
+	if (ret) {
+		return ret;
+	}
+	if (di.flags & VIRTIO_LO_F_ASYNC) {
+		return vilo_adddev_async(owner, &di, info);
+	}
+
+	dev = vilo_device_create(owner, &di, flags);
+	if (IS_ERR(dev)) {
+		return PTR_ERR(dev);
+	}
+	/* everything is OK, create the driver part */
+	if (dev->direct) {
+		/* nothing to wait for, register it from here */
+		virtio_lo_add_driver(&dev->init_work);
+	} else {
+		queue_work(vilo_wq, &dev->init_work);
+		wait_for_completion(&dev->init_done);
+	}
+
+	return vilo_device_finish(owner, dev, &di, flags, info);
+}
+
+static long vilo_ioctl_adddev_result(struct virtio_lo_owner *owner,
+				     struct virtio_lo_devinfo __user *info)
+{
+	struct virtio_lo_devinfo di;
+	struct virtio_lo_device *dev;
+
+	if (copy_from_user(&di, info, sizeof(di))) {
+		return -EFAULT;
+	}
+	/* only one caller gets the device */
+	dev = xa_erase(&owner->pending, di.idx);
+	if (!dev) {
+		return -ENOENT;
+	}
+	wait_for_completion(&dev->init_done);
+
+	return vilo_device_finish(owner, dev, &di, 0, info);
+}
+
+static long vilo_ioctl_adddev_bulk(struct virtio_lo_owner *owner,
+				   const struct virtio_lo_adddev_bulk __user *bulk)
+{
+	struct virtio_lo_adddev_bulk b;
+	unsigned i;
+	long ret = 0;
+
+	if (copy_from_user(&b, bulk, sizeof(b))) {
+		return -EFAULT;
+	}
+	if (!b.ndevs || b.ndevs > VIRTIO_LO_ADDDEV_BULK_MAX) {
+		return -EINVAL;
+	}
+	for (i = 0; i < b.ndevs; i++) {
+		struct virtio_lo_devinfo di;
+
+		if (copy_from_user(&di, &b.devs[i], sizeof(di))) {
+			ret = -EFAULT;
+			break;
+		}
+		di.flags |= VIRTIO_LO_F_ASYNC;
+		ret = vilo_adddev_async(owner, &di, &b.devs[i]);
+		if (ret) {
+			break;
+		}
+	}
+	/* the devices created before an error stay pending */
+	return i ? i : ret;
+}
+
+static long vilo_ioctl_deldev(struct virtio_lo_owner *owner, unsigned idx)
+{
+	struct virtio_lo_device *dev;
+
+	dev = xa_erase(&owner->devices, idx);
+	if (!dev) {
+		return -ENOENT;
+	}
+	virtio_lo_device_remove(dev);
+	return 0;
+}
+
+static long vilo_ioctl_getconf(struct virtio_lo_owner *owner,
+			       struct virtio_lo_config __user *conf)
+{
+	struct virtio_lo_config c;
+	struct virtio_lo_device *dev;
+	void *mem;
+	long ret = 0;
+	if (copy_from_user(&c, conf, sizeof(c)))
+		return -EFAULT;
+	dev = virtio_owner_getdev(owner, c.idx);
+	if (!dev) {
+		return -ENOENT;
+	}
+	if (c.offset >= dev->config_size ||
+	    c.offset + c.len > dev->config_size) {
+		ret = -EINVAL;
+		goto out;
+	}
+	mem = kmalloc(c.len, GFP_KERNEL);
+	if (!mem) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	virtio_lo_config_get(dev, c.offset, mem, c.len);
+	if (copy_to_user(c.config, mem, c.len)) {
+		ret = -EFAULT;
+	}
+	kfree(mem);
+out:
+	virtio_lo_device_put(dev);
+	return ret;
+}
+
+static long vilo_ioctl_setconf(struct virtio_lo_owner *owner,
+			       const struct virtio_lo_config __user *conf)
+{
+	struct virtio_lo_config c;
+	struct virtio_lo_device *dev;
+	void *mem;
+	long ret;
+	if (copy_from_user(&c, conf, sizeof(c)))
+		return -EFAULT;
+	dev = virtio_owner_getdev(owner, c.idx);
+	if (!dev) {
+		return -ENOENT;
+	}
+	if (c.offset >= dev->config_size ||
+	    c.offset + c.len > dev->config_size) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	mem = kmalloc(c.len, GFP_KERNEL);
+	if (!mem) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	if (copy_from_user(mem, c.config, c.len)) {
+		ret = -EFAULT;
+	} else {
+		virtio_lo_config_set(dev, c.offset, mem, c.len);
+		/* the driver part is only valid until the device is removed */
+		rcu_read_lock();
+		if (!READ_ONCE(dev->removed)) {
+			virtio_lo_config_driver(dev);
+		}
+		rcu_read_unlock();
+		ret = 0;
+	}
+	kfree(mem);
+out:
+	virtio_lo_device_put(dev);
+	return ret;
+}
+
+static long vilo_ioctl_config_changed(struct virtio_lo_owner *owner,
+				      unsigned idx)
+{
+	struct virtio_lo_device *dev;
+	long ret;
+
+	dev = virtio_owner_getdev(owner, idx);
+	if (!dev) {
+		return -ENOENT;
+	}
+	ret = vilo_config_publish(dev);
+	if (!ret) {
+		/* the driver part is only valid until the device is removed */
+		rcu_read_lock();
+		if (READ_ONCE(dev->removed)) {
+			ret = -ENOENT;
+		} else {
+			virtio_lo_config_driver(dev);
+		}
+		rcu_read_unlock();
+	}
+	virtio_lo_device_put(dev);
+	return ret;
+}
+
+/* negative qidx means all the queues */
+static inline bool vilo_kick_qidx_valid(struct virtio_lo_device *dev, int qidx)
+{
+	return qidx < 0 || qidx < dev->nqueues;
+}
+
+static long vilo_ioctl_set_poll(struct virtio_lo_owner *owner,
+				const struct virtio_lo_poll __user *poll)
+{
+	struct virtio_lo_poll p;
+	struct virtio_lo_device *dev;
+	unsigned i;
+	long ret = 0;
+
+	if (copy_from_user(&p, poll, sizeof(p)))
+		return -EFAULT;
+	dev = virtio_owner_getdev(owner, p.idx);
+	if (!dev) {
+		return -ENOENT;
+	}
+	if (!dev->poll_state || !vilo_kick_qidx_valid(dev, p.qidx)) {
+		ret = -EINVAL;
+		goto out;
+	}
+	for (i = 0; i < dev->nqueues; i++) {
+		if (p.qidx >= 0 && i != p.qidx) {
+			continue;
+		}
+		WRITE_ONCE(dev->queues[i].poll_budget, p.budget);
+		WRITE_ONCE(dev->queues[i].poll_idle_usecs, p.idle_usecs);
+	}
+out:
+	virtio_lo_device_put(dev);
+	return ret;
+}
+
+static long vilo_ioctl_set_coalesce(struct virtio_lo_owner *owner,
+				    const struct virtio_lo_coalesce __user *coal)
+{
+	struct virtio_lo_coalesce c;
+	struct virtio_lo_device *dev;
+	unsigned i;
+	long ret = 0;
+
+	if (copy_from_user(&c, coal, sizeof(c)))
+		return -EFAULT;
+	/* pending kicks would never be delivered */
+	if (c.max_frames > 1 && !c.max_usecs) {
+		return -EINVAL;
+	}
+	dev = virtio_owner_getdev(owner, c.idx);
+	if (!dev) {
+		return -ENOENT;
+	}
+	if (!vilo_kick_qidx_valid(dev, c.qidx)) {
+		ret = -EINVAL;
+		goto out;
+	}
+	for (i = 0; i < dev->nqueues; i++) {
+		if (c.qidx >= 0 && i != c.qidx) {
+			continue;
+		}
+		WRITE_ONCE(dev->queues[i].coalesce_frames, c.max_frames);
+		WRITE_ONCE(dev->queues[i].coalesce_usecs, c.max_usecs);
+	}
+out:
+	virtio_lo_device_put(dev);
+	return ret;
+}
+
+static long vilo_ioctl_set_affinity(struct virtio_lo_owner *owner,
+				    const struct virtio_lo_affinity __user *aff)
+{
+	struct virtio_lo_affinity a;
+	struct virtio_lo_device *dev;
+	unsigned i;
+	long ret = 0;
+
+	if (copy_from_user(&a, aff, sizeof(a)))
+		return -EFAULT;
+	if (a.cpu < -1 || (a.cpu >= 0 && (a.cpu >= nr_cpu_ids ||
+					   !cpu_possible(a.cpu)))) {
+		return -EINVAL;
+	}
+	dev = virtio_owner_getdev(owner, a.idx);
+	if (!dev) {
+		return -ENOENT;
+	}
+	if (!vilo_kick_qidx_valid(dev, a.qidx)) {
+		ret = -EINVAL;
+		goto out;
+	}
+	for (i = 0; i < dev->nqueues; i++) {
+		if (a.qidx >= 0 && i != a.qidx) {
+			continue;
+		}
+		WRITE_ONCE(dev->queues[i].irq_cpu, a.cpu);
+	}
+out:
+	virtio_lo_device_put(dev);
+	return ret;
+}
+
+static long vilo_ioctl_kick(struct virtio_lo_owner *owner,
+			    const struct virtio_lo_kick __user *kick)
+{
+	struct virtio_lo_kick k;
+	struct virtio_lo_device *dev;
+	long ret = 0;
+	if (copy_from_user(&k, kick, sizeof(k)))
+		return -EFAULT;
+
+	rcu_read_lock();
+	dev = virtio_owner_getdev_rcu(owner, k.idx);
+	if (!dev) {
+		ret = -ENOENT;
+	} else if (!vilo_kick_qidx_valid(dev, k.qidx)) {
+		ret = -EINVAL;
+	} else {
+		virtio_lo_kick_driver(dev, k.qidx);
+	}
+	rcu_read_unlock();
+
+	return ret;
+}
+
+/* Orders kicks by device and then by queue, so that "all queues" (-1)
+ * entries go first and duplicates become adjacent */
+static int vilo_kick_cmp(const void *a, const void *b)
+{
+	const struct virtio_lo_kick *ka = a, *kb = b;
+
+	if (ka->idx != kb->idx)
+		return ka->idx < kb->idx ? -1 : 1;
+	if (ka->qidx != kb->qidx)
+		return ka->qidx < kb->qidx ? -1 : 1;
+	return 0;
+}
+
+/* Sorts the kicks and drops the duplicates, returns the number of unique
+ * entries left at the beginning of the array */
+static unsigned vilo_kick_dedup(struct virtio_lo_kick *k, unsigned n)
+{
+	unsigned i, j = 0;
+
+	sort(k, n, sizeof(*k), vilo_kick_cmp, NULL);
+	for (i = 1; i < n; i++) {
+		if (k[i].idx == k[j].idx &&
+		    (k[i].qidx == k[j].qidx || k[j].qidx < 0)) {
+			continue;
+		}
+		k[++j] = k[i];
+	}
+	return j + 1;
+}
+
+static long vilo_ioctl_kick_batch(struct virtio_lo_owner *owner,
+				  const struct virtio_lo_kick_batch __user *batch)
+{
+	struct virtio_lo_kick_batch b;
+	struct virtio_lo_kick *k;
+	struct virtio_lo_device **devs;
+	unsigned i, n;
+	long ret = 0;
+
+	if (copy_from_user(&b, batch, sizeof(b)))
+		return -EFAULT;
+	if (b.nkicks == 0) {
+		return 0;
+	}
+	if (b.nkicks > VIRTIO_LO_KICK_BATCH_MAX) {
+		return -EINVAL;
+	}
+
+	k = kmalloc_array(b.nkicks, sizeof(*k), GFP_KERNEL);
+	if (!k) {
+		return -ENOMEM;
+	}
+	if (copy_from_user(k, b.kicks, b.nkicks * sizeof(*k))) {
+		ret = -EFAULT;
+		goto err_kicks;
+	}
+	n = vilo_kick_dedup(k, b.nkicks);
+
+	devs = kmalloc_array(n, sizeof(*devs), GFP_KERNEL);
+	if (!devs) {
+		ret = -ENOMEM;
+		goto err_kicks;
+	}
+
+	/* resolve all the devices in one go, the array is sorted by idx */
+	rcu_read_lock();
+	for (i = 0; i < n; i++) {
+		if (i > 0 && k[i].idx == k[i - 1].idx) {
+			devs[i] = devs[i - 1];
+		} else {
+			devs[i] = virtio_owner_getdev_rcu(owner, k[i].idx);
+		}
+		if (!devs[i]) {
+			ret = -ENOENT;
+			break;
+		}
+		if (!vilo_kick_qidx_valid(devs[i], k[i].qidx)) {
+			ret = -EINVAL;
+			break;
+		}
+	}
+
+	if (!ret) {
+		for (i = 0; i < n; i++) {
+			virtio_lo_kick_driver(devs[i], k[i].qidx);
+		}
+	}
+	rcu_read_unlock();
+
+	kfree(devs);
+err_kicks:
+	kfree(k);
+	return ret;
+}
+
+/* Queue files */
+
+static int vilo_queue_release(struct inode *inode, struct file *file)
+{
+	struct virtio_lo_vq_info *info = file->private_data;
+	virtio_lo_device_put(info->dev);
+	return 0;
+}
+
+static ssize_t vilo_queue_read(struct file *file, char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	struct virtio_lo_vq_info *info = file->private_data;
+	struct virtio_lo_queue_notify n = {};
+	u64 cnt;
+
+	if (count < sizeof(cnt)) {
+		return -EINVAL;
+	}
+	while (!(cnt = atomic64_xchg(&info->notified, 0))) {
+		int ret;
+
+		if (READ_ONCE(info->dev->removed)) {
+			return 0;
+		}
+		if (file->f_flags & O_NONBLOCK) {
+			return -EAGAIN;
+		}
+		ret = wait_event_interruptible(
+			info->notify_wait, atomic64_read(&info->notified) ||
+						   READ_ONCE(info->dev->removed));
+		if (ret) {
+			return ret;
+		}
+	}
+	if (count < sizeof(n)) {
+		if (put_user(cnt, (u64 __user *)buf)) {
+			return -EFAULT;
+		}
+		return sizeof(cnt);
+	}
+	/* the counter is read with a full barrier, the data is at least as
+	 * new as the notifications it accounts for */
+	n.count = cnt;
+	n.data = READ_ONCE(info->notify_data);
+	if (copy_to_user(buf, &n, sizeof(n))) {
+		return -EFAULT;
+	}
+	return sizeof(n);
+}
+
+static __poll_t vilo_queue_poll(struct file *file, poll_table *wait)
+{
+	struct virtio_lo_vq_info *info = file->private_data;
+	__poll_t events = 0;
+
+	poll_wait(file, &info->notify_wait, wait);
+	if (atomic64_read(&info->notified)) {
+		events |= EPOLLIN | EPOLLRDNORM;
+	}
+	if (READ_ONCE(info->dev->removed)) {
+		events |= EPOLLHUP;
+	}
+	return events;
+}
+
+/* Ring pages mapped by a queue file. They are held until the last mapping
+ * of them is gone, so that deleting the queue does not free them under the
+ * backend. */
+struct vilo_queue_pages {
+	refcount_t ref;
+	unsigned n;
+	struct page *pages[];
+};
+
+static void vilo_queue_pages_put(struct vilo_queue_pages *qp)
+{
+	unsigned i;
+
+	if (!refcount_dec_and_test(&qp->ref)) {
+		return;
+	}
+	for (i = 0; i < qp->n; i++) {
+		put_page(qp->pages[i]);
+	}
+	kfree(qp);
+}
+
+static void vilo_queue_vm_open(struct vm_area_struct *vma)
+{
+	struct vilo_queue_pages *qp = vma->vm_private_data;
+
+	refcount_inc(&qp->ref);
+}
+
+static void vilo_queue_vm_close(struct vm_area_struct *vma)
+{
+	vilo_queue_pages_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct vilo_queue_vm_ops = {
+	.open = vilo_queue_vm_open,
+	.close = vilo_queue_vm_close,
+};
+
+/* Maps len bytes of the ring at addr to start, the pages are held in qp */
+static int vilo_queue_remap(struct vm_area_struct *vma, unsigned long start,
+			    u64 addr, unsigned long len,
+			    struct vilo_queue_pages *qp)
+{
+	unsigned long pfn = addr >> PAGE_SHIFT;
+	unsigned long i;
+
+	for (i = 0; i < len >> PAGE_SHIFT; i++) {
+		if (!pfn_valid(pfn + i)) {
+			return -EINVAL;
+		}
+		qp->pages[qp->n] = pfn_to_page(pfn + i);
+		get_page(qp->pages[qp->n++]);
+	}
+	if (remap_pfn_range(vma, start, pfn, len, vma->vm_page_prot)) {
+		return -EAGAIN;
+	}
+	return 0;
+}
+
+/* The three parts of a packed ring are allocated separately, they are
+ * mapped one after another */
+static int vilo_queue_mmap_packed(struct virtio_lo_vq_info *info,
+				  struct vm_area_struct *vma,
+				  struct vilo_queue_pages *qp)
+{
+	unsigned long ring_len =
+		PAGE_ALIGN(info->size * sizeof(struct vring_packed_desc));
+	const struct {
+		u64 addr;
+		unsigned long len;
+	} parts[] = {
+		{ info->desc, ring_len },
+		{ info->avail, PAGE_SIZE },
+		{ info->used, PAGE_SIZE },
+	};
+	unsigned long start = vma->vm_start;
+	unsigned i;
+	int ret;
+
+	if (vma->vm_end - vma->vm_start > ring_len + 2 * PAGE_SIZE) {
+		return -EINVAL;
+	}
+	for (i = 0; i < ARRAY_SIZE(parts) && start < vma->vm_end; i++) {
+		unsigned long len = min(parts[i].len, vma->vm_end - start);
+
+		ret = vilo_queue_remap(vma, start, parts[i].addr, len, qp);
+		if (ret) {
+			return ret;
+		}
+		start += len;
+	}
+	return 0;
+}
+
+static int vilo_queue_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct virtio_lo_vq_info *info = file->private_data;
+	struct virtio_lo_device *dev = info->dev;
+	unsigned long len = vma->vm_end - vma->vm_start;
+	struct vilo_queue_pages *qp;
+	int ret;
+
+	/* the rings are in the pool and are mapped with it */
+	if (dev->pool || vma->vm_pgoff) {
+		return -EINVAL;
+	}
+	/* larger than the rings of any size the queue can take */
+	if (len > PAGE_ALIGN(vring_size(info->maxsize, VIRTIO_LO_VRING_ALIGN)) +
+			  2 * PAGE_SIZE) {
+		return -EINVAL;
+	}
+	qp = kzalloc(struct_size(qp, pages, len >> PAGE_SHIFT), GFP_KERNEL);
+	if (!qp) {
+		return -ENOMEM;
+	}
+	refcount_set(&qp->ref, 1);
+
+	/* the rings cannot be freed before their pages are held */
+	mutex_lock(&dev->queue_lock);
+	if (READ_ONCE(dev->removed) || !info->size) {
+		ret = -ENODEV;
+	} else if ((READ_ONCE(dev->features) &
+		    BIT_ULL(VIRTIO_F_ACCESS_PLATFORM)) &&
+		   !dev->window_enabled) {
+		/* DMA addresses, only the window ones are physical */
+		ret = -EINVAL;
+	} else if (vilo_packed(dev)) {
+		ret = vilo_queue_mmap_packed(info, vma, qp);
+	} else if (len > PAGE_ALIGN(vring_size(info->size,
+					       VIRTIO_LO_VRING_ALIGN))) {
+		ret = -EINVAL;
+	} else {
+		ret = vilo_queue_remap(vma, vma->vm_start, info->desc, len, qp);
+	}
+	mutex_unlock(&dev->queue_lock);
+
+	if (ret) {
+		vilo_queue_pages_put(qp);
+		return ret;
+	}
+	vma->vm_ops = &vilo_queue_vm_ops;
+	vma->vm_private_data = qp;
+	return 0;
+}
+
+static long vilo_queue_ioctl(struct file *file, unsigned int cmd,
+			     unsigned long arg)
+{
+	struct virtio_lo_vq_info *info = file->private_data;
+	long ret = 0;
+
+	switch (cmd) {
+	case VIRTIO_LO_QUEUE_KICK:
+		rcu_read_lock();
+		if (READ_ONCE(info->dev->removed)) {
+			ret = -ENODEV;
+		} else {
+			virtio_lo_kick_driver(info->dev, info->qidx);
+		}
+		rcu_read_unlock();
+		break;
+	default:
+		ret = -ENOTTY;
+		break;
+	}
+	return ret;
+}
+
+static const struct file_operations vilo_queue_fops = {
+	.owner = THIS_MODULE,
+	.release = vilo_queue_release,
+	.read = vilo_queue_read,
+	.poll = vilo_queue_poll,
+	.mmap = vilo_queue_mmap,
+	.unlocked_ioctl = vilo_queue_ioctl,
+	.llseek = noop_llseek,
+};
+
+static long vilo_ioctl_queue_fd(struct virtio_lo_owner *owner,
+				const struct virtio_lo_queue_fd __user *qfd)
+{
+	struct virtio_lo_queue_fd q;
+	struct virtio_lo_device *dev;
+	int fd;
+
+	if (copy_from_user(&q, qfd, sizeof(q)))
+		return -EFAULT;
+	dev = virtio_owner_getdev(owner, q.idx);
+	if (!dev) {
+		return -ENOENT;
+	}
+	if (q.qidx >= dev->nqueues) {
+		virtio_lo_device_put(dev);
+		return -EINVAL;
+	}
+
+	/* the reference is passed to the file */
+	fd = anon_inode_getfd("[virtio-lo-queue]", &vilo_queue_fops,
+			      &dev->queues[q.qidx], O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		virtio_lo_device_put(dev);
+	}
+	return fd;
+}
+
+static long vilo_ioctl_getstats(struct virtio_lo_owner *owner,
+				struct virtio_lo_stats __user *stats)
+{
+	struct virtio_lo_stats st;
+	struct virtio_lo_device *dev;
+	struct virtio_lo_qstats *qs;
+	unsigned i;
+	long ret = 0;
+
+	if (copy_from_user(&st, stats, sizeof(st)))
+		return -EFAULT;
+	dev = virtio_owner_getdev(owner, st.idx);
+	if (!dev) {
+		return -ENOENT;
+	}
+	st.nqueues = min(st.nqueues, dev->nqueues);
+
+	qs = kcalloc(st.nqueues, sizeof(*qs), GFP_KERNEL);
+	if (!qs) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < st.nqueues; i++) {
+		struct virtio_lo_vq_stats *s = &dev->queues[i].stats;
+
+		qs[i].notifications = atomic64_read(&s->notifications);
+		qs[i].notifications_suppressed =
+			atomic64_read(&s->notifications_suppressed);
+		qs[i].interrupts = atomic64_read(&s->interrupts);
+		qs[i].interrupts_suppressed =
+			atomic64_read(&s->interrupts_suppressed);
+	}
+	if (copy_to_user(st.qstats, qs, st.nqueues * sizeof(*qs)) ||
+	    copy_to_user(&stats->nqueues, &st.nqueues, sizeof(st.nqueues))) {
+		ret = -EFAULT;
+	}
+	kfree(qs);
+out:
+	virtio_lo_device_put(dev);
+	return ret;
+}
+
+/* Memory window
+ *
+ * The window follows the DMA mappings of the driver part: a page is
+ * exposed from the first mapping that covers it and revoked once the last
+ * one is gone. Nothing the backend can write decides what is exposed. */
+
+/* XA_MARK_0 flags the pages that are being revoked, their count is 0 */
+#define VILO_WINDOW_REVOKE XA_MARK_0
+
+/* Drops one DMA mapping of the pages from first to last */
+static void vilo_window_put(struct virtio_lo_device *dev, unsigned long first,
+			    unsigned long last)
+{
+	unsigned long pfn, flags;
+	bool revoke = false;
+
+	xa_lock_irqsave(&dev->window, flags);
+	for (pfn = first; pfn <= last; pfn++) {
+		void *entry = xa_load(&dev->window, pfn);
+		unsigned long n;
+
+		/* gone with a reset */
+		if (!entry || !xa_to_value(entry)) {
+			continue;
+		}
+		n = xa_to_value(entry) - 1;
+		__xa_store(&dev->window, pfn, xa_mk_value(n), GFP_ATOMIC);
+		if (!n) {
+			__xa_set_mark(&dev->window, pfn, VILO_WINDOW_REVOKE);
+			revoke = true;
+		}
+	}
+	xa_unlock_irqrestore(&dev->window, flags);
+
+	/* the page tables cannot be changed from here, the pages are kept
+	 * until they have been unmapped */
+	if (revoke) {
+		schedule_work(&dev->window_work);
+	}
+}
+
+static int vilo_window_add(struct virtio_lo_device *dev, phys_addr_t addr,
+			   size_t len)
+{
+	unsigned long pfn, first, last, flags;
+	int ret = 0;
+
+	if (!len) {
+		return 0;
+	}
+	first = PHYS_PFN(addr);
+	last = PHYS_PFN(addr + len - 1);
+	/* called from the DMA API, possibly with the ring locks held */
+	xa_lock_irqsave(&dev->window, flags);
+	for (pfn = first; pfn <= last; pfn++) {
+		void *entry = xa_load(&dev->window, pfn);
+
+		if (entry) {
+			__xa_store(&dev->window, pfn,
+				   xa_mk_value(xa_to_value(entry) + 1),
+				   GFP_ATOMIC);
+			__xa_clear_mark(&dev->window, pfn, VILO_WINDOW_REVOKE);
+			continue;
+		}
+		ret = xa_err(__xa_store(&dev->window, pfn, xa_mk_value(1),
+					GFP_ATOMIC));
+		if (ret) {
+			break;
+		}
+		/* the page stays around until the backend cannot reach it */
+		get_page(pfn_to_page(pfn));
+	}
+	xa_unlock_irqrestore(&dev->window, flags);
+
+	if (ret && pfn > first) {
+		vilo_window_put(dev, first, pfn - 1);
+	}
+	return ret;
+}
+
+static void vilo_window_del(struct virtio_lo_device *dev, phys_addr_t addr,
+			    size_t len)
+{
+	if (len) {
+		vilo_window_put(dev, PHYS_PFN(addr), PHYS_PFN(addr + len - 1));
+	}
+}
+
+/* The PTEs of the window hold no reference to the pages, the ones taken by
+ * vilo_window_add() are dropped only once the pages are unmapped */
+static void vilo_window_zap(struct virtio_lo_device *dev, unsigned long pfn,
+			    unsigned long n)
+{
+	unsigned long i;
+
+	unmap_mapping_range(dev->inode->i_mapping,
+			    VIRTIO_LO_REGION_OFFSET(VIRTIO_LO_REGION_WINDOW) +
+				    ((u64)pfn << PAGE_SHIFT),
+			    (u64)n << PAGE_SHIFT, 1);
+	for (i = 0; i < n; i++) {
+		put_page(pfn_to_page(pfn + i));
+	}
+}
+
+/* Unmaps the pages whose last DMA mapping is gone */
+static void vilo_window_revoke(struct work_struct *work)
+{
+	struct virtio_lo_device *dev =
+		container_of(work, struct virtio_lo_device, window_work);
+	unsigned long pfn, start = 0, n = 0;
+	void *entry;
+
+	/* no fault can map a page between its removal and the unmap */
+	mutex_lock(&dev->window_lock);
+	xa_for_each_marked (&dev->window, pfn, entry, VILO_WINDOW_REVOKE) {
+		bool gone = false;
+
+		xa_lock_irq(&dev->window);
+		/* mapped again meanwhile */
+		if (xa_to_value(xa_load(&dev->window, pfn))) {
+			__xa_clear_mark(&dev->window, pfn, VILO_WINDOW_REVOKE);
+		} else {
+			__xa_erase(&dev->window, pfn);
+			gone = true;
+		}
+		xa_unlock_irq(&dev->window);
+		if (!gone) {
+			continue;
+		}
+
+		/* unmap contiguous pages at once */
+		if (n && pfn != start + n) {
+			vilo_window_zap(dev, start, n);
+			n = 0;
+		}
+		if (!n) {
+			start = pfn;
+		}
+		n++;
+	}
+	if (n) {
+		vilo_window_zap(dev, start, n);
+	}
+	mutex_unlock(&dev->window_lock);
+}
+
+void virtio_lo_window_reset(struct virtio_lo_device *dev)
+{
+	unsigned long pfn;
+	void *entry;
+
+	if (!dev->window_enabled) {
+		return;
+	}
+	cancel_work_sync(&dev->window_work);
+
+	/* nothing can fault the pages in again until the lock is dropped, so
+	 * the whole region is unmapped before the references go */
+	mutex_lock(&dev->window_lock);
+	/* the other regions of the device files stay mapped */
+	unmap_mapping_range(dev->inode->i_mapping,
+			    VIRTIO_LO_REGION_OFFSET(VIRTIO_LO_REGION_WINDOW),
+			    VIRTIO_LO_REGION_OFFSET(1), 1);
+	xa_for_each (&dev->window, pfn, entry) {
+		xa_erase_irq(&dev->window, pfn);
+		put_page(pfn_to_page(pfn));
+	}
+	mutex_unlock(&dev->window_lock);
+}
+
+static inline bool vilo_window_mapped(struct virtio_lo_device *dev,
+				      unsigned long pfn)
+{
+	return xa_to_value(xa_load(&dev->window, pfn));
+}
+
+static vm_fault_t vilo_window_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct virtio_lo_device *dev = vma->vm_private_data;
+	unsigned long pfn = vmf->pgoff &
+			    (BIT(VIRTIO_LO_REGION_SHIFT - PAGE_SHIFT) - 1);
+	unsigned long i, n;
+	vm_fault_t ret = VM_FAULT_NOPAGE;
+
+	mutex_lock(&dev->window_lock);
+	if (!vilo_window_mapped(dev, pfn)) {
+		mutex_unlock(&dev->window_lock);
+		return VM_FAULT_SIGBUS;
+	}
+
+	/* map the rest of the buffer right away */
+	n = min((vma->vm_end - vmf->address) >> PAGE_SHIFT,
+		(unsigned long)VIRTIO_LO_WINDOW_FAULT_PAGES);
+	for (i = 0; i < n; i++) {
+		vm_fault_t r;
+
+		if (i && !vilo_window_mapped(dev, pfn + i)) {
+			break;
+		}
+		r = vmf_insert_pfn(vma, vmf->address + (i << PAGE_SHIFT),
+				   pfn + i);
+		if (r != VM_FAULT_NOPAGE) {
+			ret = i ? VM_FAULT_NOPAGE : r;
+			break;
+		}
+	}
+	mutex_unlock(&dev->window_lock);
+	return ret;
+}
+
+static const struct vm_operations_struct vilo_window_vm_ops = {
+	.fault = vilo_window_fault,
+};
+
+static int vilo_window_mmap(struct virtio_lo_device *dev,
+			    struct vm_area_struct *vma)
+{
+	if (!dev->window_enabled) {
+		return -ENODEV;
+	}
+	vilo_vm_flags_set(vma, VM_PFNMAP | VM_IO | VM_DONTEXPAND | VM_DONTDUMP);
+	vma->vm_ops = &vilo_window_vm_ops;
+	vma->vm_private_data = dev;
+	return 0;
+}
+
+#ifdef CONFIG_DMA_OPS
+
+/* DMA API of the platform device of a window device: the DMA addresses
+ * are the physical ones, every mapping is added to the window. The window
+ * works in pages, so the buffers that share their pages with other memory
+ * are bounced through pages of their own. So are the buffers above the
+ * end of the window region. */
+
+/* Copy of a driver buffer, every page of the copy points to it in
+ * window_bounce */
+struct vilo_window_bounce {
+	phys_addr_t phys;
+	size_t size;
+	void *va;
+};
+
+static struct virtio_lo_device *vilo_window_device(struct device *dev)
+{
+	return *(struct virtio_lo_device **)dev_get_platdata(dev);
+}
+
+/* the window region of the device files is that large */
+static inline bool vilo_window_reachable(phys_addr_t phys, size_t size)
+{
+	return phys + size <= VIRTIO_LO_REGION_OFFSET(1);
+}
+
+/* kmalloc buffers and parts of pages, and the memory the backend cannot
+ * reach */
+static bool vilo_window_shared(struct page *page, unsigned long offset,
+			       size_t size)
+{
+	return size && (!PAGE_ALIGNED(offset) || !PAGE_ALIGNED(size) ||
+			PageSlab(page) ||
+			!vilo_window_reachable(page_to_phys(page) + offset,
+					       size));
+}
+
+/* Allocates pages the window can expose, retries from ZONE_DMA32 like
+ * dma-direct does for a device with a limited mask */
+static void *vilo_window_alloc_pages(size_t size, gfp_t gfp)
+{
+	void *va;
+
+	va = alloc_pages_exact(size, gfp | __GFP_ZERO);
+	if (va && !vilo_window_reachable(virt_to_phys(va), size)) {
+		free_pages_exact(va, size);
+		va = NULL;
+		if (IS_ENABLED(CONFIG_ZONE_DMA32)) {
+			va = alloc_pages_exact(size,
+					       gfp | __GFP_ZERO | GFP_DMA32);
+		}
+	}
+	return va;
+}
+
+static void vilo_window_bounce_copy(struct vilo_window_bounce *b, size_t off,
+				    size_t size, bool to_device)
+{
+	phys_addr_t phys = b->phys + off;
+	void *va = b->va + off;
+
+	/* the buffer may be in highmem */
+	while (size) {
+		struct page *page = pfn_to_page(PHYS_PFN(phys));
+		size_t poff = offset_in_page(phys);
+		size_t n = min_t(size_t, size, PAGE_SIZE - poff);
+
+		if (to_device) {
+			memcpy_from_page(va, page, poff, n);
+		} else {
+			memcpy_to_page(page, poff, va, n);
+		}
+		phys += n;
+		va += n;
+		size -= n;
+	}
+}
+
+/* Removes the copy starting at addr from window_bounce */
+static struct vilo_window_bounce *
+vilo_window_bounce_take(struct virtio_lo_device *dev, dma_addr_t addr)
+{
+	struct vilo_window_bounce *b;
+	unsigned long pfn, flags;
+
+	xa_lock_irqsave(&dev->window_bounce, flags);
+	b = xa_load(&dev->window_bounce, PHYS_PFN(addr));
+	if (b) {
+		for (pfn = PHYS_PFN(addr); pfn <= PHYS_PFN(addr + b->size - 1);
+		     pfn++) {
+			__xa_erase(&dev->window_bounce, pfn);
+		}
+	}
+	xa_unlock_irqrestore(&dev->window_bounce, flags);
+	return b;
+}
+
+static void vilo_window_bounce_free(struct vilo_window_bounce *b)
+{
+	/* the window keeps the pages until the backend cannot reach them */
+	free_pages_exact(b->va, b->size);
+	kfree(b);
+}
+
+static dma_addr_t vilo_window_bounce_map(struct virtio_lo_device *dev,
+					 phys_addr_t phys, size_t size,
+					 enum dma_data_direction dir)
+{
+	struct vilo_window_bounce *b;
+	unsigned long pfn, flags;
+	dma_addr_t addr;
+	int ret = 0;
+
+	b = kmalloc(sizeof(*b), GFP_ATOMIC);
+	if (!b) {
+		return DMA_MAPPING_ERROR;
+	}
+	/* zeroed, the backend sees the rest of the last page */
+	b->va = vilo_window_alloc_pages(size, GFP_ATOMIC);
+	if (!b->va) {
+		kfree(b);
+		return DMA_MAPPING_ERROR;
+	}
+	b->phys = phys;
+	b->size = size;
+	if (dir == DMA_TO_DEVICE || dir == DMA_BIDIRECTIONAL) {
+		vilo_window_bounce_copy(b, 0, size, true);
+	}
+
+	addr = virt_to_phys(b->va);
+	xa_lock_irqsave(&dev->window_bounce, flags);
+	for (pfn = PHYS_PFN(addr); pfn <= PHYS_PFN(addr + size - 1); pfn++) {
+		ret = xa_err(__xa_store(&dev->window_bounce, pfn, b,
+					GFP_ATOMIC));
+		if (ret) {
+			break;
+		}
+	}
+	xa_unlock_irqrestore(&dev->window_bounce, flags);
+	if (!ret) {
+		ret = vilo_window_add(dev, addr, size);
+	}
+	if (ret) {
+		vilo_window_bounce_take(dev, addr);
+		vilo_window_bounce_free(b);
+		return DMA_MAPPING_ERROR;
+	}
+	return addr;
+}
+
+static void *vilo_window_alloc(struct device *dev, size_t size,
+			       dma_addr_t *dma_handle, gfp_t gfp,
+			       unsigned long attrs)
+{
+	void *va;
+
+	va = vilo_window_alloc_pages(size, gfp);
+	if (!va) {
+		return NULL;
+	}
+	*dma_handle = virt_to_phys(va);
+	if (vilo_window_add(vilo_window_device(dev), *dma_handle, size)) {
+		free_pages_exact(va, size);
+		return NULL;
+	}
+	return va;
+}
+
+static void vilo_window_free(struct device *dev, size_t size, void *vaddr,
+			     dma_addr_t dma_handle, unsigned long attrs)
+{
+	vilo_window_del(vilo_window_device(dev), dma_handle, size);
+	free_pages_exact(vaddr, size);
+}
+
+static dma_addr_t vilo_window_map_page(struct device *dev, struct page *page,
+				       unsigned long offset, size_t size,
+				       enum dma_data_direction dir,
+				       unsigned long attrs)
+{
+	struct virtio_lo_device *vdev = vilo_window_device(dev);
+	phys_addr_t phys = page_to_phys(page) + offset;
+
+	if (vilo_window_shared(page, offset, size)) {
+		return vilo_window_bounce_map(vdev, phys, size, dir);
+	}
+	if (vilo_window_add(vdev, phys, size)) {
+		return DMA_MAPPING_ERROR;
+	}
+	return phys;
+}
+
+static void vilo_window_unmap_page(struct device *dev, dma_addr_t addr,
+				   size_t size, enum dma_data_direction dir,
+				   unsigned long attrs)
+{
+	struct virtio_lo_device *vdev = vilo_window_device(dev);
+	struct vilo_window_bounce *b;
+
+	b = vilo_window_bounce_take(vdev, addr);
+	if (b && (dir == DMA_FROM_DEVICE || dir == DMA_BIDIRECTIONAL)) {
+		vilo_window_bounce_copy(b, 0, b->size, false);
+	}
+	vilo_window_del(vdev, addr, size);
+	if (b) {
+		vilo_window_bounce_free(b);
+	}
+}
+
+static void vilo_window_sync_single_for_cpu(struct device *dev,
+					    dma_addr_t addr, size_t size,
+					    enum dma_data_direction dir)
+{
+	struct vilo_window_bounce *b;
+
+	b = xa_load(&vilo_window_device(dev)->window_bounce, PHYS_PFN(addr));
+	if (b && (dir == DMA_FROM_DEVICE || dir == DMA_BIDIRECTIONAL)) {
+		vilo_window_bounce_copy(b, addr - virt_to_phys(b->va), size,
+					false);
+	}
+}
+
+static void vilo_window_sync_single_for_device(struct device *dev,
+					       dma_addr_t addr, size_t size,
+					       enum dma_data_direction dir)
+{
+	struct vilo_window_bounce *b;
+
+	b = xa_load(&vilo_window_device(dev)->window_bounce, PHYS_PFN(addr));
+	if (b && (dir == DMA_TO_DEVICE || dir == DMA_BIDIRECTIONAL)) {
+		vilo_window_bounce_copy(b, addr - virt_to_phys(b->va), size,
+					true);
+	}
+}
+
+static void vilo_window_sync_sg_for_cpu(struct device *dev,
+					struct scatterlist *sgl, int nents,
+					enum dma_data_direction dir)
+{
+	struct scatterlist *sg;
+	int i;
+
+	for_each_sg (sgl, sg, nents, i) {
+		vilo_window_sync_single_for_cpu(dev, sg_dma_address(sg),
+						sg_dma_len(sg), dir);
+	}
+}
+
+static void vilo_window_sync_sg_for_device(struct device *dev,
+					   struct scatterlist *sgl, int nents,
+					   enum dma_data_direction dir)
+{
+	struct scatterlist *sg;
+	int i;
+
+	for_each_sg (sgl, sg, nents, i) {
+		vilo_window_sync_single_for_device(dev, sg_dma_address(sg),
+						   sg_dma_len(sg), dir);
+	}
+}
+
+static void vilo_window_unmap_sg(struct device *dev, struct scatterlist *sgl,
+				 int nents, enum dma_data_direction dir,
+				 unsigned long attrs)
+{
+	struct scatterlist *sg;
+	int i;
+
+	for_each_sg (sgl, sg, nents, i) {
+		vilo_window_unmap_page(dev, sg_dma_address(sg), sg_dma_len(sg),
+				       dir, attrs);
+	}
+}
+
+static int vilo_window_map_sg(struct device *dev, struct scatterlist *sgl,
+			      int nents, enum dma_data_direction dir,
+			      unsigned long attrs)
+{
+	struct scatterlist *sg;
+	int i;
+
+	for_each_sg (sgl, sg, nents, i) {
+		sg->dma_address = vilo_window_map_page(dev, sg_page(sg),
+						       sg->offset, sg->length,
+						       dir, attrs);
+		if (sg->dma_address == DMA_MAPPING_ERROR) {
+			vilo_window_unmap_sg(dev, sgl, i, dir, attrs);
+			return 0;
+		}
+		sg_dma_len(sg) = sg->length;
+	}
+	return nents;
+}
+
+static const struct dma_map_ops virtio_lo_window_dma_ops = {
+	.alloc = vilo_window_alloc,
+	.free = vilo_window_free,
+	.map_page = vilo_window_map_page,
+	.unmap_page = vilo_window_unmap_page,
+	.map_sg = vilo_window_map_sg,
+	.unmap_sg = vilo_window_unmap_sg,
+	.sync_single_for_cpu = vilo_window_sync_single_for_cpu,
+	.sync_single_for_device = vilo_window_sync_single_for_device,
+	.sync_sg_for_cpu = vilo_window_sync_sg_for_cpu,
+	.sync_sg_for_device = vilo_window_sync_sg_for_device,
+};
+
+int virtio_lo_window_setup_dma(struct device *dev)
+{
+	int ret;
+
+	/* the DMA addresses are offsets in the window region */
+	ret = dma_coerce_mask_and_coherent(dev,
+					   DMA_BIT_MASK(VIRTIO_LO_REGION_SHIFT));
+	if (ret) {
+		return ret;
+	}
+	set_dma_ops(dev, &virtio_lo_window_dma_ops);
+	return 0;
+}
+
+#else /* CONFIG_DMA_OPS */
+
+int virtio_lo_window_setup_dma(struct device *dev)
+{
+	return -EOPNOTSUPP;
+}
+
+#endif /* CONFIG_DMA_OPS */
+
+/* Shared memory regions */
+
+static int vilo_shm_mmap(struct virtio_lo_device *dev, unsigned id,
+			 struct vm_area_struct *vma, unsigned long pgoff)
+{
+	unsigned long len = vma->vm_end - vma->vm_start;
+	unsigned i;
+
+	for (i = 0; i < dev->nshm; i++) {
+		struct virtio_lo_shm_region *shm = &dev->shm[i];
+
+		if (shm->id != id) {
+			continue;
+		}
+		if ((pgoff << PAGE_SHIFT) + len > shm->len) {
+			return -EINVAL;
+		}
+		/* device memory, not cached like RAM */
+		if (io_remap_pfn_range(vma, vma->vm_start,
+				       (shm->addr >> PAGE_SHIFT) + pgoff, len,
+				       pgprot_writecombine(vma->vm_page_prot))) {
+			return -EAGAIN;
+		}
+		return 0;
+	}
+	return -ENODEV;
+}
+
+/* Busy polling */
+
+static int vilo_poll_mmap(struct virtio_lo_device *dev,
+			  struct vm_area_struct *vma, unsigned long pgoff)
+{
+	if (!dev->poll_state) {
+		return -ENODEV;
+	}
+	/* the state is only written by the poller */
+	if (vma->vm_flags & VM_WRITE) {
+		return -EPERM;
+	}
+	vilo_vm_flags_clear(vma, VM_MAYWRITE);
+	return remap_vmalloc_range(vma, dev->poll_state, pgoff);
+}
+
+/* Config page */
+
+static int vilo_config_mmap(struct virtio_lo_device *dev,
+			    struct vm_area_struct *vma, unsigned long pgoff)
+{
+	return remap_vmalloc_range(vma, dev->config_page, pgoff);
+}
+
+/* Doorbells */
+
+static int vilo_doorbell_mmap(struct virtio_lo_device *dev,
+			      struct vm_area_struct *vma, unsigned long pgoff)
+{
+	if (!dev->doorbell) {
+		return -ENODEV;
+	}
+	return remap_vmalloc_range(vma, dev->doorbell, pgoff);
+}
+
+/* Device files */
+
+static int vilo_device_file_release(struct inode *inode, struct file *file)
+{
+	struct virtio_lo_device *dev = file->private_data;
+	virtio_lo_device_put(dev);
+	return 0;
+}
+
+static int vilo_device_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct virtio_lo_device *dev = file->private_data;
+	unsigned long region =
+		vma->vm_pgoff >> (VIRTIO_LO_REGION_SHIFT - PAGE_SHIFT);
+	unsigned long pgoff = vma->vm_pgoff &
+			      (BIT(VIRTIO_LO_REGION_SHIFT - PAGE_SHIFT) - 1);
+
+	if (READ_ONCE(dev->removed)) {
+		return -ENODEV;
+	}
+
+	switch (region) {
+	case VIRTIO_LO_REGION_POOL:
+		if (!dev->pool) {
+			return -ENODEV;
+		}
+		return virtio_lo_pool_mmap(dev->pool, vma, pgoff);
+	case VIRTIO_LO_REGION_WINDOW:
+		return vilo_window_mmap(dev, vma);
+	case VIRTIO_LO_REGION_POLL:
+		return vilo_poll_mmap(dev, vma, pgoff);
+	case VIRTIO_LO_REGION_DOORBELL:
+		return vilo_doorbell_mmap(dev, vma, pgoff);
+	case VIRTIO_LO_REGION_CONFIG:
+		return vilo_config_mmap(dev, vma, pgoff);
+	case VIRTIO_LO_REGION_SHM(0) ... VIRTIO_LO_REGION_SHM(U8_MAX):
+		return vilo_shm_mmap(dev, region - VIRTIO_LO_REGION_SHM(0), vma,
+				     pgoff);
+	default:
+		return -EINVAL;
+	}
+}
+
+static const struct file_operations vilo_device_fops = {
+	.owner = THIS_MODULE,
+	.release = vilo_device_file_release,
+	.mmap = vilo_device_file_mmap,
+	.llseek = noop_llseek,
+};
+
+/* Takes over a reference to dev */
+static int vilo_device_getfd(struct virtio_lo_device *dev)
+{
+	struct file *file;
+	int fd;
+
+	fd = get_unused_fd_flags(O_CLOEXEC);
+	if (fd < 0) {
+		virtio_lo_device_put(dev);
+		return fd;
+	}
+	file = anon_inode_getfile("[virtio-lo-device]", &vilo_device_fops, dev,
+				  O_RDWR | O_CLOEXEC);
+	if (IS_ERR(file)) {
+		put_unused_fd(fd);
+		virtio_lo_device_put(dev);
+		return PTR_ERR(file);
+	}
+	/* the window is mapped through the inode of the device */
+	if (dev->inode) {
+		file->f_mapping = dev->inode->i_mapping;
+	}
+	fd_install(fd, file);
+	return fd;
+}
+
+static long vilo_ioctl_device_fd(struct virtio_lo_owner *owner, unsigned idx)
+{
+	struct virtio_lo_device *dev;
+
+	dev = virtio_owner_getdev(owner, idx);
+	if (!dev) {
+		return -ENOENT;
+	}
+	return vilo_device_getfd(dev);
+}
+
+/* Returns false if the backend is polling the doorbell and does not need
+ * to be woken up */
+static inline bool vilo_ring_doorbell(struct virtio_lo_doorbell *db, u32 avail)
+{
+	WRITE_ONCE(db->avail, avail);
+	smp_wmb();
+	WRITE_ONCE(db->seq, db->seq + 1);
+	/* pairs with the barrier between setting sleeping and checking seq in
+	 * the backend */
+	smp_mb();
+	return READ_ONCE(db->sleeping);
+}
+
+void virtio_lo_kick_device(struct virtio_lo_device *dev, unsigned qidx,
+			   u32 avail)
+{
+	struct virtio_lo_vq_info *info = &dev->queues[qidx];
+	struct eventfd_ctx *kick;
+
+	if (dev->features & BIT_ULL(VIRTIO_F_NOTIFICATION_DATA)) {
+		WRITE_ONCE(info->notify_data, qidx | avail << 16);
+		smp_mb__before_atomic();
+	}
+	atomic64_inc(&info->notified);
+	if (dev->doorbell && !vilo_ring_doorbell(&dev->doorbell[qidx], avail)) {
+		return;
+	}
+	/* VDUSE_VQ_SETUP_KICKFD may replace the eventfd */
+	rcu_read_lock();
+	kick = READ_ONCE(info->device_kick);
+	if (kick) {
+		eventfd_signal(kick, 1);
+	}
+	rcu_read_unlock();
+	if (wq_has_sleeper(&info->notify_wait)) {
+		wake_up_interruptible_poll(&info->notify_wait, EPOLLIN);
+	}
+}
+
+void virtio_lo_set_queue(struct virtio_lo_device *dev, unsigned qidx, u32 size,
+			 u64 desc, u64 avail, u64 used)
+{
+	struct virtio_lo_vq_info *info = &dev->queues[qidx];
+	dev_notice(&vl_device_parent,
+		   "setting queue addr %u size %u\n"
+		   "\tdesc  %016llx\n"
+		   "\tavail %016llx\n"
+		   "\tused  %016llx\n",
+		   qidx, size, desc, avail, used);
+	mutex_lock(&dev->queue_lock);
+	info->size = size;
+	info->desc = desc;
+	info->avail = avail;
+	info->used = used;
+	mutex_unlock(&dev->queue_lock);
+	virtio_lo_event(dev, VIRTIO_LO_EVENT_QUEUE_SETUP, qidx, 0);
+}
+
+void virtio_lo_del_queue(struct virtio_lo_device *dev, unsigned qidx)
+{
+	struct virtio_lo_vq_info *info = &dev->queues[qidx];
+
+	/* the queue files that have mapped the rings hold their pages */
+	mutex_lock(&dev->queue_lock);
+	info->size = 0;
+	info->desc = 0;
+	info->avail = 0;
+	info->used = 0;
+	mutex_unlock(&dev->queue_lock);
+	virtio_lo_event(dev, VIRTIO_LO_EVENT_QUEUE_DEL, qidx, 0);
+}
+
+void virtio_lo_event(struct virtio_lo_device *dev, u32 type, unsigned qidx,
+		     u64 value)
+{
+	struct virtio_lo_owner *owner = dev->events;
+	struct virtio_lo_event ev = {
+		.type = type,
+		.idx = dev->idx,
+		.qidx = qidx,
+		.value = value,
+	};
+	unsigned long flags;
+
+	if (!owner) {
+		return;
+	}
+	if (type == VIRTIO_LO_EVENT_QUEUE_SETUP) {
+		ev.size = dev->queues[qidx].size;
+		ev.desc = dev->queues[qidx].desc;
+		ev.avail = dev->queues[qidx].avail;
+		ev.used = dev->queues[qidx].used;
+	}
+
+	spin_lock_irqsave(&owner->events_lock, flags);
+	if (!kfifo_put(&owner->events, ev)) {
+		owner->events_lost++;
+	}
+	spin_unlock_irqrestore(&owner->events_lock, flags);
+
+	wake_up_interruptible_poll(&owner->events_wait, EPOLLIN);
+}
+
+void virtio_lo_config_device(struct virtio_lo_device *dev)
+{
+	if (dev->config_kick) {
+		eventfd_signal(dev->config_kick, 1);
+	}
+}
+
+void virtio_lo_config_get(struct virtio_lo_device *dev, unsigned offset,
+			  void *buf, unsigned len)
+{
+	unsigned seq;
+
+	do {
+		seq = read_seqbegin(&dev->config_lock);
+		memcpy(buf, dev->config + offset, len);
+	} while (read_seqretry(&dev->config_lock, seq));
+}
+
+unsigned virtio_lo_config_generation(struct virtio_lo_device *dev)
+{
+	/* bumped by the writers, so a reader that sees the same value before
+	 * and after reading the fields got a consistent config */
+	return READ_ONCE(dev->config_generation);
+}
+
+/* Copies a change of the config to the config page, called with
+ * config_lock held. A backend update in progress is never waited for,
+ * the change is then only seen through VIRTIO_LO_GCONF. */
+static void vilo_config_mirror(struct virtio_lo_device *dev, unsigned offset,
+			       unsigned len)
+{
+	struct virtio_lo_config_page *page = dev->config_page;
+	u32 seq = READ_ONCE(page->seq);
+
+	if ((seq & 1) || cmpxchg(&page->seq, seq, seq + 1) != seq) {
+		return;
+	}
+	memcpy(page->config + offset, dev->config + offset, len);
+	WRITE_ONCE(page->generation, dev->config_generation);
+	smp_wmb();
+	WRITE_ONCE(page->seq, seq + 2);
+}
+
+void virtio_lo_config_set(struct virtio_lo_device *dev, unsigned offset,
+			  const void *buf, unsigned len)
+{
+	unsigned long flags;
+
+	/* readers may run in interrupt context */
+	write_seqlock_irqsave(&dev->config_lock, flags);
+	memcpy(dev->config + offset, buf, len);
+	WRITE_ONCE(dev->config_generation, dev->config_generation + 1);
+	vilo_config_mirror(dev, offset, len);
+	write_sequnlock_irqrestore(&dev->config_lock, flags);
+}
+
+/* Takes the config the backend has written to the config page. Fails with
+ * -EAGAIN instead of waiting if an update of the page is in progress. */
+static int vilo_config_publish(struct virtio_lo_device *dev)
+{
+	struct virtio_lo_config_page *page = dev->config_page;
+	unsigned long flags;
+	void *config;
+	u32 seq;
+
+	config = kmalloc(dev->config_size, GFP_KERNEL);
+	if (!config) {
+		return -ENOMEM;
+	}
+	seq = READ_ONCE(page->seq);
+	smp_rmb();
+	memcpy(config, page->config, dev->config_size);
+	smp_rmb();
+	if ((seq & 1) || READ_ONCE(page->seq) != seq) {
+		kfree(config);
+		return -EAGAIN;
+	}
+
+	write_seqlock_irqsave(&dev->config_lock, flags);
+	memcpy(dev->config, config, dev->config_size);
+	WRITE_ONCE(dev->config_generation, dev->config_generation + 1);
+	write_sequnlock_irqrestore(&dev->config_lock, flags);
+	kfree(config);
+	return 0;
+}
+
+/* VDUSE personality
+ *
+ * /dev/virtio-lo accepts the ioctls of /dev/vduse/control. VDUSE_CREATE_DEV
+ * returns a file descriptor that behaves like /dev/vduse/$NAME: the
+ * device ioctls, SET_STATUS requests to read() and responses to write().
+ * The IOVA domain is the pool of the device, VDUSE_IOTLB_GET_FD hands out
+ * a device file mapping it. The driver part is added once all the queues
+ * have been set up with VDUSE_VQ_SETUP, which stands in for attaching the
+ * device to the vDPA bus. */
+
+/* how long the backend has to answer a request */
+#define VILO_VDUSE_MSG_TIMEOUT (30 * HZ)
+
+/* Fails all the requests, the backend or the device is gone */
+static void vilo_vduse_flush(struct virtio_lo_vduse *v)
+{
+	struct vilo_vduse_msg *msg, *n;
+
+	spin_lock(&v->lock);
+	list_splice_init(&v->recv_list, &v->send_list);
+	list_for_each_entry_safe (msg, n, &v->send_list, list) {
+		list_del(&msg->list);
+		msg->resp.result = VDUSE_REQ_RESULT_FAILED;
+		msg->completed = true;
+		wake_up(&msg->waitq);
+	}
+	spin_unlock(&v->lock);
+	wake_up(&v->waitq);
+}
+
+static int vilo_vduse_msg_sync(struct virtio_lo_device *dev,
+			       struct vilo_vduse_msg *msg)
+{
+	struct virtio_lo_vduse *v = dev->vduse;
+	int ret;
+
+	init_waitqueue_head(&msg->waitq);
+	spin_lock(&v->lock);
+	if (!v->connected || READ_ONCE(dev->removed)) {
+		spin_unlock(&v->lock);
+		return -ENOTCONN;
+	}
+	msg->req.request_id = v->msg_id++;
+	list_add_tail(&msg->list, &v->send_list);
+	spin_unlock(&v->lock);
+	wake_up(&v->waitq);
+
+	wait_event_killable_timeout(msg->waitq, READ_ONCE(msg->completed),
+				    VILO_VDUSE_MSG_TIMEOUT);
+
+	/* the message lives on our stack, it must be off the lists */
+	spin_lock(&v->lock);
+	if (!msg->completed) {
+		list_del(&msg->list);
+		ret = -ETIMEDOUT;
+	} else if (msg->resp.result != VDUSE_REQ_RESULT_OK) {
+		ret = -EIO;
+	} else {
+		ret = 0;
+	}
+	spin_unlock(&v->lock);
+	return ret;
+}
+
+int virtio_lo_device_set_status(struct virtio_lo_device *dev, u8 status)
+{
+	struct vilo_vduse_msg msg = {};
+
+	if (!dev->vduse) {
+		return 0;
+	}
+	msg.req.type = VDUSE_SET_STATUS;
+	msg.req.s.status = status;
+	return vilo_vduse_msg_sync(dev, &msg);
+}
+
+/* should be called under rcu_read_lock(), the driver part stays valid
+ * until rcu_read_unlock() */
+static bool vilo_vduse_bound(struct virtio_lo_device *dev)
+{
+	return !READ_ONCE(dev->removed) && completion_done(&dev->init_done) &&
+	       dev->driver;
+}
+
+static struct vilo_vduse_msg *vilo_vduse_find(struct list_head *list, u32 id)
+{
+	struct vilo_vduse_msg *msg;
+
+	list_for_each_entry (msg, list, list) {
+		if (msg->req.request_id == id) {
+			return msg;
+		}
+	}
+	return NULL;
+}
+
+static ssize_t vilo_vduse_read(struct file *file, char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	struct virtio_lo_device *dev = file->private_data;
+	struct virtio_lo_vduse *v = dev->vduse;
+	struct vduse_dev_request req;
+	struct vilo_vduse_msg *msg;
+
+	if (count < sizeof(req)) {
+		return -EINVAL;
+	}
+	spin_lock(&v->lock);
+	while (list_empty(&v->send_list)) {
+		int ret;
+
+		spin_unlock(&v->lock);
+		if (READ_ONCE(dev->removed)) {
+			return 0;
+		}
+		if (file->f_flags & O_NONBLOCK) {
+			return -EAGAIN;
+		}
+		ret = wait_event_interruptible_exclusive(
+			v->waitq, !list_empty(&v->send_list) ||
+					  READ_ONCE(dev->removed));
+		if (ret) {
+			return ret;
+		}
+		spin_lock(&v->lock);
+	}
+	msg = list_first_entry(&v->send_list, struct vilo_vduse_msg, list);
+	list_move_tail(&msg->list, &v->recv_list);
+	req = msg->req;
+	spin_unlock(&v->lock);
+
+	if (copy_to_user(buf, &req, sizeof(req))) {
+		/* requeue it unless the sender has given up meanwhile */
+		spin_lock(&v->lock);
+		msg = vilo_vduse_find(&v->recv_list, req.request_id);
+		if (msg) {
+			list_move(&msg->list, &v->send_list);
+		}
+		spin_unlock(&v->lock);
+		return -EFAULT;
+	}
+	return sizeof(req);
+}
+
+static ssize_t vilo_vduse_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct virtio_lo_device *dev = file->private_data;
+	struct virtio_lo_vduse *v = dev->vduse;
+	struct vduse_dev_response resp;
+	struct vilo_vduse_msg *msg;
+
+	if (count < sizeof(resp)) {
+		return -EINVAL;
 	}
-	if (copy_to_user(di.qinfo, qi, dev->nqueues * sizeof(*qi))) {
-		ret = -EFAULT;
+	if (copy_from_user(&resp, buf, sizeof(resp))) {
+		return -EFAULT;
 	}
-	if (copy_to_user(&info->idx, &dev->idx, sizeof(dev->idx))) {
-		ret = -EFAULT;
+
+	spin_lock(&v->lock);
+	msg = vilo_vduse_find(&v->recv_list, resp.request_id);
+	if (msg) {
+		list_del(&msg->list);
+		msg->resp = resp;
+		msg->completed = true;
+		wake_up(&msg->waitq);
 	}
-	if (copy_to_user(&info->features, &dev->features,
-			 sizeof(dev->features))) {
-		ret = -EFAULT;
+	spin_unlock(&v->lock);
+
+	return msg ? sizeof(resp) : -ENOENT;
+}
+
+static __poll_t vilo_vduse_poll(struct file *file, poll_table *wait)
+{
+	struct virtio_lo_device *dev = file->private_data;
+	struct virtio_lo_vduse *v = dev->vduse;
+	__poll_t events = 0;
+
+	poll_wait(file, &v->waitq, wait);
+	spin_lock(&v->lock);
+	if (!list_empty(&v->send_list)) {
+		events |= EPOLLIN | EPOLLRDNORM;
 	}
-	if (copy_to_user(di.config, dev->config, dev->config_size)) {
-		ret = -EFAULT;
+	if (!list_empty(&v->recv_list)) {
+		events |= EPOLLOUT | EPOLLWRNORM;
 	}
-	spin_lock_irqsave(&owner->lock, flags);
-	list_add(&dev->devlist, &owner->devlist);
-	spin_unlock_irqrestore(&owner->lock, flags);
-
-	kfree(qi);
-	return ret;
-err_queues:
-	kfree(dev->queues);
-err_qi:
-	kfree(qi);
-err_conf:
-	kfree(dev->config);
-err_dev:
-	kfree(dev);
-	return ret;
+	spin_unlock(&v->lock);
+	if (READ_ONCE(dev->removed)) {
+		events |= EPOLLHUP;
+	}
+	return events;
 }
 
-static long vilo_ioctl_deldev(struct virtio_lo_owner *owner, unsigned idx)
+static int vilo_vduse_release(struct inode *inode, struct file *file)
 {
-	unsigned long flags;
-	long ret = -ENOENT;
-	struct virtio_lo_device *dev;
+	struct virtio_lo_device *dev = file->private_data;
+	struct virtio_lo_vduse *v = dev->vduse;
 
-	spin_lock_irqsave(&owner->lock, flags);
+	spin_lock(&v->lock);
+	v->connected = false;
+	spin_unlock(&v->lock);
+	vilo_vduse_flush(v);
 
-	dev = virtio_owner_getdev_unlocked(owner, idx);
-	if (dev) {
-		list_del(&dev->devlist);
-		virtio_lo_device_release(dev);
-		ret = 0;
+	virtio_lo_device_put(dev);
+	return 0;
+}
+
+static long vilo_vduse_iotlb_get_fd(struct virtio_lo_device *dev,
+				    struct vduse_iotlb_entry __user *argp)
+{
+	struct virtio_lo_vduse *v = dev->vduse;
+	struct vduse_iotlb_entry e;
+
+	if (copy_from_user(&e, argp, sizeof(e))) {
+		return -EFAULT;
 	}
-	spin_unlock_irqrestore(&owner->lock, flags);
-	return ret;
+	if (e.start > e.last || e.start >= v->iova_size) {
+		return -EINVAL;
+	}
+	e.offset = VIRTIO_LO_REGION_OFFSET(VIRTIO_LO_REGION_POOL);
+	e.start = 0;
+	e.last = v->iova_size - 1;
+	e.perm = VDUSE_ACCESS_RW;
+	if (copy_to_user(argp, &e, sizeof(e))) {
+		return -EFAULT;
+	}
+
+	/* the reference is passed to the file */
+	kref_get(&dev->kref);
+	return vilo_device_getfd(dev);
 }
 
-static long vilo_ioctl_getconf(struct virtio_lo_owner *owner,
-			       struct virtio_lo_config __user *conf)
+static long vilo_vduse_set_config(struct virtio_lo_device *dev,
+				  struct vduse_config_data __user *argp)
 {
-	struct virtio_lo_config c;
-	struct virtio_lo_device *dev;
+	struct vduse_config_data c;
 	void *mem;
-	long ret = 0;
-	if (copy_from_user(&c, conf, sizeof(c)))
+
+	if (copy_from_user(&c, argp, sizeof(c))) {
 		return -EFAULT;
-	dev = virtio_owner_getdev(owner, c.idx);
-	if (!dev) {
-		return -ENOENT;
 	}
 	if (c.offset >= dev->config_size ||
-	    c.offset + c.len > dev->config_size) {
+	    c.length > dev->config_size - c.offset) {
 		return -EINVAL;
 	}
-	mem = kmalloc(c.len, GFP_KERNEL);
-	if (!mem) {
-		return -ENOMEM;
-	}
-	virtio_lo_config_get(dev, c.offset, mem, c.len);
-	if (copy_to_user(c.config, mem, c.len)) {
-		ret = -EFAULT;
+	mem = memdup_user(argp->buffer, c.length);
+	if (IS_ERR(mem)) {
+		return PTR_ERR(mem);
 	}
+	virtio_lo_config_set(dev, c.offset, mem, c.length);
 	kfree(mem);
-
-	return ret;
+	return 0;
 }
 
-static long vilo_ioctl_setconf(struct virtio_lo_owner *owner,
-			       const struct virtio_lo_config __user *conf)
+static long vilo_vduse_vq_setup(struct virtio_lo_device *dev,
+				const struct vduse_vq_config __user *argp)
 {
-	struct virtio_lo_config c;
-	struct virtio_lo_device *dev;
-	void *mem;
-	long ret;
-	if (copy_from_user(&c, conf, sizeof(c)))
+	struct virtio_lo_vduse *v = dev->vduse;
+	struct vduse_vq_config c;
+	unsigned i;
+	long ret = 0;
+
+	if (copy_from_user(&c, argp, sizeof(c))) {
 		return -EFAULT;
-	dev = virtio_owner_getdev(owner, c.idx);
-	if (!dev) {
-		return -ENOENT;
 	}
-	if (c.offset >= dev->config_size ||
-	    c.offset + c.len > dev->config_size) {
+	if (c.index >= dev->nqueues || !c.max_size) {
 		return -EINVAL;
 	}
 
-	mem = kmalloc(c.len, GFP_KERNEL);
-	if (!mem) {
-		return -ENOMEM;
+	spin_lock(&v->lock);
+	if (v->started || READ_ONCE(dev->removed)) {
+		ret = -EBUSY;
+		goto out;
 	}
-	if (copy_from_user(mem, c.config, c.len)) {
-		ret = -EFAULT;
-	} else {
-		virtio_lo_config_set(dev, c.offset, mem, c.len);
-		virtio_lo_config_driver(dev->pdev);
-		ret = 0;
+	dev->queues[c.index].maxsize = c.max_size;
+	for (i = 0; i < dev->nqueues; i++) {
+		if (!dev->queues[i].maxsize) {
+			goto out;
+		}
 	}
-	kfree(mem);
+	/* everything is OK, create driver part platform device */
+	v->started = true;
+	queue_work(vilo_wq, &dev->init_work);
+out:
+	spin_unlock(&v->lock);
 	return ret;
 }
 
-static long vilo_ioctl_kick(struct virtio_lo_owner *owner,
-			    const struct virtio_lo_kick __user *kick)
+static long vilo_vduse_vq_get_info(struct virtio_lo_device *dev,
+				   struct vduse_vq_info __user *argp)
 {
-	struct virtio_lo_kick k;
-	struct virtio_lo_device *dev;
-	if (copy_from_user(&k, kick, sizeof(k)))
+	struct virtio_lo_vq_info *info;
+	struct vduse_vq_info vqi = {};
+
+	if (get_user(vqi.index, &argp->index)) {
 		return -EFAULT;
-	dev = virtio_owner_getdev(owner, k.idx);
-	if (!dev) {
-		return -ENOENT;
 	}
-	if (k.qidx >= dev->nqueues) {
+	if (vqi.index >= dev->nqueues) {
 		return -EINVAL;
 	}
-	virtio_lo_kick_driver(dev->pdev, k.qidx);
-
+	info = &dev->queues[vqi.index];
+	/* the queue is ready once the driver has set it up */
+	vqi.num = info->size;
+	vqi.desc_addr = info->desc;
+	vqi.driver_addr = info->avail;
+	vqi.device_addr = info->used;
+	vqi.ready = !!info->size;
+	if (copy_to_user(argp, &vqi, sizeof(vqi))) {
+		return -EFAULT;
+	}
 	return 0;
 }
 
-void virtio_lo_kick_device(struct virtio_lo_device *dev, int qidx)
+static long vilo_vduse_vq_setup_kickfd(struct virtio_lo_device *dev,
+				       const struct vduse_vq_eventfd __user *argp)
 {
-	if (qidx >= 0 && qidx < dev->nqueues) {
-		if (dev->queues[qidx].device_kick) {
-			eventfd_signal(dev->queues[qidx].device_kick, 1);
-		}
-	} else {
-		unsigned i;
-		for (i = 0; i < dev->nqueues; i++) {
-			if (dev->queues[i].device_kick) {
-				eventfd_signal(dev->queues[i].device_kick, 1);
-			}
+	struct vduse_vq_eventfd e;
+	struct eventfd_ctx *ctx = NULL;
+
+	if (copy_from_user(&e, argp, sizeof(e))) {
+		return -EFAULT;
+	}
+	if (e.index >= dev->nqueues) {
+		return -EINVAL;
+	}
+	if (e.fd != VDUSE_EVENTFD_DEASSIGN) {
+		ctx = eventfd_ctx_fdget(e.fd);
+		if (IS_ERR(ctx)) {
+			return PTR_ERR(ctx);
 		}
 	}
+	ctx = xchg(&dev->queues[e.index].device_kick, ctx);
+	if (ctx) {
+		/* virtio_lo_kick_device may still be signalling it */
+		synchronize_rcu();
+		eventfd_ctx_put(ctx);
+	}
+	return 0;
 }
 
-void virtio_lo_set_queue(struct virtio_lo_device *dev, unsigned qidx, u32 size,
-			 u64 desc, u64 avail, u64 used)
+static long vilo_vduse_ioctl(struct file *file, unsigned int cmd,
+			     unsigned long arg)
 {
-	struct virtio_lo_vq_info *info = &dev->queues[qidx];
-	dev_notice(&vl_device_parent,
-		   "setting queue addr %u size %u\n"
-		   "\tdesc  %016llx\n"
-		   "\tavail %016llx\n"
-		   "\tused  %016llx\n",
-		   qidx, size, desc, avail, used);
-	info->size = size;
-	info->desc = desc;
-	info->avail = avail;
-	info->used = used;
-}
+	struct virtio_lo_device *dev = file->private_data;
+	void __user *argp = (void __user *)arg;
+	u32 qidx;
+	long ret = 0;
 
-void virtio_lo_config_device(struct virtio_lo_device *dev)
-{
-	if (dev->config_kick) {
-		eventfd_signal(dev->config_kick, 1);
+	switch (cmd) {
+	case VDUSE_IOTLB_GET_FD:
+		ret = vilo_vduse_iotlb_get_fd(dev, argp);
+		break;
+	case VDUSE_DEV_GET_FEATURES:
+		ret = put_user(READ_ONCE(dev->features), (u64 __user *)argp);
+		break;
+	case VDUSE_DEV_SET_CONFIG:
+		ret = vilo_vduse_set_config(dev, argp);
+		break;
+	case VDUSE_DEV_INJECT_CONFIG_IRQ:
+		rcu_read_lock();
+		if (vilo_vduse_bound(dev)) {
+			virtio_lo_config_driver(dev);
+		} else {
+			ret = -EINVAL;
+		}
+		rcu_read_unlock();
+		break;
+	case VDUSE_VQ_SETUP:
+		ret = vilo_vduse_vq_setup(dev, argp);
+		break;
+	case VDUSE_VQ_GET_INFO:
+		ret = vilo_vduse_vq_get_info(dev, argp);
+		break;
+	case VDUSE_VQ_SETUP_KICKFD:
+		ret = vilo_vduse_vq_setup_kickfd(dev, argp);
+		break;
+	case VDUSE_VQ_INJECT_IRQ:
+		if (get_user(qidx, (u32 __user *)argp)) {
+			ret = -EFAULT;
+			break;
+		}
+		if (qidx >= dev->nqueues) {
+			ret = -EINVAL;
+			break;
+		}
+		rcu_read_lock();
+		if (vilo_vduse_bound(dev)) {
+			virtio_lo_kick_driver(dev, qidx);
+		} else {
+			ret = -EINVAL;
+		}
+		rcu_read_unlock();
+		break;
+	default:
+		ret = -ENOTTY;
+		break;
 	}
+	return ret;
 }
 
-void virtio_lo_config_get(struct virtio_lo_device *dev, unsigned offset,
-			  void *buf, unsigned len)
+static const struct file_operations vilo_vduse_fops = {
+	.owner = THIS_MODULE,
+	.release = vilo_vduse_release,
+	.read = vilo_vduse_read,
+	.write = vilo_vduse_write,
+	.poll = vilo_vduse_poll,
+	.unlocked_ioctl = vilo_vduse_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.llseek = noop_llseek,
+};
+
+static long vilo_vduse_create(struct virtio_lo_owner *owner,
+			      struct vduse_dev_config __user *argp)
 {
-	unsigned long flags;
-	spin_lock_irqsave(&dev->config_lock, flags);
-	memcpy(buf, dev->config + offset, len);
-	spin_unlock_irqrestore(&dev->config_lock, flags);
+	struct vduse_dev_config c;
+	struct virtio_lo_devinfo di = {};
+	struct virtio_lo_device *dev;
+	struct virtio_lo_vduse *v;
+	unsigned long idx;
+	long ret;
+
+	if (copy_from_user(&c, argp, sizeof(c))) {
+		return -EFAULT;
+	}
+	if (!c.name[0] || strnlen(c.name, VDUSE_NAME_MAX) == VDUSE_NAME_MAX) {
+		return -EINVAL;
+	}
+	if (!c.vq_num || memchr_inv(c.reserved, 0, sizeof(c.reserved))) {
+		return -EINVAL;
+	}
+
+	/* the name is checked and the device inserted at once */
+	mutex_lock(&owner->vduse_lock);
+	xa_for_each (&owner->vduse, idx, dev) {
+		if (!strcmp(dev->vduse->name, c.name)) {
+			ret = -EEXIST;
+			goto out;
+		}
+	}
+
+	v = kzalloc(sizeof(*v), GFP_KERNEL);
+	if (!v) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	strscpy(v->name, c.name, sizeof(v->name));
+	v->iova_size = PAGE_ALIGN(vduse_pool_size);
+	spin_lock_init(&v->lock);
+	INIT_LIST_HEAD(&v->send_list);
+	INIT_LIST_HEAD(&v->recv_list);
+	init_waitqueue_head(&v->waitq);
+	v->connected = true;
+
+	/* vq_align is not used, the rings are laid out by the driver part */
+	di.device_id = c.device_id;
+	di.vendor_id = c.vendor_id;
+	di.nqueues = c.vq_num;
+	di.features = c.features;
+	di.config_size = c.config_size;
+	di.config_kick = -1;
+	di.config = argp->config;
+	di.flags = VIRTIO_LO_F_POOL;
+	di.pool_size = v->iova_size;
+	dev = vilo_device_create(owner, &di, VILO_CREATE_NO_QINFO);
+	if (IS_ERR(dev)) {
+		kfree(v);
+		ret = PTR_ERR(dev);
+		goto out;
+	}
+	dev->vduse = v;
+
+	vilo_debugfs_add(dev);
+	if (xa_insert(&owner->vduse, dev->idx, dev, GFP_KERNEL)) {
+		virtio_lo_device_remove(dev);
+		ret = -ENOMEM;
+		goto out;
+	}
+	/* the reference is passed to the file */
+	kref_get(&dev->kref);
+	ret = anon_inode_getfd("[virtio-lo-vduse]", &vilo_vduse_fops, dev,
+			       O_RDWR | O_CLOEXEC);
+	if (ret < 0) {
+		virtio_lo_device_put(dev);
+		if (xa_erase(&owner->vduse, dev->idx) == dev) {
+			virtio_lo_device_remove(dev);
+		}
+	}
+out:
+	mutex_unlock(&owner->vduse_lock);
+	return ret;
 }
 
-unsigned virtio_lo_config_generation(struct virtio_lo_device *dev)
+static long vilo_vduse_destroy(struct virtio_lo_owner *owner,
+			       const char __user *argp)
 {
-	unsigned long flags;
-	unsigned ret;
-	spin_lock_irqsave(&dev->config_lock, flags);
-	ret = dev->generation;
-	spin_unlock_irqrestore(&dev->config_lock, flags);
-	return ret;
+	char name[VDUSE_NAME_MAX];
+	struct virtio_lo_device *dev;
+	unsigned long idx;
+
+	if (copy_from_user(name, argp, sizeof(name))) {
+		return -EFAULT;
+	}
+	name[VDUSE_NAME_MAX - 1] = '\0';
+
+	mutex_lock(&owner->vduse_lock);
+	xa_for_each (&owner->vduse, idx, dev) {
+		if (strcmp(dev->vduse->name, name)) {
+			continue;
+		}
+		if (xa_erase(&owner->vduse, idx) != dev) {
+			break;
+		}
+		mutex_unlock(&owner->vduse_lock);
+		virtio_lo_device_remove(dev);
+		return 0;
+	}
+	mutex_unlock(&owner->vduse_lock);
+	return -EINVAL;
 }
 
-void virtio_lo_config_set(struct virtio_lo_device *dev, unsigned offset,
-			  const void *buf, unsigned len)
+static long vilo_vduse_control_ioctl(struct virtio_lo_owner *owner,
+				     unsigned int cmd, void __user *argp)
 {
-	unsigned long flags;
-	spin_lock_irqsave(&dev->config_lock, flags);
-	memcpy(dev->config + offset, buf, len);
-	dev->generation++;
-	spin_unlock_irqrestore(&dev->config_lock, flags);
+	u64 version;
+
+	switch (cmd) {
+	case VDUSE_GET_API_VERSION:
+		return put_user((u64)VDUSE_API_VERSION, (u64 __user *)argp);
+	case VDUSE_SET_API_VERSION:
+		if (get_user(version, (u64 __user *)argp)) {
+			return -EFAULT;
+		}
+		return version == VDUSE_API_VERSION ? 0 : -EINVAL;
+	case VDUSE_CREATE_DEV:
+		return vilo_vduse_create(owner, argp);
+	case VDUSE_DESTROY_DEV:
+		return vilo_vduse_destroy(owner, argp);
+	default:
+		return -ENOTTY;
+	}
 }
 
 static long virtio_lo_misc_device_ioctl(struct file *file, unsigned int cmd,
@@ -445,13 +3201,25 @@ static long virtio_lo_misc_device_ioctl(struct file *file, unsigned int cmd,
 		return -ENOTTY;
 	}
 
+	if (_IOC_TYPE(cmd) == VDUSE_BASE) {
+		return vilo_vduse_control_ioctl(owner, cmd, argp);
+	}
 	if (_IOC_TYPE(cmd) != VIRTIO_LOIO) {
 		return -ENOTTY;
 	}
 
+	/* every size of struct virtio_lo_devinfo goes to the same command */
+	if (_IOC_NR(cmd) == _IOC_NR(VIRTIO_LO_ADDDEV) &&
+	    _IOC_DIR(cmd) == (_IOC_READ | _IOC_WRITE)) {
+		return vilo_ioctl_adddev(owner, argp, _IOC_SIZE(cmd));
+	}
+
 	switch (cmd) {
-	case VIRTIO_LO_ADDDEV:
-		ret = vilo_ioctl_adddev(owner, argp);
+	case VIRTIO_LO_ADDDEV_RESULT:
+		ret = vilo_ioctl_adddev_result(owner, argp);
+		break;
+	case VIRTIO_LO_ADDDEV_BULK:
+		ret = vilo_ioctl_adddev_bulk(owner, argp);
 		break;
 	case VIRTIO_LO_DELDEV:
 		ret = vilo_ioctl_deldev(owner, arg);
@@ -462,9 +3230,33 @@ static long virtio_lo_misc_device_ioctl(struct file *file, unsigned int cmd,
 	case VIRTIO_LO_SCONF:
 		ret = vilo_ioctl_setconf(owner, argp);
 		break;
+	case VIRTIO_LO_CONFIG_CHANGED:
+		ret = vilo_ioctl_config_changed(owner, arg);
+		break;
 	case VIRTIO_LO_KICK:
 		ret = vilo_ioctl_kick(owner, argp);
 		break;
+	case VIRTIO_LO_KICK_BATCH:
+		ret = vilo_ioctl_kick_batch(owner, argp);
+		break;
+	case VIRTIO_LO_QUEUE_FD:
+		ret = vilo_ioctl_queue_fd(owner, argp);
+		break;
+	case VIRTIO_LO_DEVICE_FD:
+		ret = vilo_ioctl_device_fd(owner, arg);
+		break;
+	case VIRTIO_LO_SET_POLL:
+		ret = vilo_ioctl_set_poll(owner, argp);
+		break;
+	case VIRTIO_LO_SET_COALESCE:
+		ret = vilo_ioctl_set_coalesce(owner, argp);
+		break;
+	case VIRTIO_LO_SET_AFFINITY:
+		ret = vilo_ioctl_set_affinity(owner, argp);
+		break;
+	case VIRTIO_LO_GSTATS:
+		ret = vilo_ioctl_getstats(owner, argp);
+		break;
 	default:
 		ret = -EINVAL;
 		break;
@@ -473,9 +3265,108 @@ static long virtio_lo_misc_device_ioctl(struct file *file, unsigned int cmd,
 	return ret;
 }
 
+static bool vilo_events_pending(struct virtio_lo_owner *owner)
+{
+	return !kfifo_is_empty(&owner->events) || READ_ONCE(owner->events_lost);
+}
+
+/* how many events are copied at once */
+#define VILO_EVENTS_BATCH 8
+
+static ssize_t virtio_lo_misc_device_read(struct file *file, char __user *buf,
+					  size_t count, loff_t *ppos)
+{
+	struct virtio_lo_owner *owner = file->private_data;
+	struct virtio_lo_event ev[VILO_EVENTS_BATCH];
+	size_t done = 0;
+	int ret = 0;
+
+	if (count < sizeof(ev[0])) {
+		return -EINVAL;
+	}
+again:
+	while (!vilo_events_pending(owner)) {
+		if (file->f_flags & O_NONBLOCK) {
+			return -EAGAIN;
+		}
+		ret = wait_event_interruptible(owner->events_wait,
+					      vilo_events_pending(owner));
+		if (ret) {
+			return ret;
+		}
+	}
+	if (mutex_lock_interruptible(&owner->events_read_lock)) {
+		return -ERESTARTSYS;
+	}
+
+	/* Events are peeked and only taken out of the queue once copied, a
+	 * fault leaves them for the next read. Writers only append, so the
+	 * head stays the same while the lock is held. */
+	while (count - done >= sizeof(ev[0])) {
+		unsigned n = min_t(size_t, (count - done) / sizeof(ev[0]),
+				   VILO_EVENTS_BATCH);
+		unsigned long flags;
+		u64 lost = 0;
+
+		spin_lock_irqsave(&owner->events_lock, flags);
+		/* the loss is reported once the queue has been drained, the
+		 * backend then knows it has seen everything before it */
+		if (kfifo_is_empty(&owner->events) && owner->events_lost) {
+			lost = owner->events_lost;
+			memset(&ev[0], 0, sizeof(ev[0]));
+			ev[0].type = VIRTIO_LO_EVENT_LOST;
+			ev[0].idx = -1;
+			ev[0].value = lost;
+			n = 1;
+		} else {
+			n = kfifo_out_peek(&owner->events, ev, n);
+		}
+		spin_unlock_irqrestore(&owner->events_lock, flags);
+
+		if (!n) {
+			break;
+		}
+		if (copy_to_user(buf + done, ev, n * sizeof(ev[0]))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		spin_lock_irqsave(&owner->events_lock, flags);
+		if (lost) {
+			/* more may have been lost in the meantime */
+			owner->events_lost -= lost;
+		} else {
+			n = kfifo_out(&owner->events, ev, n);
+		}
+		spin_unlock_irqrestore(&owner->events_lock, flags);
+		done += n * sizeof(ev[0]);
+	}
+	mutex_unlock(&owner->events_read_lock);
+
+	/* another reader took what woke us up */
+	if (!done && !ret) {
+		goto again;
+	}
+	return done ? done : ret;
+}
+
+static __poll_t virtio_lo_misc_device_poll(struct file *file, poll_table *wait)
+{
+	struct virtio_lo_owner *owner = file->private_data;
+	__poll_t events = 0;
+
+	poll_wait(file, &owner->events_wait, wait);
+	if (vilo_events_pending(owner)) {
+		events |= EPOLLIN | EPOLLRDNORM;
+	}
+	return events;
+}
+
 static struct file_operations virtio_lo_misc_device_fops = {
 	.owner = THIS_MODULE,
 	.open = virtio_lo_misc_device_open,
+	.read = virtio_lo_misc_device_read,
+	.poll = virtio_lo_misc_device_poll,
 	.unlocked_ioctl = virtio_lo_misc_device_ioctl,
 	.mmap = virtio_lo_misc_device_mmap,
 	.release = virtio_lo_misc_device_release
@@ -489,21 +3380,38 @@ static struct miscdevice virtio_lo_misc_device = {
 
 int __init virtio_lo_device_init(void)
 {
-	vilo_wq = create_singlethread_workqueue("virtio-lo");
+	int ret;
+
+	/* the driver parts of several devices are probed concurrently */
+	vilo_wq = alloc_workqueue("virtio-lo", WQ_UNBOUND, 0);
 	if (!vilo_wq) {
 		return -ENOMEM;
 	}
-	if (device_register(&vl_device_parent)) {
-		destroy_workqueue(vilo_wq);
+	ret = device_register(&vl_device_parent);
+	if (ret) {
+		put_device(&vl_device_parent);
+		goto err_wq;
 	}
+	vilo_debugfs = debugfs_create_dir(dev_name(&vl_device_parent), NULL);
 
-	return misc_register(&virtio_lo_misc_device);
+	ret = misc_register(&virtio_lo_misc_device);
+	if (ret) {
+		goto err_parent;
+	}
+	return 0;
+err_parent:
+	debugfs_remove(vilo_debugfs);
+	device_unregister(&vl_device_parent);
+err_wq:
+	destroy_workqueue(vilo_wq);
+	return ret;
 }
 
 void __exit virtio_lo_device_exit(void)
 {
 	flush_workqueue(vilo_wq);
 	destroy_workqueue(vilo_wq);
+	debugfs_remove(vilo_debugfs);
 	device_unregister(&vl_device_parent);
 	misc_deregister(&virtio_lo_misc_device);
 }
@@ -7,10 +7,58 @@
 #define _VIRTIO_LO_DEVICE_H
 
 #include <linux/completion.h>
+#include <linux/irq_work.h>
 #include <linux/kref.h>
-#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/seqlock.h>
 #include <linux/types.h>
+#include <linux/wait.h>
 #include <linux/workqueue.h>
+#include <linux/xarray.h>
+
+/* The alignment to use between consumer and producer parts of vring.
+ * Currently hardcoded to the page size. */
+#define VIRTIO_LO_VRING_ALIGN PAGE_SIZE
+
+struct device;
+struct inode;
+struct virtio_lo_config_page;
+struct virtio_lo_device;
+struct virtio_lo_doorbell;
+struct virtio_lo_driver;
+struct virtio_lo_owner;
+struct virtio_lo_pool;
+struct virtio_lo_vduse;
+
+struct virtio_lo_shm_region {
+	u8 id;
+	u64 addr;
+	u64 len;
+};
+
+/* Number of buckets of the notification -> used buffer time histogram */
+#define VIRTIO_LO_RTT_BUCKETS 32
+
+/* see struct virtio_lo_qstats, the rest is only in debugfs */
+struct virtio_lo_vq_stats {
+	atomic64_t notifications;
+	atomic64_t notifications_suppressed;
+	atomic64_t interrupts;
+	atomic64_t interrupts_suppressed;
+
+	/* kicks of the driver, before moderation */
+	atomic64_t kicks;
+	/* interrupts that found no used buffer */
+	atomic64_t spurious;
+	/* most buffers in flight at a notification, split rings only */
+	u16 inflight_max;
+	/* ktime of the first notification not followed by a kick or by
+	 * used buffers seen by the poller yet */
+	atomic64_t notify_ns;
+	/* bucket n counts the times in [2^n, 2^(n+1)) ns */
+	atomic64_t rtt[VIRTIO_LO_RTT_BUCKETS];
+};
 
 struct virtio_lo_vq_info {
 	unsigned maxsize;
@@ -18,36 +66,115 @@ struct virtio_lo_vq_info {
 	u64 desc;
 	u64 avail;
 	u64 used;
+	/* replaced by VDUSE_VQ_SETUP_KICKFD, signalled under rcu_read_lock() */
 	struct eventfd_ctx *device_kick;
+
+	/* driver -> device notifications for the queue file */
+	atomic64_t notified;
+	/* see VIRTIO_F_NOTIFICATION_DATA */
+	u32 notify_data;
+	wait_queue_head_t notify_wait;
+
+	struct virtio_lo_vq_stats stats;
+
+	/* see struct virtio_lo_poll */
+	u32 poll_idle_usecs;
+	u32 poll_budget;
+
+	/* see struct virtio_lo_coalesce */
+	u32 coalesce_frames;
+	u32 coalesce_usecs;
+
+	/* see struct virtio_lo_affinity */
+	int irq_cpu;
+
+	/* irqfd-like call eventfd, device -> driver */
+	struct virtio_lo_device *dev;
+	unsigned qidx;
+	struct eventfd_ctx *driver_call;
+	/* only held until the call is armed */
+	struct file *driver_call_file;
+	wait_queue_entry_t call_wait;
+	poll_table call_pt;
+	struct irq_work call_work;
 };
 
 struct virtio_lo_device {
+	struct kref kref;
+	/* set before the driver part is unregistered */
+	bool removed;
+
 	unsigned idx;
 	u32 device_id;
 	u32 vendor_id;
 	int card_index;
 
+	/* unique among all the devices, names the platform device */
+	int id;
+	/* see VIRTIO_LO_F_DIRECT, pdev is NULL then */
+	bool direct;
 	struct platform_device *pdev;
+	/* the driver part, set while its virtio device is registered */
+	struct virtio_lo_driver *driver;
 
 	u64 device_features;
 
+	/* completed once the driver part has been probed */
 	struct completion init_done;
 	struct work_struct init_work;
+	/* see VIRTIO_LO_F_ASYNC */
+	struct eventfd_ctx *done_kick;
 
 	/* State machine */
-	spinlock_t status_lock;
-	u8 status;
+	atomic_t status;
 	u64 features;
 
-	spinlock_t config_lock;
-	unsigned generation;
-	unsigned config_size;
+	/* config seen by the driver, under config_lock. The config page
+	 * shared with the backend mirrors it and is taken back with
+	 * VIRTIO_LO_CONFIG_CHANGED. */
+	seqlock_t config_lock;
+	u32 config_generation;
 	void *config;
+	unsigned config_size;
+	struct virtio_lo_config_page *config_page;
 	struct eventfd_ctx *config_kick;
 
 	unsigned nqueues;
 	struct virtio_lo_vq_info *queues;
-	struct list_head devlist;
+	/* serializes the queue addresses with the queue files mapping them */
+	struct mutex queue_lock;
+
+	/* see VIRTIO_LO_F_POOL */
+	struct virtio_lo_pool *pool;
+
+	unsigned nshm;
+	struct virtio_lo_shm_region *shm;
+
+	/* see VIRTIO_LO_F_POLL, one entry per queue, written by the poller */
+	u32 *poll_state;
+
+	/* see VIRTIO_LO_F_DOORBELL, one entry per queue */
+	struct virtio_lo_doorbell *doorbell;
+
+	struct dentry *debugfs;
+
+	/* see VIRTIO_LO_F_EVENTS, owner receiving the events or NULL */
+	struct virtio_lo_owner *events;
+
+	/* devices created with VDUSE_CREATE_DEV, NULL for the others */
+	struct virtio_lo_vduse *vduse;
+
+	/* see VIRTIO_LO_F_WINDOW, pfn -> number of DMA mappings of the page.
+	 * window_lock serializes the faults with the revocations done by
+	 * window_work. */
+	bool window_enabled;
+	struct xarray window;
+	struct mutex window_lock;
+	struct work_struct window_work;
+	/* pfn of a page of a bounce buffer -> struct vilo_window_bounce */
+	struct xarray window_bounce;
+	/* inode of the device files, NULL without a window */
+	struct inode *inode;
 };
 
 /* interaction between driver and device */
@@ -57,15 +184,40 @@ struct virtio_lo_device {
 /** Forward queue addresses */
 void virtio_lo_set_queue(struct virtio_lo_device *dev, unsigned qidx, u32 size,
 			 u64 desc, u64 avail, u64 used);
+/** Forget the queue addresses, the rings are about to be freed */
+void virtio_lo_del_queue(struct virtio_lo_device *dev, unsigned qidx);
 /** Queue kick device -> driver */
-void virtio_lo_kick_driver(struct platform_device *pdev, int qidx);
-
-/** Queue kick driver -> device */
-void virtio_lo_kick_device(struct virtio_lo_device *dev, int qidx);
+void virtio_lo_kick_driver(struct virtio_lo_device *dev, int qidx);
+
+/** Queue kick driver -> device, avail is the avail index of split rings */
+void virtio_lo_kick_device(struct virtio_lo_device *dev, unsigned qidx,
+			   u32 avail);
+
+/* Driver part */
+/** Register the virtio device of dev under parent, without a platform
+ * device, see VIRTIO_LO_F_DIRECT */
+int virtio_lo_driver_add(struct virtio_lo_device *dev, struct device *parent);
+/** Unregister the virtio device added by virtio_lo_driver_add */
+void virtio_lo_driver_remove(struct virtio_lo_device *dev);
+
+/* Status */
+/** Let the backend accept a status change, 0 if it did */
+int virtio_lo_device_set_status(struct virtio_lo_device *dev, u8 status);
+
+/* Events */
+/** Report an action of the driver to the backend, see VIRTIO_LO_F_EVENTS */
+void virtio_lo_event(struct virtio_lo_device *dev, u32 type, unsigned qidx,
+		     u64 value);
+
+/* Memory window */
+/** Revoke the access to all the memory */
+void virtio_lo_window_reset(struct virtio_lo_device *dev);
+/** Make the DMA API of the platform device add the mappings to the window */
+int virtio_lo_window_setup_dma(struct device *dev);
 
 /* Config routines */
 /** Config change device -> driver */
-void virtio_lo_config_driver(struct platform_device *pdev);
+void virtio_lo_config_driver(struct virtio_lo_device *dev);
 
 /** Config change driver -> device */
 void virtio_lo_config_device(struct virtio_lo_device *dev);
@@ -5,33 +5,76 @@
 
 #include <linux/completion.h>
 #include <linux/eventfd.h>
+#include <linux/cpumask.h>
+#include <linux/hrtimer.h>
+#include <linux/irq_work.h>
+#include <linux/kthread.h>
+#include <linux/log2.h>
 #include <linux/module.h>
 #include <linux/platform_device.h>
+#include <linux/rcupdate.h>
 #include <linux/slab.h>
-#include <linux/spinlock.h>
 #include <linux/virtio.h>
 #include <linux/virtio_config.h>
 #include <linux/virtio_ring.h>
 
+#include "virtio_lo.h"
 #include "virtio_lo_device.h"
+#include "virtio_lo_pool.h"
 
-/* The alignment to use between consumer and producer parts of vring.
- * Currently hardcoded to the page size. */
-#define VIRTIO_LO_VRING_ALIGN PAGE_SIZE
+#define CREATE_TRACE_POINTS
+#include "virtio_lo_trace.h"
+
+#define VL_NAME "virtio-lo"
 
 #define to_virtio_lo_driver(_virt_dev)                                         \
 	container_of(_virt_dev, struct virtio_lo_driver, vdev)
 
 #define to_virtio_lo_device(_virt_dev) (to_virtio_lo_driver(_virt_dev)->device)
 
+struct virtio_lo_vq {
+	struct virtqueue *vq;
+	/* packed rings only, NULL if it cannot be accessed directly */
+	struct vring_packed_desc_event *driver_event;
+
+	/* avail index at the previous notification */
+	u16 notified_avail;
+	/* used index at the previous kick, for VIRTIO_RING_F_EVENT_IDX */
+	u16 signalled_used;
+	bool signalled_used_valid;
+
+	/* busy polling, ktime in ns up to which the queue is polled */
+	atomic64_t poll_deadline;
+	/* used index seen by the poller and completions since it yielded */
+	u16 poll_used;
+	unsigned poll_work;
+
+	/* interrupt moderation, kicks merged into the next interrupt */
+	struct virtio_lo_driver *driver;
+	unsigned qidx;
+	atomic_t coalesce_pending;
+	struct hrtimer coalesce_timer;
+
+	/* affinity requested by the driver and the CPU picked from it, -1
+	 * for none */
+	struct cpumask affinity;
+	int cpu;
+	/* delivers the kicks on another CPU */
+	struct irq_work kick_work;
+};
+
 struct virtio_lo_driver {
 	struct virtio_device vdev;
+	/* NULL for devices added with VIRTIO_LO_F_DIRECT */
 	struct platform_device *pdev;
 
 	struct virtio_lo_device *device;
 
 	/* Array of queues */
-	struct virtqueue **queues;
+	struct virtio_lo_vq *queues;
+
+	/* see VIRTIO_LO_F_POLL */
+	struct task_struct *poll_task;
 };
 
 /* Configuration interface */
@@ -40,7 +83,7 @@ static u64 vl_get_features(struct virtio_device *vdev)
 {
 	struct virtio_lo_device *vl_dev = to_virtio_lo_device(vdev);
 
-	dev_notice(&vdev->dev, "get features %llx", vl_dev->features);
+	dev_dbg(&vdev->dev, "get features %llx", vl_dev->features);
 
 	return vl_dev->features;
 }
@@ -48,9 +91,19 @@ static u64 vl_get_features(struct virtio_device *vdev)
 static int vl_finalize_features(struct virtio_device *vdev)
 {
 	struct virtio_lo_device *vl_dev = to_virtio_lo_device(vdev);
+	bool notification_data =
+		__virtio_test_bit(vdev, VIRTIO_F_NOTIFICATION_DATA);
+
 	vring_transport_features(vdev);
+	/* the vring code does not know about the notification data, but
+	 * vl_notify provides it for split rings */
+	if (notification_data &&
+	    !__virtio_test_bit(vdev, VIRTIO_F_RING_PACKED)) {
+		__virtio_set_bit(vdev, VIRTIO_F_NOTIFICATION_DATA);
+	}
 	vl_dev->features = vdev->features;
-	dev_notice(&vdev->dev, "finalize features %llx", vl_dev->features);
+	dev_dbg(&vdev->dev, "finalize features %llx", vl_dev->features);
+	virtio_lo_event(vl_dev, VIRTIO_LO_EVENT_FEATURES, 0, vl_dev->features);
 	return 0;
 }
 
@@ -58,7 +111,8 @@ static void vl_get(struct virtio_device *vdev, unsigned offset, void *buf,
 		   unsigned len)
 {
 	struct virtio_lo_device *vl_dev = to_virtio_lo_device(vdev);
-	dev_notice(&vdev->dev, "get config");
+
+	trace_virtio_lo_config_get(vl_dev->idx, offset, len);
 
 	if (offset >= vl_dev->config_size ||
 	    offset + len > vl_dev->config_size) {
@@ -73,7 +127,8 @@ static void vl_set(struct virtio_device *vdev, unsigned offset, const void *buf,
 		   unsigned len)
 {
 	struct virtio_lo_device *vl_dev = to_virtio_lo_device(vdev);
-	dev_notice(&vdev->dev, "set config");
+
+	trace_virtio_lo_config_set(vl_dev->idx, offset, len);
 
 	if (offset >= vl_dev->config_size ||
 	    offset + len > vl_dev->config_size) {
@@ -87,100 +142,495 @@ static void vl_set(struct virtio_device *vdev, unsigned offset, const void *buf,
 static u32 vl_generation(struct virtio_device *vdev)
 {
 	struct virtio_lo_device *vl_dev = to_virtio_lo_device(vdev);
-	u32 ret;
 
-	ret = (u32)virtio_lo_config_generation(vl_dev);
-	dev_notice(&vdev->dev, "generation %d", ret);
-	return ret;
+	return (u32)virtio_lo_config_generation(vl_dev);
 }
 
 static u8 vl_get_status(struct virtio_device *vdev)
 {
 	struct virtio_lo_device *vl_dev = to_virtio_lo_device(vdev);
-	u8 ret;
-	unsigned long flags;
 
-	spin_lock_irqsave(&vl_dev->status_lock, flags);
-	ret = vl_dev->status;
-	spin_unlock_irqrestore(&vl_dev->status_lock, flags);
-	dev_notice(&vdev->dev, "get_status %x", ret);
-	return ret;
+	return atomic_read(&vl_dev->status);
 }
 
 static void vl_set_status(struct virtio_device *vdev, u8 status)
 {
 	struct virtio_lo_device *vl_dev = to_virtio_lo_device(vdev);
-	unsigned long flags;
 
 	/* We should never be setting status to 0. */
-	dev_notice(&vdev->dev, "set_status %x", status);
+	trace_virtio_lo_status(vl_dev->idx, status);
 	BUG_ON(status == 0);
 
-	spin_lock_irqsave(&vl_dev->status_lock, flags);
-	vl_dev->status = status;
-	spin_unlock_irqrestore(&vl_dev->status_lock, flags);
+	if (virtio_lo_device_set_status(vl_dev, status)) {
+		dev_warn(&vdev->dev, "status %x refused by the device", status);
+		return;
+	}
+	atomic_set(&vl_dev->status, status);
 	if (status & VIRTIO_CONFIG_S_DRIVER_OK) {
 		dev_notice(&vdev->dev, "init complete");
-		complete(&vl_dev->init_done);
 	}
+	virtio_lo_event(vl_dev, VIRTIO_LO_EVENT_STATUS, 0, status);
 }
 
 static void vl_reset(struct virtio_device *vdev)
 {
 	struct virtio_lo_device *vl_dev = to_virtio_lo_device(vdev);
-	unsigned long flags;
 
-	dev_notice(&vdev->dev, "reset");
-	spin_lock_irqsave(&vl_dev->status_lock, flags);
-	vl_dev->status = 0;
-	vl_dev->features = vl_dev->device_features;
-	spin_unlock_irqrestore(&vl_dev->status_lock, flags);
+	trace_virtio_lo_status(vl_dev->idx, 0);
+	/* the reset happens even if the device does not acknowledge it */
+	virtio_lo_device_set_status(vl_dev, 0);
+	WRITE_ONCE(vl_dev->features, vl_dev->device_features);
+	atomic_set(&vl_dev->status, 0);
+	virtio_lo_event(vl_dev, VIRTIO_LO_EVENT_RESET, 0, 0);
 }
 
 /* Transport interface */
 
+static inline bool vl_packed(struct virtqueue *vq)
+{
+	return virtio_has_feature(vq->vdev, VIRTIO_F_RING_PACKED);
+}
+
+static void vl_poll_start(struct virtio_lo_driver *vl_driv,
+			  struct virtio_lo_vq *q, unsigned qidx);
+
 /* the notify function used when creating a virt queue */
 static bool vl_notify(struct virtqueue *vq)
 {
 	struct virtio_lo_driver *vl_driv = vq->priv;
-	virtio_lo_kick_device(vl_driv->device, vq->index);
+	struct virtio_lo_vq *q = &vl_driv->queues[vq->index];
+	struct virtio_lo_vq_stats *stats =
+		&vl_driv->device->queues[vq->index].stats;
+	u16 avail = 0;
+
+	if (!vl_packed(vq)) {
+		const struct vring *vr = virtqueue_get_vring(vq);
+		u16 added;
+		u16 inflight;
+
+		avail = virtio16_to_cpu(vq->vdev, vr->avail->idx);
+		added = avail - q->notified_avail;
+		inflight = avail - virtio16_to_cpu(vq->vdev,
+						   READ_ONCE(vr->used->idx));
+		if (inflight > stats->inflight_max) {
+			WRITE_ONCE(stats->inflight_max, inflight);
+		}
+
+		q->notified_avail = avail;
+		if (added > 1) {
+			atomic64_add(added - 1,
+				     &stats->notifications_suppressed);
+		}
+	}
+	atomic64_inc(&stats->notifications);
+	if (!atomic64_read(&stats->notify_ns)) {
+		atomic64_cmpxchg(&stats->notify_ns, 0, ktime_get_ns());
+	}
+
+	trace_virtio_lo_notify(vl_driv->device->idx, vq->index, avail);
+	virtio_lo_kick_device(vl_driv->device, vq->index, avail);
+	if (vl_driv->poll_task && !vl_packed(vq)) {
+		vl_poll_start(vl_driv, q, vq->index);
+	}
 	return true;
 }
 
-void virtio_lo_kick_driver(struct platform_device *pdev, int qidx)
+/* Checks whether the driver wants to be interrupted for the buffers used
+ * since the previous kick, the same way a device would check it */
+static bool vl_need_interrupt(struct virtio_lo_vq *q, struct virtqueue *vq)
 {
-	struct virtio_lo_driver *vl_driv;
+	const struct vring *vr;
+	u16 used, old, event;
+	bool valid;
+
+	if (vl_packed(vq)) {
+		if (!q->driver_event) {
+			return true;
+		}
+		smp_mb();
+		return le16_to_cpu(READ_ONCE(q->driver_event->flags)) !=
+		       VRING_PACKED_EVENT_FLAG_DISABLE;
+	}
+	vr = virtqueue_get_vring(vq);
+
+	/* the used index has been published by the backend, make sure we see
+	 * the latest suppression state written by the driver */
+	smp_mb();
+	if (!virtio_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+		return !(virtio16_to_cpu(vq->vdev, READ_ONCE(vr->avail->flags)) &
+			 VRING_AVAIL_F_NO_INTERRUPT);
+	}
+
+	used = virtio16_to_cpu(vq->vdev, READ_ONCE(vr->used->idx));
+	event = virtio16_to_cpu(vq->vdev, READ_ONCE(vring_used_event(vr)));
+	old = READ_ONCE(q->signalled_used);
+	valid = READ_ONCE(q->signalled_used_valid);
+	WRITE_ONCE(q->signalled_used, used);
+	WRITE_ONCE(q->signalled_used_valid, true);
+
+	return !valid || vring_need_event(event, used, old);
+}
+
+/* used index for the tracepoints, 0 for packed rings or without a queue */
+static u16 vl_trace_used(struct virtqueue *vq)
+{
+	if (!vq || vl_packed(vq)) {
+		return 0;
+	}
+	return virtio16_to_cpu(vq->vdev,
+			       READ_ONCE(virtqueue_get_vring(vq)->used->idx));
+}
+
+static inline void vl_interrupt(struct virtio_lo_driver *vl_driv, unsigned qidx)
+{
+	struct virtio_lo_vq *q = &vl_driv->queues[qidx];
+	struct virtio_lo_vq_stats *stats = &vl_driv->device->queues[qidx].stats;
+	/* the queue may have not been set up or may be being deleted */
+	struct virtqueue *vq = READ_ONCE(q->vq);
+	bool need;
+
+	if (!vq) {
+		return;
+	}
+	need = vl_need_interrupt(q, vq);
+	if (trace_virtio_lo_interrupt_enabled()) {
+		trace_virtio_lo_interrupt(vl_driv->device->idx, qidx,
+					  vl_trace_used(vq), need);
+	}
+	if (need) {
+		atomic64_inc(&stats->interrupts);
+		if (vring_interrupt(0, vq) == IRQ_NONE) {
+			atomic64_inc(&stats->spurious);
+		}
+	} else {
+		atomic64_inc(&stats->interrupts_suppressed);
+	}
+}
+
+/* Interrupt moderation */
+
+static enum hrtimer_restart vl_coalesce_timer(struct hrtimer *timer)
+{
+	struct virtio_lo_vq *q =
+		container_of(timer, struct virtio_lo_vq, coalesce_timer);
 
-	vl_driv = platform_get_drvdata(pdev);
+	if (atomic_xchg(&q->coalesce_pending, 0)) {
+		rcu_read_lock();
+		vl_interrupt(q->driver, q->qidx);
+		rcu_read_unlock();
+	}
+	return HRTIMER_NORESTART;
+}
+
+/* called under rcu_read_lock */
+static void vl_coalesce_kick(struct virtio_lo_driver *vl_driv, unsigned qidx)
+{
+	struct virtio_lo_vq_info *info = &vl_driv->device->queues[qidx];
+	struct virtio_lo_vq *q = &vl_driv->queues[qidx];
+	u32 frames = READ_ONCE(info->coalesce_frames);
+	u32 usecs = READ_ONCE(info->coalesce_usecs);
+	int pending;
+
+	if (!usecs && frames <= 1) {
+		vl_interrupt(vl_driv, qidx);
+		return;
+	}
+
+	pending = atomic_inc_return(&q->coalesce_pending);
+	if (frames && pending >= frames) {
+		/* the timer finds nothing pending if it fires now */
+		if (atomic_xchg(&q->coalesce_pending, 0)) {
+			hrtimer_try_to_cancel(&q->coalesce_timer);
+			vl_interrupt(vl_driv, qidx);
+		}
+	} else if (pending == 1) {
+		hrtimer_start(&q->coalesce_timer,
+			      ns_to_ktime((u64)usecs * NSEC_PER_USEC),
+			      HRTIMER_MODE_REL_PINNED);
+	}
+}
+
+/* Interrupt affinity */
+
+static void vl_kick_work(struct irq_work *work)
+{
+	struct virtio_lo_vq *q =
+		container_of(work, struct virtio_lo_vq, kick_work);
+
+	rcu_read_lock();
+	vl_coalesce_kick(q->driver, q->qidx);
+	rcu_read_unlock();
+}
+
+/* the CPU set by the backend takes precedence over the driver affinity */
+static int vl_kick_cpu(struct virtio_lo_driver *vl_driv, unsigned qidx)
+{
+	int cpu = READ_ONCE(vl_driv->device->queues[qidx].irq_cpu);
+
+	if (cpu < 0) {
+		cpu = READ_ONCE(vl_driv->queues[qidx].cpu);
+	}
+	if (cpu < 0 || !cpu_online(cpu)) {
+		return -1;
+	}
+	return cpu;
+}
+
+/* completes the round trip started by the last notification, whether the
+ * device kicked or the poller saw the used index move */
+static void vl_rtt_stats(struct virtio_lo_vq_stats *stats)
+{
+	u64 start;
+
+	if (!atomic64_read(&stats->notify_ns)) {
+		return;
+	}
+	start = atomic64_xchg(&stats->notify_ns, 0);
+	if (start) {
+		u64 ns = ktime_get_ns() - start;
+		unsigned bucket = ns ? ilog2(ns) : 0;
+
+		atomic64_inc(&stats->rtt[min(bucket,
+					     VIRTIO_LO_RTT_BUCKETS - 1U)]);
+	}
+}
+
+static void vl_kick_stats(struct virtio_lo_vq_stats *stats)
+{
+	atomic64_inc(&stats->kicks);
+	vl_rtt_stats(stats);
+}
+
+/* called under rcu_read_lock */
+static void vl_kick(struct virtio_lo_driver *vl_driv, unsigned qidx)
+{
+	struct virtio_lo_vq *q = &vl_driv->queues[qidx];
+	int cpu = vl_kick_cpu(vl_driv, qidx);
+
+	if (trace_virtio_lo_kick_enabled()) {
+		trace_virtio_lo_kick(vl_driv->device->idx, qidx,
+				     vl_trace_used(READ_ONCE(q->vq)));
+	}
+	vl_kick_stats(&vl_driv->device->queues[qidx].stats);
+
+	/* a kick already queued on the CPU covers this one */
+	if (cpu >= 0 && cpu != raw_smp_processor_id()) {
+		irq_work_queue_on(&q->kick_work, cpu);
+		return;
+	}
+	vl_coalesce_kick(vl_driv, qidx);
+}
+
+static void vl_set_affinity(struct virtio_lo_vq *q, const struct cpumask *mask)
+{
+	unsigned cpu;
+
+	if (!mask) {
+		cpumask_clear(&q->affinity);
+		WRITE_ONCE(q->cpu, -1);
+		return;
+	}
+	cpumask_copy(&q->affinity, mask);
+	cpu = cpumask_any_and(mask, cpu_online_mask);
+	WRITE_ONCE(q->cpu, cpu < nr_cpu_ids ? cpu : -1);
+}
+
+/* Waits for the kicks in flight and drops the pending ones */
+static void vl_kick_cancel(struct virtio_lo_driver *vl_driv)
+{
+	unsigned i;
+
+	for (i = 0; i < vl_driv->device->nqueues; i++) {
+		irq_work_sync(&vl_driv->queues[i].kick_work);
+		hrtimer_cancel(&vl_driv->queues[i].coalesce_timer);
+		atomic_set(&vl_driv->queues[i].coalesce_pending, 0);
+	}
+}
+
+void virtio_lo_kick_driver(struct virtio_lo_device *dev, int qidx)
+{
+	struct virtio_lo_driver *vl_driv = READ_ONCE(dev->driver);
+
+	if (!vl_driv) {
+		return;
+	}
+	rcu_read_lock();
 	if (qidx >= 0) {
-		vring_interrupt(0, vl_driv->queues[qidx]);
+		vl_kick(vl_driv, qidx);
 	} else {
 		struct virtio_lo_device *vl_dev = vl_driv->device;
 		unsigned i;
 		for (i = 0; i < vl_dev->nqueues; i++) {
-			vring_interrupt(0, vl_driv->queues[i]);
+			vl_kick(vl_driv, i);
 		}
 	}
+	rcu_read_unlock();
 }
 
-void virtio_lo_config_driver(struct platform_device *pdev)
+/* Busy polling */
+
+#define VL_POLL_BUDGET 64
+
+static void vl_poll_start(struct virtio_lo_driver *vl_driv,
+			  struct virtio_lo_vq *q, unsigned qidx)
 {
-	struct virtio_lo_driver *vl_driv = platform_get_drvdata(pdev);
-	virtio_config_changed(&vl_driv->vdev);
+	struct virtio_lo_device *vl_dev = vl_driv->device;
+	u32 idle = READ_ONCE(vl_dev->queues[qidx].poll_idle_usecs);
+
+	if (!idle) {
+		return;
+	}
+	atomic64_set(&q->poll_deadline,
+		     ktime_get_ns() + (u64)idle * NSEC_PER_USEC);
+	/* pairs with the barrier in vl_poll_vq, either the poller sees the new
+	 * deadline or we see that it has stopped polling */
+	smp_mb();
+	if (!READ_ONCE(vl_dev->poll_state[qidx])) {
+		wake_up_process(vl_driv->poll_task);
+	}
+}
+
+static inline bool vl_polling(struct virtio_lo_vq *q, struct virtqueue *vq,
+			      u32 idle)
+{
+	return vq && !vl_packed(vq) && idle &&
+	       ktime_get_ns() < atomic64_read(&q->poll_deadline);
+}
+
+/* Delivers the completions since the previous call, returns their number */
+static u16 vl_poll_used(struct virtio_lo_driver *vl_driv,
+			struct virtio_lo_vq *q, struct virtqueue *vq,
+			unsigned qidx)
+{
+	const struct vring *vr = virtqueue_get_vring(vq);
+	u16 used = virtio16_to_cpu(vq->vdev, READ_ONCE(vr->used->idx));
+	u16 work = used - q->poll_used;
+
+	if (work) {
+		q->poll_used = used;
+		vl_rtt_stats(&vl_driv->device->queues[qidx].stats);
+		vl_interrupt(vl_driv, qidx);
+	}
+	return work;
+}
+
+/* Returns true if the queue is still being polled */
+static bool vl_poll_vq(struct virtio_lo_driver *vl_driv, unsigned qidx,
+		       bool *yield)
+{
+	struct virtio_lo_device *vl_dev = vl_driv->device;
+	struct virtio_lo_vq_info *info = &vl_dev->queues[qidx];
+	struct virtio_lo_vq *q = &vl_driv->queues[qidx];
+	struct virtqueue *vq = READ_ONCE(q->vq);
+	u32 *state = &vl_dev->poll_state[qidx];
+	u32 idle = READ_ONCE(info->poll_idle_usecs);
+	u32 budget = READ_ONCE(info->poll_budget) ?: VL_POLL_BUDGET;
+	u16 work;
+
+	if (!vl_polling(q, vq, idle)) {
+		if (!READ_ONCE(*state)) {
+			return false;
+		}
+		/* the backend kicks again from now on, pick up the completions
+		 * it has published without a kick */
+		WRITE_ONCE(*state, 0);
+		smp_mb();
+		if (vq && !vl_packed(vq)) {
+			vl_poll_used(vl_driv, q, vq, qidx);
+		}
+		q->poll_work = 0;
+		if (!vl_polling(q, vq, idle)) {
+			return false;
+		}
+	}
+
+	if (!READ_ONCE(*state)) {
+		WRITE_ONCE(*state, 1);
+		/* the backend has to see the state before we look at the
+		 * used index */
+		smp_mb();
+	}
+	work = vl_poll_used(vl_driv, q, vq, qidx);
+	if (work) {
+		atomic64_set(&q->poll_deadline,
+			     ktime_get_ns() + (u64)idle * NSEC_PER_USEC);
+		q->poll_work += work;
+		if (q->poll_work >= budget) {
+			q->poll_work = 0;
+			*yield = true;
+		}
+	} else {
+		*yield = true;
+	}
+	return true;
+}
+
+static int vl_poll_thread(void *data)
+{
+	struct virtio_lo_driver *vl_driv = data;
+	unsigned nqueues = vl_driv->device->nqueues;
+
+	while (!kthread_should_stop()) {
+		bool polling = false, yield = false;
+		unsigned i;
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		rcu_read_lock();
+		for (i = 0; i < nqueues; i++) {
+			if (vl_poll_vq(vl_driv, i, &yield)) {
+				polling = true;
+			}
+		}
+		rcu_read_unlock();
+
+		if (!polling) {
+			schedule();
+			continue;
+		}
+		__set_current_state(TASK_RUNNING);
+		/* keep the CPU while the queues make progress within the
+		 * budget */
+		if (yield) {
+			cond_resched();
+		}
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+void virtio_lo_config_driver(struct virtio_lo_device *dev)
+{
+	struct virtio_lo_driver *vl_driv = READ_ONCE(dev->driver);
+
+	if (vl_driv) {
+		virtio_config_changed(&vl_driv->vdev);
+	}
 }
 
 static void vl_del_vqs(struct virtio_device *vdev)
 {
 	struct virtio_lo_driver *vl_driver = to_virtio_lo_driver(vdev);
 	struct virtio_lo_device *vl_dev = vl_driver->device;
+	struct virtqueue *vq, *n;
 	unsigned i;
 
-	dev_notice(&vdev->dev, "deleting queues");
+	dev_dbg(&vdev->dev, "deleting queues");
 
 	for (i = 0; i < vl_dev->nqueues; i++) {
-		struct virtqueue *vq = vl_driver->queues[i];
+		if (vl_driver->queues[i].vq) {
+			virtio_lo_del_queue(vl_dev, i);
+		}
+		WRITE_ONCE(vl_driver->queues[i].vq, NULL);
+	}
+	/* wait for the interrupts that could still see the queues */
+	synchronize_rcu();
+	vl_kick_cancel(vl_driver);
+
+	list_for_each_entry_safe (vq, n, &vdev->vqs, list) {
 		vring_del_virtqueue(vq);
 	}
+	/* the buffers still mapped are going away together with the queues */
+	virtio_lo_window_reset(vl_dev);
 }
 
 static struct virtqueue *vl_setup_vq(struct virtio_device *vdev, unsigned index,
@@ -193,12 +643,13 @@ static struct virtqueue *vl_setup_vq(struct virtio_device *vdev, unsigned index,
 
 	if (!name)
 		return NULL;
-	if (index > vl_dev->nqueues)
+	if (index >= vl_dev->nqueues)
 		return NULL;
 	info = &vl_dev->queues[index];
-	dev_notice(&vdev->dev, "creating queue %d", index);
+	dev_dbg(&vdev->dev, "creating queue %d", index);
 
-	/* Create the vring */
+	/* Create the vring, it is packed if VIRTIO_F_RING_PACKED has been
+	 * negotiated */
 	vq = vring_create_virtqueue(index, info->maxsize, VIRTIO_LO_VRING_ALIGN,
 				    vdev, true, true, ctx, vl_notify, callback,
 				    name);
@@ -215,6 +666,16 @@ static struct virtqueue *vl_setup_vq(struct virtio_device *vdev, unsigned index,
 	return vq;
 }
 
+static struct vring_packed_desc_event *vl_driver_event(struct virtqueue *vq)
+{
+	/* without the DMA API the ring addresses are physical */
+	if (!vl_packed(vq) ||
+	    virtio_has_feature(vq->vdev, VIRTIO_F_ACCESS_PLATFORM)) {
+		return NULL;
+	}
+	return phys_to_virt(virtqueue_get_avail_addr(vq));
+}
+
 static int vl_find_vqs(struct virtio_device *vdev, unsigned nvqs,
 		       struct virtqueue *vqs[], vq_callback_t *callbacks[],
 		       const char *const names[], const bool *ctx,
@@ -230,17 +691,78 @@ static int vl_find_vqs(struct virtio_device *vdev, unsigned nvqs,
 			vl_del_vqs(vdev);
 			return PTR_ERR(vqs[i]);
 		}
-		vl_driver->queues[i] = vqs[i];
+		/* the driver does not want this queue */
+		if (!vqs[i]) {
+			continue;
+		}
+		vl_driver->queues[i].notified_avail = 0;
+		vl_driver->queues[i].signalled_used_valid = false;
+		vl_driver->queues[i].poll_used = 0;
+		vl_driver->queues[i].poll_work = 0;
+		atomic64_set(&vl_driver->queues[i].poll_deadline, 0);
+		vl_driver->queues[i].driver_event = vl_driver_event(vqs[i]);
+		vl_set_affinity(&vl_driver->queues[i], NULL);
+		WRITE_ONCE(vl_driver->queues[i].vq, vqs[i]);
+	}
+
+	/* spread the queues between the pre and post vectors over the CPUs,
+	 * like the interrupts of a PCI device would be */
+	if (desc && desc->pre_vectors + desc->post_vectors < nvqs) {
+		unsigned first = desc->pre_vectors;
+		unsigned last = nvqs - desc->post_vectors;
+
+		for (i = first; i < last; i++) {
+			int cpu = cpumask_local_spread(i - first,
+						       dev_to_node(&vdev->dev));
+
+			vl_set_affinity(&vl_driver->queues[i], cpumask_of(cpu));
+		}
 	}
 
 	return 0;
 }
 
-static const char *vl_bus_name(struct virtio_device *vdev)
+static int vl_set_vq_affinity(struct virtqueue *vq,
+			      const struct cpumask *cpu_mask)
+{
+	struct virtio_lo_driver *vl_driver = to_virtio_lo_driver(vq->vdev);
+
+	vl_set_affinity(&vl_driver->queues[vq->index], cpu_mask);
+	return 0;
+}
+
+static const struct cpumask *vl_get_vq_affinity(struct virtio_device *vdev,
+						int index)
 {
 	struct virtio_lo_driver *vl_driver = to_virtio_lo_driver(vdev);
+	struct virtio_lo_vq *q = &vl_driver->queues[index];
+
+	if (cpumask_empty(&q->affinity)) {
+		return NULL;
+	}
+	return &q->affinity;
+}
 
-	return vl_driver->pdev->name;
+/* the platform device, or the shared parent of direct devices */
+static const char *vl_bus_name(struct virtio_device *vdev)
+{
+	return dev_name(vdev->dev.parent);
+}
+
+static bool vl_get_shm_region(struct virtio_device *vdev,
+			      struct virtio_shm_region *region, u8 id)
+{
+	struct virtio_lo_device *vl_dev = to_virtio_lo_device(vdev);
+	unsigned i;
+
+	for (i = 0; i < vl_dev->nshm; i++) {
+		if (vl_dev->shm[i].id == id) {
+			region->addr = vl_dev->shm[i].addr;
+			region->len = vl_dev->shm[i].len;
+			return true;
+		}
+	}
+	return false;
 }
 
 static const struct virtio_config_ops virtio_lo_config_ops = {
@@ -255,18 +777,136 @@ static const struct virtio_config_ops virtio_lo_config_ops = {
 	.get_features = vl_get_features,
 	.finalize_features = vl_finalize_features,
 	.bus_name = vl_bus_name,
+	.get_shm_region = vl_get_shm_region,
+	.set_vq_affinity = vl_set_vq_affinity,
+	.get_vq_affinity = vl_get_vq_affinity,
 };
 
 static void virtio_lo_release_dev_empty(struct device *_d)
 {
 }
 
+/* Driver part */
+
+static struct virtio_lo_driver *vl_driver_create(struct virtio_lo_device *device,
+						 struct device *parent)
+{
+	struct virtio_lo_driver *vl_driv;
+	unsigned i;
+
+	vl_driv = kzalloc(sizeof(*vl_driv), GFP_KERNEL);
+	if (!vl_driv) {
+		return NULL;
+	}
+	vl_driv->queues = kcalloc(device->nqueues, sizeof(*vl_driv->queues),
+				  GFP_KERNEL);
+	if (!vl_driv->queues) {
+		kfree(vl_driv);
+		return NULL;
+	}
+
+	vl_driv->device = device;
+
+#ifdef CONFIG_VIRTIO_LO_DEVICE_INDEX
+	vl_driv->vdev.card_index = device->card_index;
+#endif /* CONFIG_VIRTIO_LO_DEVICE_INDEX */
+	vl_driv->vdev.dev.parent = parent;
+	vl_driv->vdev.dev.release = virtio_lo_release_dev_empty;
+	vl_driv->vdev.config = &virtio_lo_config_ops;
+	vl_driv->vdev.id.device = device->device_id;
+	vl_driv->vdev.id.vendor = device->vendor_id;
+	for (i = 0; i < device->nqueues; i++) {
+		struct virtio_lo_vq *q = &vl_driv->queues[i];
+
+		q->driver = vl_driv;
+		q->qidx = i;
+		hrtimer_init(&q->coalesce_timer, CLOCK_MONOTONIC,
+			     HRTIMER_MODE_REL);
+		q->coalesce_timer.function = vl_coalesce_timer;
+		q->cpu = -1;
+		init_irq_work(&q->kick_work, vl_kick_work);
+	}
+	return vl_driv;
+}
+
+static void vl_driver_free(struct virtio_lo_driver *vl_driv)
+{
+	kfree(vl_driv->queues);
+	kfree(vl_driv);
+}
+
+static int vl_driver_register(struct virtio_lo_driver *vl_driv)
+{
+	struct virtio_lo_device *device = vl_driv->device;
+	int ret;
+
+	if (device->poll_state) {
+		vl_driv->poll_task = kthread_run(vl_poll_thread, vl_driv,
+						 "virtio-lo-poll/%u",
+						 device->idx);
+		if (IS_ERR(vl_driv->poll_task)) {
+			dev_err(vl_driv->vdev.dev.parent,
+				"cannot start the poller");
+			return PTR_ERR(vl_driv->poll_task);
+		}
+	}
+
+	/* the device kicks the driver part through it */
+	WRITE_ONCE(device->driver, vl_driv);
+	ret = register_virtio_device(&vl_driv->vdev);
+	if (ret) {
+		WRITE_ONCE(device->driver, NULL);
+		if (vl_driv->poll_task) {
+			kthread_stop(vl_driv->poll_task);
+		}
+		vl_kick_cancel(vl_driv);
+	}
+	return ret;
+}
+
+static void vl_driver_unregister(struct virtio_lo_driver *vl_driv)
+{
+	unregister_virtio_device(&vl_driv->vdev);
+	/* the queues are gone, nothing wakes the poller any more */
+	if (vl_driv->poll_task) {
+		kthread_stop(vl_driv->poll_task);
+	}
+	/* the device has stopped kicking before it was unregistered */
+	vl_kick_cancel(vl_driv);
+	WRITE_ONCE(vl_driv->device->driver, NULL);
+}
+
+int virtio_lo_driver_add(struct virtio_lo_device *dev, struct device *parent)
+{
+	struct virtio_lo_driver *vl_driv;
+	int ret;
+
+	vl_driv = vl_driver_create(dev, parent);
+	if (!vl_driv) {
+		return -ENOMEM;
+	}
+	ret = vl_driver_register(vl_driv);
+	if (ret) {
+		vl_driver_free(vl_driv);
+	}
+	return ret;
+}
+
+void virtio_lo_driver_remove(struct virtio_lo_device *dev)
+{
+	struct virtio_lo_driver *vl_driv = dev->driver;
+
+	vl_driver_unregister(vl_driv);
+	vl_driver_free(vl_driv);
+}
+
 /* Platform device */
 
 static int virtio_lo_probe(struct platform_device *pdev)
 {
 	struct virtio_lo_driver *vl_driv;
 	struct virtio_lo_device *device;
+	int ret;
 
 	device = *(struct virtio_lo_device **)dev_get_platdata(&pdev->dev);
 	if (!device) {
@@ -275,43 +915,46 @@ static int virtio_lo_probe(struct platform_device *pdev)
 		return -EINVAL;
 	}
 
-	vl_driv = devm_kzalloc(&pdev->dev, sizeof(*vl_driv), GFP_KERNEL);
+	vl_driv = vl_driver_create(device, &pdev->dev);
 	if (!vl_driv) {
 		dev_err(&pdev->dev, "no memory");
 		return -ENOMEM;
 	}
-
-	vl_driv->device = device;
 	vl_driv->pdev = pdev;
 
-#ifdef CONFIG_VIRTIO_LO_DEVICE_INDEX
-	vl_driv->vdev.card_index = device->card_index;
-#endif /* CONFIG_VIRTIO_LO_DEVICE_INDEX */
-	vl_driv->vdev.dev.parent = &pdev->dev;
-	vl_driv->vdev.dev.release = virtio_lo_release_dev_empty;
-	vl_driv->vdev.config = &virtio_lo_config_ops;
-	vl_driv->pdev = pdev;
-	vl_driv->queues = devm_kcalloc(&pdev->dev, device->nqueues,
-				       sizeof(struct virtqueue), GFP_KERNEL);
-	if (!vl_driv->queues) {
-		dev_err(&pdev->dev, "no memory");
-		return -ENOMEM;
+	if (device->pool) {
+		ret = virtio_lo_pool_setup_dma(&pdev->dev);
+		if (ret) {
+			dev_err(&pdev->dev, "cannot use the buffer pool");
+			goto err_free;
+		}
+	} else if (device->window_enabled) {
+		ret = virtio_lo_window_setup_dma(&pdev->dev);
+		if (ret) {
+			dev_err(&pdev->dev, "cannot use the memory window");
+			goto err_free;
+		}
 	}
 
-	vl_driv->vdev.id.device = device->device_id;
-	vl_driv->vdev.id.vendor = device->vendor_id;
 	device->pdev = pdev;
-
 	platform_set_drvdata(pdev, vl_driv);
 
-	return register_virtio_device(&vl_driv->vdev);
+	ret = vl_driver_register(vl_driv);
+	if (ret) {
+		goto err_free;
+	}
+	return 0;
+err_free:
+	vl_driver_free(vl_driv);
+	return ret;
 }
 
 static int virtio_lo_remove(struct platform_device *pdev)
 {
 	struct virtio_lo_driver *vl_driv = platform_get_drvdata(pdev);
 
-	unregister_virtio_device(&vl_driv->vdev);
+	vl_driver_unregister(vl_driv);
+	vl_driver_free(vl_driv);
 	return 0;
 }
 
@@ -329,7 +972,7 @@ static struct platform_driver virtio_lo_driver_ops = {
 	.remove = virtio_lo_remove,
 	.driver =
 		{
-			.name = "virtio-lo",
+			.name = VL_NAME,
 			.of_match_table = virtio_lo_match,
 		},
 };
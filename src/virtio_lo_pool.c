@@ -0,0 +1,337 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2022  Panasonic Automotive Systems, Co., Ltd.
+ */
+
+#include <linux/dma-map-ops.h>
+#include <linux/dma-mapping.h>
+#include <linux/err.h>
+#include <linux/genalloc.h>
+#include <linux/highmem.h>
+#include <linux/mm.h>
+#include <linux/platform_device.h>
+#include <linux/scatterlist.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#include "virtio_lo_device.h"
+#include "virtio_lo_pool.h"
+
+/* Size of a pool slot, the same as swiotlb uses */
+#define VIRTIO_LO_POOL_SHIFT 11
+#define VIRTIO_LO_POOL_SLOT (1UL << VIRTIO_LO_POOL_SHIFT)
+
+struct virtio_lo_pool {
+	void *vaddr;
+	size_t size;
+	/* the "physical" addresses of the chunk are offsets in the pool */
+	struct gen_pool *gp;
+	/* for each slot of a streaming mapping, the address of the original
+	 * buffer the slot is bounced to */
+	phys_addr_t *orig;
+};
+
+struct virtio_lo_pool *virtio_lo_pool_create(size_t size)
+{
+	struct virtio_lo_pool *pool;
+
+	if (!IS_ENABLED(CONFIG_DMA_OPS)) {
+		return ERR_PTR(-EOPNOTSUPP);
+	}
+
+	size = PAGE_ALIGN(size);
+	if (!size) {
+		return ERR_PTR(-EINVAL);
+	}
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool) {
+		return ERR_PTR(-ENOMEM);
+	}
+	pool->size = size;
+
+	pool->vaddr = vmalloc_user(size);
+	if (!pool->vaddr) {
+		goto err_pool;
+	}
+	pool->orig = kvcalloc(size >> VIRTIO_LO_POOL_SHIFT,
+			      sizeof(*pool->orig), GFP_KERNEL);
+	if (!pool->orig) {
+		goto err_vaddr;
+	}
+	pool->gp = gen_pool_create(VIRTIO_LO_POOL_SHIFT, NUMA_NO_NODE);
+	if (!pool->gp) {
+		goto err_orig;
+	}
+	if (gen_pool_add_virt(pool->gp, (unsigned long)pool->vaddr, 0, size,
+			      NUMA_NO_NODE)) {
+		goto err_gp;
+	}
+	return pool;
+
+err_gp:
+	gen_pool_destroy(pool->gp);
+err_orig:
+	kvfree(pool->orig);
+err_vaddr:
+	vfree(pool->vaddr);
+err_pool:
+	kfree(pool);
+	return ERR_PTR(-ENOMEM);
+}
+
+void virtio_lo_pool_destroy(struct virtio_lo_pool *pool)
+{
+	/* gen_pool_destroy() crashes on leaked allocations, leak the pool
+	 * bookkeeping instead */
+	if (WARN_ON(gen_pool_avail(pool->gp) != gen_pool_size(pool->gp))) {
+		return;
+	}
+	gen_pool_destroy(pool->gp);
+	kvfree(pool->orig);
+	/* pages mapped to userspace are kept until they are unmapped */
+	vfree(pool->vaddr);
+	kfree(pool);
+}
+
+int virtio_lo_pool_mmap(struct virtio_lo_pool *pool,
+			struct vm_area_struct *vma, unsigned long pgoff)
+{
+	unsigned long len = vma->vm_end - vma->vm_start;
+
+	if ((pgoff << PAGE_SHIFT) + len > pool->size) {
+		return -EINVAL;
+	}
+	return remap_vmalloc_range(vma, pool->vaddr, pgoff);
+}
+
+#ifdef CONFIG_DMA_OPS
+
+static struct virtio_lo_pool *vilo_pool(struct device *dev)
+{
+	struct virtio_lo_device *vl_dev =
+		*(struct virtio_lo_device **)dev_get_platdata(dev);
+	return vl_dev->pool;
+}
+
+static inline bool vilo_pool_valid(struct virtio_lo_pool *pool,
+				   dma_addr_t addr, size_t size)
+{
+	return addr < pool->size && size <= pool->size - addr;
+}
+
+/* Copies data between the slots starting at addr and the original buffer,
+ * one page of the original buffer at a time since it may be in highmem */
+static void vilo_pool_bounce(struct virtio_lo_pool *pool, dma_addr_t addr,
+			     size_t size, bool to_device)
+{
+	while (size) {
+		size_t slot_off = addr & (VIRTIO_LO_POOL_SLOT - 1);
+		phys_addr_t orig = pool->orig[addr >> VIRTIO_LO_POOL_SHIFT] +
+				   slot_off;
+		struct page *page = pfn_to_page(PHYS_PFN(orig));
+		size_t off = offset_in_page(orig);
+		size_t n = min_t(size_t, size, VIRTIO_LO_POOL_SLOT - slot_off);
+
+		n = min_t(size_t, n, PAGE_SIZE - off);
+		if (to_device) {
+			memcpy_from_page(pool->vaddr + addr, page, off, n);
+		} else {
+			memcpy_to_page(page, off, pool->vaddr + addr, n);
+		}
+		addr += n;
+		size -= n;
+	}
+}
+
+static void *vilo_pool_alloc(struct device *dev, size_t size,
+			     dma_addr_t *dma_handle, gfp_t gfp,
+			     unsigned long attrs)
+{
+	struct virtio_lo_pool *pool = vilo_pool(dev);
+	struct genpool_data_align align = { .align = PAGE_SIZE };
+	unsigned long va;
+
+	va = gen_pool_alloc_algo(pool->gp, size, gen_pool_first_fit_align,
+				 &align);
+	if (!va) {
+		return NULL;
+	}
+	memset((void *)va, 0, size);
+	*dma_handle = gen_pool_virt_to_phys(pool->gp, va);
+	return (void *)va;
+}
+
+static void vilo_pool_free(struct device *dev, size_t size, void *vaddr,
+			   dma_addr_t dma_handle, unsigned long attrs)
+{
+	struct virtio_lo_pool *pool = vilo_pool(dev);
+
+	gen_pool_free(pool->gp, (unsigned long)vaddr, size);
+}
+
+static dma_addr_t vilo_pool_map_page(struct device *dev, struct page *page,
+				     unsigned long offset, size_t size,
+				     enum dma_data_direction dir,
+				     unsigned long attrs)
+{
+	struct virtio_lo_pool *pool = vilo_pool(dev);
+	phys_addr_t phys = page_to_phys(page) + offset;
+	unsigned long va, i;
+	dma_addr_t addr;
+
+	va = gen_pool_alloc(pool->gp, size);
+	if (!va) {
+		dev_warn_ratelimited(dev, "buffer pool is full\n");
+		return DMA_MAPPING_ERROR;
+	}
+	addr = gen_pool_virt_to_phys(pool->gp, va);
+	for (i = 0; i < DIV_ROUND_UP(size, VIRTIO_LO_POOL_SLOT); i++) {
+		pool->orig[(addr >> VIRTIO_LO_POOL_SHIFT) + i] =
+			phys + (i << VIRTIO_LO_POOL_SHIFT);
+	}
+
+	/* like swiotlb, always copy the buffer so that the parts the device
+	 * does not write are preserved on unmap */
+	vilo_pool_bounce(pool, addr, size, true);
+	return addr;
+}
+
+static void vilo_pool_unmap_page(struct device *dev, dma_addr_t addr,
+				 size_t size, enum dma_data_direction dir,
+				 unsigned long attrs)
+{
+	struct virtio_lo_pool *pool = vilo_pool(dev);
+
+	if (WARN_ON(!vilo_pool_valid(pool, addr, size))) {
+		return;
+	}
+	if ((dir == DMA_FROM_DEVICE || dir == DMA_BIDIRECTIONAL) &&
+	    !(attrs & DMA_ATTR_SKIP_CPU_SYNC)) {
+		vilo_pool_bounce(pool, addr, size, false);
+	}
+	gen_pool_free(pool->gp, (unsigned long)pool->vaddr + addr, size);
+}
+
+static void vilo_pool_sync_single_for_cpu(struct device *dev,
+					  dma_addr_t addr, size_t size,
+					  enum dma_data_direction dir)
+{
+	struct virtio_lo_pool *pool = vilo_pool(dev);
+
+	if (WARN_ON(!vilo_pool_valid(pool, addr, size))) {
+		return;
+	}
+	if (dir == DMA_FROM_DEVICE || dir == DMA_BIDIRECTIONAL) {
+		vilo_pool_bounce(pool, addr, size, false);
+	}
+}
+
+static void vilo_pool_sync_single_for_device(struct device *dev,
+					     dma_addr_t addr, size_t size,
+					     enum dma_data_direction dir)
+{
+	struct virtio_lo_pool *pool = vilo_pool(dev);
+
+	if (WARN_ON(!vilo_pool_valid(pool, addr, size))) {
+		return;
+	}
+	if (dir == DMA_TO_DEVICE || dir == DMA_BIDIRECTIONAL) {
+		vilo_pool_bounce(pool, addr, size, true);
+	}
+}
+
+static void vilo_pool_unmap_sg(struct device *dev, struct scatterlist *sgl,
+			       int nents, enum dma_data_direction dir,
+			       unsigned long attrs)
+{
+	struct scatterlist *sg;
+	int i;
+
+	for_each_sg (sgl, sg, nents, i) {
+		vilo_pool_unmap_page(dev, sg_dma_address(sg), sg_dma_len(sg),
+				     dir, attrs);
+	}
+}
+
+static int vilo_pool_map_sg(struct device *dev, struct scatterlist *sgl,
+			    int nents, enum dma_data_direction dir,
+			    unsigned long attrs)
+{
+	struct scatterlist *sg;
+	int i;
+
+	for_each_sg (sgl, sg, nents, i) {
+		sg->dma_address = vilo_pool_map_page(dev, sg_page(sg),
+						     sg->offset, sg->length,
+						     dir, attrs);
+		if (sg->dma_address == DMA_MAPPING_ERROR) {
+			vilo_pool_unmap_sg(dev, sgl, i, dir,
+					   attrs | DMA_ATTR_SKIP_CPU_SYNC);
+			return 0;
+		}
+		sg_dma_len(sg) = sg->length;
+	}
+	return nents;
+}
+
+static void vilo_pool_sync_sg_for_cpu(struct device *dev,
+				      struct scatterlist *sgl, int nents,
+				      enum dma_data_direction dir)
+{
+	struct scatterlist *sg;
+	int i;
+
+	for_each_sg (sgl, sg, nents, i) {
+		vilo_pool_sync_single_for_cpu(dev, sg_dma_address(sg),
+					      sg_dma_len(sg), dir);
+	}
+}
+
+static void vilo_pool_sync_sg_for_device(struct device *dev,
+					 struct scatterlist *sgl, int nents,
+					 enum dma_data_direction dir)
+{
+	struct scatterlist *sg;
+	int i;
+
+	for_each_sg (sgl, sg, nents, i) {
+		vilo_pool_sync_single_for_device(dev, sg_dma_address(sg),
+						 sg_dma_len(sg), dir);
+	}
+}
+
+static const struct dma_map_ops virtio_lo_pool_dma_ops = {
+	.alloc = vilo_pool_alloc,
+	.free = vilo_pool_free,
+	.map_page = vilo_pool_map_page,
+	.unmap_page = vilo_pool_unmap_page,
+	.map_sg = vilo_pool_map_sg,
+	.unmap_sg = vilo_pool_unmap_sg,
+	.sync_single_for_cpu = vilo_pool_sync_single_for_cpu,
+	.sync_single_for_device = vilo_pool_sync_single_for_device,
+	.sync_sg_for_cpu = vilo_pool_sync_sg_for_cpu,
+	.sync_sg_for_device = vilo_pool_sync_sg_for_device,
+};
+
+int virtio_lo_pool_setup_dma(struct device *dev)
+{
+	int ret;
+
+	/* DMA addresses are offsets in the pool, any of them will do */
+	ret = dma_coerce_mask_and_coherent(dev, DMA_BIT_MASK(64));
+	if (ret) {
+		return ret;
+	}
+	set_dma_ops(dev, &virtio_lo_pool_dma_ops);
+	return 0;
+}
+
+#else /* CONFIG_DMA_OPS */
+
+int virtio_lo_pool_setup_dma(struct device *dev)
+{
+	return -EOPNOTSUPP;
+}
+
+#endif /* CONFIG_DMA_OPS */
@@ -0,0 +1,30 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2022  Panasonic Automotive Systems, Co., Ltd.
+ */
+
+#ifndef _VIRTIO_LO_POOL_H
+#define _VIRTIO_LO_POOL_H
+
+#include <linux/device.h>
+#include <linux/mm.h>
+#include <linux/types.h>
+
+/* Per-device memory pool. All the DMA of the driver part of a device is
+ * redirected to the pool (restricted DMA pool style), DMA addresses are
+ * offsets in the pool. */
+struct virtio_lo_pool;
+
+/** Allocate a pool of size bytes */
+struct virtio_lo_pool *virtio_lo_pool_create(size_t size);
+/** Free the pool, all the DMA mappings should have been released */
+void virtio_lo_pool_destroy(struct virtio_lo_pool *pool);
+
+/** Map the pool starting at page pgoff to userspace */
+int virtio_lo_pool_mmap(struct virtio_lo_pool *pool,
+			struct vm_area_struct *vma, unsigned long pgoff);
+
+/** Make the DMA API of the platform device use the pool of its device */
+int virtio_lo_pool_setup_dma(struct device *dev);
+
+#endif /* _VIRTIO_LO_POOL_H */
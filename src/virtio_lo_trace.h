@@ -0,0 +1,150 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2022  Panasonic Automotive Systems, Co., Ltd.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM virtio_lo
+
+#if !defined(_VIRTIO_LO_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _VIRTIO_LO_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* driver -> device notification, avail is 0 for packed rings */
+TRACE_EVENT(virtio_lo_notify,
+	TP_PROTO(unsigned idx, unsigned qidx, u16 avail),
+	TP_ARGS(idx, qidx, avail),
+	TP_STRUCT__entry(
+		__field(unsigned, idx)
+		__field(unsigned, qidx)
+		__field(u16, avail)
+	),
+	TP_fast_assign(
+		__entry->idx = idx;
+		__entry->qidx = qidx;
+		__entry->avail = avail;
+	),
+	TP_printk("dev=%u vq=%u avail=%u", __entry->idx, __entry->qidx,
+		  __entry->avail)
+);
+
+/* device -> driver kick, before moderation and steering */
+TRACE_EVENT(virtio_lo_kick,
+	TP_PROTO(unsigned idx, unsigned qidx, u16 used),
+	TP_ARGS(idx, qidx, used),
+	TP_STRUCT__entry(
+		__field(unsigned, idx)
+		__field(unsigned, qidx)
+		__field(u16, used)
+	),
+	TP_fast_assign(
+		__entry->idx = idx;
+		__entry->qidx = qidx;
+		__entry->used = used;
+	),
+	TP_printk("dev=%u vq=%u used=%u", __entry->idx, __entry->qidx,
+		  __entry->used)
+);
+
+/* interrupt of the driver, used is 0 for packed rings */
+TRACE_EVENT(virtio_lo_interrupt,
+	TP_PROTO(unsigned idx, unsigned qidx, u16 used, bool delivered),
+	TP_ARGS(idx, qidx, used, delivered),
+	TP_STRUCT__entry(
+		__field(unsigned, idx)
+		__field(unsigned, qidx)
+		__field(u16, used)
+		__field(bool, delivered)
+	),
+	TP_fast_assign(
+		__entry->idx = idx;
+		__entry->qidx = qidx;
+		__entry->used = used;
+		__entry->delivered = delivered;
+	),
+	TP_printk("dev=%u vq=%u used=%u %s", __entry->idx, __entry->qidx,
+		  __entry->used,
+		  __entry->delivered ? "delivered" : "suppressed")
+);
+
+DECLARE_EVENT_CLASS(virtio_lo_config,
+	TP_PROTO(unsigned idx, unsigned offset, unsigned len),
+	TP_ARGS(idx, offset, len),
+	TP_STRUCT__entry(
+		__field(unsigned, idx)
+		__field(unsigned, offset)
+		__field(unsigned, len)
+	),
+	TP_fast_assign(
+		__entry->idx = idx;
+		__entry->offset = offset;
+		__entry->len = len;
+	),
+	TP_printk("dev=%u offset=%u len=%u", __entry->idx, __entry->offset,
+		  __entry->len)
+);
+
+DEFINE_EVENT(virtio_lo_config, virtio_lo_config_get,
+	TP_PROTO(unsigned idx, unsigned offset, unsigned len),
+	TP_ARGS(idx, offset, len)
+);
+
+DEFINE_EVENT(virtio_lo_config, virtio_lo_config_set,
+	TP_PROTO(unsigned idx, unsigned offset, unsigned len),
+	TP_ARGS(idx, offset, len)
+);
+
+/* status written by the driver, 0 on reset */
+TRACE_EVENT(virtio_lo_status,
+	TP_PROTO(unsigned idx, u8 status),
+	TP_ARGS(idx, status),
+	TP_STRUCT__entry(
+		__field(unsigned, idx)
+		__field(u8, status)
+	),
+	TP_fast_assign(
+		__entry->idx = idx;
+		__entry->status = status;
+	),
+	TP_printk("dev=%u status=0x%x", __entry->idx, __entry->status)
+);
+
+TRACE_EVENT(virtio_lo_device_add,
+	TP_PROTO(unsigned idx, u32 device_id, unsigned nqueues),
+	TP_ARGS(idx, device_id, nqueues),
+	TP_STRUCT__entry(
+		__field(unsigned, idx)
+		__field(u32, device_id)
+		__field(unsigned, nqueues)
+	),
+	TP_fast_assign(
+		__entry->idx = idx;
+		__entry->device_id = device_id;
+		__entry->nqueues = nqueues;
+	),
+	TP_printk("dev=%u id=%u nqueues=%u", __entry->idx,
+		  __entry->device_id, __entry->nqueues)
+);
+
+TRACE_EVENT(virtio_lo_device_remove,
+	TP_PROTO(unsigned idx),
+	TP_ARGS(idx),
+	TP_STRUCT__entry(
+		__field(unsigned, idx)
+	),
+	TP_fast_assign(
+		__entry->idx = idx;
+	),
+	TP_printk("dev=%u", __entry->idx)
+);
+
+#endif /* _VIRTIO_LO_TRACE_H */
+
+/* the module is built with -I$(src) */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE virtio_lo_trace
+
+#include <trace/define_trace.h>